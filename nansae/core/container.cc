@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/container.h"
+#include "nansae/core/stream_binary_io.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+namespace NSL {
+#ifndef __SSE4_2__
+/**
+ * The lookup table of the bytewise CRC-32C, for the reflected polynomial
+ * 0x82f63b78.
+ */
+struct Crc32cTable {
+  uint32_t entries[256];
+
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      }
+      entries[i] = crc;
+    }
+  }
+};
+#endif
+
+uint32_t Crc32c(const char* data, size_t size, uint32_t crc) {
+  crc = ~crc;
+#ifdef __SSE4_2__
+  for (; size >= 8; size -= 8, data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, 8);
+    crc = (uint32_t)_mm_crc32_u64(crc, word);
+  }
+  for (; size > 0; size--) crc = _mm_crc32_u8(crc, *data++);
+#else
+  static const Crc32cTable table;
+  for (; size > 0; size--) {
+    crc = (crc >> 8) ^ table.entries[(crc ^ (uint8_t)*data++) & 0xff];
+  }
+#endif
+  return ~crc;
+}
+
+/**
+ * The header is [magic][u32 version][u32 endianness][u32 page size]
+ * [u32 sections][u64 table offset][u64 table size][u32 crc][u32 reserved],
+ * the crc covers the header up to it and the section table. The table holds
+ * [u32 name size][name][u64 offset][u64 size][u32 crc] per section.
+ */
+static const char Magic[8] = {'N', 'S', 'L', 'C', 'N', 'T', 'R', '\0'};
+static const uint32_t EndiannessMarker = 0x01020304;
+static const size_t HeaderSize = 48;
+static const size_t HeaderCrcOffset = 40;
+
+static inline uint64_t alignToPage(uint64_t offset) {
+  return (offset + Container::PageSize - 1) / Container::PageSize *
+         Container::PageSize;
+}
+
+void ContainerWriter::addSection(const std::string& name, std::string data) {
+  for (const Section& section : _sections) {
+    if (section.name == name) {
+      throw std::invalid_argument("The container already has a section " +
+                                  name + ".");
+    }
+  }
+  _sections.push_back({name, std::move(data)});
+}
+
+void ContainerWriter::writeToStream(std::ostream& os) {
+  std::ostringstream tableStream;
+  uint64_t offset;
+  {
+    StreamBinaryWriter table(tableStream);
+    uint64_t tableSize = 0;
+    for (const Section& section : _sections) {
+      tableSize += 4 + section.name.size() + 8 + 8 + 4;
+    }
+
+    offset = alignToPage(HeaderSize + tableSize);
+    for (const Section& section : _sections) {
+      table.write<uint32_t>(section.name.size());
+      table.writeBytes(section.name.data(), section.name.size());
+      table.write<uint64_t>(offset);
+      table.write<uint64_t>(section.data.size());
+      table.write<uint32_t>(Crc32c(section.data.data(), section.data.size()));
+      offset = alignToPage(offset + section.data.size());
+    }
+    table.flush();
+  }
+  std::string table = tableStream.str();
+
+  std::ostringstream headerStream;
+  {
+    StreamBinaryWriter header(headerStream);
+    header.writeBytes(Magic, sizeof(Magic));
+    header.write<uint32_t>(Container::Version);
+    header.write<uint32_t>(EndiannessMarker);
+    header.write<uint32_t>(Container::PageSize);
+    header.write<uint32_t>(_sections.size());
+    header.write<uint64_t>(HeaderSize);
+    header.write<uint64_t>(table.size());
+    header.flush();
+  }
+  std::string header = headerStream.str();
+  uint32_t crc = Crc32c(table.data(), table.size(),
+                        Crc32c(header.data(), header.size()));
+
+  StreamBinaryWriter writer(os);
+  writer.writeBytes(header.data(), header.size());
+  writer.write<uint32_t>(crc);
+  writer.write<uint32_t>(0);
+  writer.writeBytes(table.data(), table.size());
+
+  const std::string padding(Container::PageSize, '\0');
+  uint64_t written = HeaderSize + table.size();
+  for (const Section& section : _sections) {
+    writer.writeBytes(padding.data(), alignToPage(written) - written);
+    writer.writeBytes(section.data.data(), section.data.size());
+    written = alignToPage(written) + section.data.size();
+  }
+  writer.flush();
+}
+
+void ContainerWriter::writeToFile(const std::string& path) {
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  if (!os) throw std::runtime_error("Can't open " + path + " for writing.");
+  this->writeToStream(os);
+}
+
+template <typename T>
+static inline T readLittleEndian(const char* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  SwapLittleEndian(&value, 1);
+  return value;
+}
+
+Container::Container(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Can't open " + path + ".");
+
+  struct stat status;
+  if (::fstat(fd, &status) != 0 || status.st_size == 0) {
+    ::close(fd);
+    throw std::runtime_error("Can't read " + path + ".");
+  }
+  void* data = ::mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) throw std::runtime_error("Can't map " + path + ".");
+
+  _data = (const char*)data;
+  _size = status.st_size;
+  _mapped = true;
+  try {
+    this->parse();
+  } catch (...) {
+    this->release();
+    throw;
+  }
+}
+
+Container::Container(std::istream& is) {
+  std::ostringstream os;
+  os << is.rdbuf();
+  _buffer = os.str();
+  _data = _buffer.data();
+  _size = _buffer.size();
+  this->parse();
+}
+
+Container::Container(Container&& other)
+    : _data(other._data),
+      _size(other._size),
+      _mapped(other._mapped),
+      _buffer(std::move(other._buffer)),
+      _sections(std::move(other._sections)) {
+  if (!_mapped) _data = _buffer.data();
+  other._data = nullptr;
+  other._size = 0;
+  other._mapped = false;
+}
+
+Container::~Container() { this->release(); }
+
+void Container::release() {
+  if (_mapped) ::munmap(const_cast<char*>(_data), _size);
+  _data = nullptr;
+  _mapped = false;
+}
+
+void Container::parse() {
+  if (_size < HeaderSize || std::memcmp(_data, Magic, sizeof(Magic)) != 0) {
+    throw std::runtime_error("Not an NSL::Container.");
+  }
+  if (readLittleEndian<uint32_t>(_data + 12) != EndiannessMarker) {
+    throw std::runtime_error("The NSL::Container has a foreign byte order.");
+  }
+  if (readLittleEndian<uint32_t>(_data + 8) > Version) {
+    throw std::runtime_error("The NSL::Container version isn't supported.");
+  }
+
+  uint32_t sectionsNo = readLittleEndian<uint32_t>(_data + 20);
+  uint64_t tableOffset = readLittleEndian<uint64_t>(_data + 24);
+  uint64_t tableSize = readLittleEndian<uint64_t>(_data + 32);
+  if (tableOffset < HeaderSize || tableOffset > _size ||
+      tableSize > _size - tableOffset) {
+    throw std::runtime_error("The NSL::Container section table is corrupt.");
+  }
+  uint32_t crc = Crc32c(_data + tableOffset, tableSize,
+                        Crc32c(_data, HeaderCrcOffset));
+  if (crc != readLittleEndian<uint32_t>(_data + HeaderCrcOffset)) {
+    throw std::runtime_error("The NSL::Container header checksum mismatch.");
+  }
+
+  const char* pos = _data + tableOffset;
+  const char* end = pos + tableSize;
+  for (uint32_t i = 0; i < sectionsNo; i++) {
+    if (end - pos < 4) break;
+    uint32_t nameSize = readLittleEndian<uint32_t>(pos);
+    pos += 4;
+    if ((uint64_t)(end - pos) < nameSize + 20ull) break;
+
+    SectionEntry entry;
+    entry.name.assign(pos, nameSize);
+    pos += nameSize;
+    entry.offset = readLittleEndian<uint64_t>(pos);
+    entry.size = readLittleEndian<uint64_t>(pos + 8);
+    entry.crc = readLittleEndian<uint32_t>(pos + 16);
+    entry.validated = false;
+    pos += 20;
+    if (entry.offset > _size || entry.size > _size - entry.offset) break;
+    _sections.push_back(entry);
+  }
+  if (_sections.size() != sectionsNo) {
+    throw std::runtime_error("The NSL::Container section table is corrupt.");
+  }
+}
+
+bool Container::has(const std::string& name) const {
+  for (const SectionEntry& entry : _sections) {
+    if (entry.name == name) return true;
+  }
+  return false;
+}
+
+std::vector<std::string> Container::sectionNames() const {
+  std::vector<std::string> names;
+  for (const SectionEntry& entry : _sections) names.push_back(entry.name);
+  return names;
+}
+
+Container::Section Container::section(const std::string& name) {
+  for (SectionEntry& entry : _sections) {
+    if (entry.name != name) continue;
+
+    const char* data = _data + entry.offset;
+    if (!entry.validated) {
+      if (Crc32c(data, entry.size) != entry.crc) {
+        throw std::runtime_error("The checksum of the NSL::Container section " +
+                                 name + " doesn't match.");
+      }
+      entry.validated = true;
+    }
+    return {data, entry.size};
+  }
+  throw std::out_of_range("The NSL::Container has no section " + name + ".");
+}
+
+std::streambuf::pos_type Container::SectionBuffer::seekoff(
+    off_type offset, std::ios_base::seekdir dir,
+    std::ios_base::openmode which) {
+  char* position;
+  if (dir == std::ios_base::beg) {
+    position = this->eback() + offset;
+  } else if (dir == std::ios_base::cur) {
+    position = this->gptr() + offset;
+  } else {
+    position = this->egptr() + offset;
+  }
+  if (!(which & std::ios_base::in) || position < this->eback() ||
+      position > this->egptr()) {
+    return pos_type(off_type(-1));
+  }
+  this->setg(this->eback(), position, this->egptr());
+  return pos_type(position - this->eback());
+}
+}
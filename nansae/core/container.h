@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NSL_CONTAINER_H
+#define NSL_CONTAINER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace NSL {
+/**
+ * Computes the CRC-32C (Castagnoli) checksum of the data.
+ * \param data The data.
+ * \param size The size of the data in bytes.
+ * \param crc The checksum of the preceding data, to checksum in parts.
+ */
+uint32_t Crc32c(const char* data, size_t size, uint32_t crc = 0);
+
+/**
+ * Writes a container, a single file holding named sections such as a trie,
+ * hash tables and metadata.
+ *
+ * The file starts with a header holding the magic "NSLCNTR\0", the format
+ * version, an endianness marker and the location of the section table,
+ * followed by the section table itself. Every section starts at a multiple
+ * of the page size and has its own CRC-32C, the header and the section
+ * table share one more. Everything is little endian.
+ */
+class ContainerWriter {
+ private:
+  struct Section {
+    std::string name;
+    std::string data;
+  };
+
+  std::vector<Section> _sections;
+
+ public:
+  /**
+   * Adds a section holding the given bytes.
+   * \throws std::invalid_argument if a section of the same name exists.
+   */
+  void addSection(const std::string& name, std::string data);
+
+  /**
+   * Adds a section holding an object serialized by its writeToStream.
+   */
+  template <typename Serializable>
+  void add(const std::string& name, Serializable& object) {
+    std::ostringstream os;
+    object.writeToStream(os);
+    this->addSection(name, os.str());
+  }
+
+  void writeToStream(std::ostream& os);
+
+  /**
+   * \throws std::runtime_error if the file can't be written.
+   */
+  void writeToFile(const std::string& path);
+};
+
+/**
+ * Reads a container written by NSL::ContainerWriter.
+ * Files are memory mapped and only the header and the section table are
+ * checked when opening; the checksum of a section is verified the first
+ * time it is accessed. Sections start at page boundaries of the mapping,
+ * so flat images such as NSL::PerfectHashTable can be used in place.
+ */
+class Container {
+ public:
+  struct Section {
+    const char* data;
+    uint64_t size;
+  };
+
+  static const uint32_t Version = 1;
+  static const uint32_t PageSize = 4096;
+
+ private:
+  struct SectionEntry {
+    std::string name;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t crc;
+    bool validated;
+  };
+
+  /**
+   * Reads a section in place.
+   */
+  class SectionBuffer : public std::streambuf {
+   public:
+    SectionBuffer(const char* data, uint64_t size) {
+      char* begin = const_cast<char*>(data);
+      this->setg(begin, begin, begin + size);
+    }
+
+   protected:
+    pos_type seekoff(off_type offset, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type position,
+                     std::ios_base::openmode which) override {
+      return this->seekoff(position, std::ios_base::beg, which);
+    }
+  };
+
+  const char* _data = nullptr;
+  uint64_t _size = 0;
+  bool _mapped = false;
+  std::string _buffer;
+  std::vector<SectionEntry> _sections;
+
+  void parse();
+  void release();
+
+ public:
+  /**
+   * Memory maps a container file.
+   * \throws std::runtime_error if the file can't be mapped or its header or
+   * section table is corrupt.
+   */
+  explicit Container(const std::string& path);
+
+  /**
+   * Reads a whole container from a stream into memory.
+   * \throws std::runtime_error as above.
+   */
+  explicit Container(std::istream& is);
+
+  ~Container();
+
+  Container(const Container&) = delete;
+  Container(Container&& other);
+
+  bool has(const std::string& name) const;
+  std::vector<std::string> sectionNames() const;
+
+  /**
+   * Returns a section after verifying its checksum.
+   * \throws std::out_of_range for unknown sections.
+   * \throws std::runtime_error if the checksum doesn't match.
+   */
+  Section section(const std::string& name);
+
+  /**
+   * Loads an object from a section through its loadFromStream.
+   */
+  template <typename Serializable>
+  void load(const std::string& name, Serializable& object) {
+    Section s = this->section(name);
+    SectionBuffer buffer(s.data, s.size);
+    std::istream is(&buffer);
+    object.loadFromStream(is);
+  }
+};
+}
+#endif  // NSL_CONTAINER_H
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/container.h"
+#include "nansae/core/hash_table.h"
+#include "nansae/core/perfect_hash_table.h"
+#include "nansae/core/trie.h"
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+TEST(Container, crc32c) {
+  ASSERT_EQ(NSL::Crc32c("123456789", 9), 0xe3069283);
+  ASSERT_EQ(NSL::Crc32c("56789", 5, NSL::Crc32c("1234", 4)), 0xe3069283);
+}
+
+TEST(Container, sections) {
+  NSL::Trie trie;
+  trie.addWord(NSL::String(u8"빨간"), 1);
+  trie.addWord(NSL::String(u8"파란"), 2);
+  trie.freeze();
+
+  NSL::HashTable<uint32_t> weights(16);
+  NSL::HashTable<uint64_t, float> features(16);
+  for (uint32_t i = 0; i < 1000; i++) {
+    weights.insert(i, i * .5);
+    features.insert(i * 11, i);
+  }
+  NSL::PerfectHashTable<uint32_t> perfect(weights);
+
+  NSL::ContainerWriter writer;
+  writer.add("trie", trie);
+  writer.add("weights", weights);
+  writer.add("features", features);
+  writer.add("perfect", perfect);
+  writer.addSection("metadata", "epochs=5");
+  ASSERT_THROW(writer.addSection("trie", ""), std::invalid_argument);
+
+  char path[] = "/tmp/nsl_container_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  writer.writeToFile(path);
+
+  NSL::Container container(path);
+  ASSERT_EQ(container.sectionNames().size(), 5);
+  ASSERT_TRUE(container.has("weights"));
+  ASSERT_FALSE(container.has("missing"));
+  ASSERT_THROW(container.section("missing"), std::out_of_range);
+
+  NSL::Container::Section metadata = container.section("metadata");
+  ASSERT_EQ(std::string(metadata.data, metadata.size), "epochs=5");
+
+  NSL::Trie loadedTrie;
+  loadedTrie.freeze();
+  container.load("trie", loadedTrie);
+  ASSERT_EQ(loadedTrie.findWord(NSL::String(u8"파란")), 2);
+
+  NSL::HashTable<uint32_t> loadedWeights;
+  NSL::HashTable<uint64_t, float> loadedFeatures;
+  container.load("weights", loadedWeights);
+  container.load("features", loadedFeatures);
+  ASSERT_EQ(loadedWeights.size(), 1000);
+  ASSERT_EQ(loadedWeights.retrieve(10), 5);
+  ASSERT_EQ(loadedFeatures.retrieve(110), 10);
+
+  // sections are page aligned, so flat images work in place
+  NSL::Container::Section image = container.section("perfect");
+  ASSERT_EQ((uintptr_t)image.data % NSL::Container::PageSize, 0);
+  NSL::PerfectHashTable<uint32_t> view(image.data, image.size);
+  ASSERT_EQ(view.retrieve(20), 10);
+
+  NSL::Container moved(std::move(container));
+  ASSERT_TRUE(moved.has("trie"));
+  std::remove(path);
+}
+
+TEST(Container, corruption) {
+  NSL::ContainerWriter writer;
+  writer.addSection("a", std::string(10000, 'a'));
+  writer.addSection("b", "bbbb");
+  std::stringstream ss;
+  writer.writeToStream(ss);
+  std::string bytes = ss.str();
+
+  // a damaged section is only reported when it's accessed
+  std::string damaged = bytes;
+  damaged[damaged.size() - 1] = 'c';
+  std::istringstream damagedStream(damaged);
+  NSL::Container container(damagedStream);
+  ASSERT_EQ(container.section("a").size, 10000);
+  ASSERT_THROW(container.section("b"), std::runtime_error);
+
+  std::string header = bytes;
+  header[50] ^= 1;
+  std::istringstream headerStream(header);
+  ASSERT_THROW(NSL::Container c(headerStream), std::runtime_error);
+
+  std::istringstream garbage(std::string(100, 'x'));
+  ASSERT_THROW(NSL::Container c(garbage), std::runtime_error);
+}
@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/group_hash_table.h"
+#include "nansae/core/hash.h"
+#include "nansae/core/stream_binary_io.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace NSL {
+
+/**
+ * The number of buckets probed at once.
+ */
+static const unsigned GroupSize = 16;
+
+/**
+ * The control byte of an empty bucket. Used buckets hold a 7-bit tag, so the
+ * high bit alone tells the two apart.
+ */
+static const uint8_t EmptyControl = 0x80;
+
+/**
+ * Returns a bitmask of the buckets in a group whose control byte equals the
+ * tag.
+ */
+static inline uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(tag)));
+#else
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < GroupSize; i++) {
+    mask |= (uint32_t)(group[i] == tag) << i;
+  }
+  return mask;
+#endif
+}
+
+/**
+ * Returns a bitmask of the empty buckets in a group.
+ */
+static inline uint32_t matchEmpty(const uint8_t* group) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < GroupSize; i++) {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+#endif
+}
+
+static inline unsigned lowestBit(uint32_t mask) { return __builtin_ctz(mask); }
+
+static inline size_t alignUp(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+template <typename T, typename V>
+GroupHashTable<T, V>::GroupHashTable(T bucketsNo) {
+  T roundedBucketsNo = GroupSize;
+  while (roundedBucketsNo < bucketsNo) roundedBucketsNo *= 2;
+  this->allocate(roundedBucketsNo);
+}
+
+template <typename T, typename V>
+GroupHashTable<T, V>::GroupHashTable(const GroupHashTable<T, V>& other)
+    : _usedUpBuckets(other._usedUpBuckets) {
+  this->allocate(other._bucketsNo);
+  std::memcpy(_ids, other._ids, _bucketsNo * sizeof(T));
+  std::memcpy(_values, other._values, _bucketsNo * sizeof(ValueType));
+  std::memcpy(_control, other._control, _bucketsNo * sizeof(uint8_t));
+}
+
+template <typename T, typename V>
+GroupHashTable<T, V>::GroupHashTable(GroupHashTable<T, V>&& other)
+    : _bucketsNo(other._bucketsNo),
+      _usedUpBuckets(other._usedUpBuckets),
+      _storage(other._storage),
+      _values(other._values),
+      _ids(other._ids),
+      _control(other._control) {
+  other._storage = nullptr;
+  other._values = nullptr;
+  other._ids = nullptr;
+  other._control = nullptr;
+  other._bucketsNo = 0;
+  other._usedUpBuckets = 0;
+}
+
+template <typename T, typename V>
+GroupHashTable<T, V>::~GroupHashTable() {
+  std::free(this->_storage);
+}
+
+template <typename T, typename V>
+void GroupHashTable<T, V>::allocate(T bucketsNo) {
+  size_t idsOffset = alignUp(bucketsNo * sizeof(ValueType), alignof(T));
+  size_t controlOffset = idsOffset + bucketsNo * sizeof(T);
+
+  _bucketsNo = bucketsNo;
+  _storage = (char*)std::malloc(controlOffset + bucketsNo);
+  if (_storage == nullptr) throw std::bad_alloc();
+  _values = (ValueType*)_storage;
+  _ids = (T*)(_storage + idsOffset);
+  _control = (uint8_t*)(_storage + controlOffset);
+  std::memset(_control, EmptyControl, bucketsNo);
+}
+
+/* SERIALIZATION FORMAT
+ * [(T)buckets no, (T)used up buckets no, (uint8_t[buckets no])control bytes,
+ *  (T[used up buckets no])ids, (V[used up buckets no])values]
+ * Only the occupied buckets' ids and values are written, in bucket order.
+ */
+
+template <typename T, typename V>
+void GroupHashTable<T, V>::loadFromStream(std::istream& is) {
+  // read everything before replacing the buckets, so that a failed read
+  // leaves the table as it was
+  StreamBinaryReader reader(is);
+  T bucketsNo = reader.read<T>();
+  T usedUpBuckets = reader.read<T>();
+
+  // groups are picked by masking the hash, and probing only ends at an
+  // empty bucket
+  if (bucketsNo < GroupSize || (bucketsNo & (bucketsNo - 1)) != 0 ||
+      usedUpBuckets > bucketsNo - bucketsNo / 8) {
+    throw std::runtime_error("Malformed NSL::GroupHashTable stream.");
+  }
+  std::vector<uint8_t> control(bucketsNo);
+  reader.readArray(control.data(), control.size());
+  T usedControls = 0;
+  for (uint8_t c : control) {
+    if (c != EmptyControl && (c & 0x80) != 0) {
+      throw std::runtime_error("Malformed NSL::GroupHashTable stream.");
+    }
+    usedControls += c != EmptyControl;
+  }
+  if (usedControls != usedUpBuckets) {
+    throw std::runtime_error("Malformed NSL::GroupHashTable stream.");
+  }
+
+  std::vector<T> ids(usedUpBuckets);
+  std::vector<ValueType> values(usedUpBuckets);
+  reader.readArray(ids.data(), ids.size());
+  reader.readArray(values.data(), values.size());
+
+  std::free(_storage);
+  this->allocate(bucketsNo);
+  _usedUpBuckets = usedUpBuckets;
+  std::memcpy(_control, control.data(), bucketsNo);
+
+  T read = 0;
+  for (T i = 0; i < _bucketsNo && read < _usedUpBuckets; i++) {
+    if (_control[i] == EmptyControl) continue;
+    _ids[i] = ids[read];
+    _values[i] = values[read];
+    read++;
+  }
+}
+
+template <typename T, typename V>
+void GroupHashTable<T, V>::writeToStream(std::ostream& os) {
+  StreamBinaryWriter writer(os);
+  writer.write<T>(_bucketsNo);
+  writer.write<T>(_usedUpBuckets);
+  writer.writeArray(_control, _bucketsNo);
+
+  std::vector<T> ids;
+  std::vector<ValueType> values;
+  ids.reserve(_usedUpBuckets);
+  values.reserve(_usedUpBuckets);
+  for (T i = 0; i < _bucketsNo; i++) {
+    if (_control[i] == EmptyControl) continue;
+    ids.push_back(_ids[i]);
+    values.push_back(_values[i]);
+  }
+  writer.writeArray(ids.data(), ids.size());
+  writer.writeArray(values.data(), values.size());
+  writer.flush();
+}
+
+template <typename T, typename V>
+void GroupHashTable<T, V>::rehash(T bucketsNo) {
+  char* originalStorage = _storage;
+  T* originalIds = _ids;
+  ValueType* originalValues = _values;
+  uint8_t* originalControl = _control;
+  T originalBucketsNo = _bucketsNo;
+
+  this->allocate(bucketsNo);
+  _usedUpBuckets = 0;
+
+  for (T i = 0; i < originalBucketsNo; i++) {
+    if (originalControl[i] != EmptyControl) {
+      this->insert(originalIds[i], originalValues[i]);
+    }
+  }
+
+  std::free(originalStorage);
+}
+
+template <typename T, typename V>
+T GroupHashTable<T, V>::findBucket(T id) const {
+  T hashValue = hash(id);
+  uint8_t tag = hashValue & 0x7f;
+  T groupMask = _bucketsNo / GroupSize - 1;
+  T group = (hashValue >> 7) & groupMask;
+
+  // probe the groups triangularly, which visits every group exactly once
+  // when their number is a power of two
+  for (T step = 1;; step++) {
+    const uint8_t* control = _control + group * GroupSize;
+    for (uint32_t match = matchTag(control, tag); match != 0;
+         match &= match - 1) {
+      T position = group * GroupSize + lowestBit(match);
+      if (_ids[position] == id) return position;
+    }
+    if (matchEmpty(control) != 0) return _bucketsNo;
+    group = (group + step) & groupMask;
+  }
+}
+
+template <typename T, typename V>
+int GroupHashTable<T, V>::insert(T id, ValueType value) {
+  T position = findBucket(id);
+  if (position != _bucketsNo) {
+    _values[position] = value;
+    return 1;
+  }
+
+  // keep at most 7/8 of the buckets in use
+  if (_usedUpBuckets + 1 > _bucketsNo - _bucketsNo / 8) {
+    this->rehash(2 * _bucketsNo);
+  }
+
+  T hashValue = hash(id);
+  T groupMask = _bucketsNo / GroupSize - 1;
+  T group = (hashValue >> 7) & groupMask;
+
+  for (T step = 1;; step++) {
+    uint32_t empty = matchEmpty(_control + group * GroupSize);
+    if (empty != 0) {
+      position = group * GroupSize + lowestBit(empty);
+      _control[position] = hashValue & 0x7f;
+      _ids[position] = id;
+      _values[position] = value;
+      _usedUpBuckets++;
+      return 0;
+    }
+    group = (group + step) & groupMask;
+  }
+}
+
+template <typename T, typename V>
+V GroupHashTable<T, V>::retrieve(T id) const {
+  T position = findBucket(id);
+  if (position == _bucketsNo) return ValueType();
+  return _values[position];
+}
+
+template <typename T, typename V>
+bool GroupHashTable<T, V>::exists(T id) const {
+  return findBucket(id) != _bucketsNo;
+}
+
+template <typename T, typename V>
+typename GroupHashTable<T, V>::Entry GroupHashTable<T, V>::Iterator::operator*() {
+  Entry e;
+  e.id = _ht->_ids[_position];
+  e.value = _ht->_values[_position];
+  return e;
+}
+
+template <typename T, typename V>
+typename GroupHashTable<T, V>::Entry GroupHashTable<T, V>::Iterator::operator->() {
+  return this->operator*();
+}
+
+template <typename T, typename V>
+typename GroupHashTable<T, V>::Iterator
+GroupHashTable<T, V>::Iterator::operator++() {
+  // skip whole groups of empty buckets
+  T position = _position + 1;
+  while (position < _ht->_bucketsNo) {
+    T group = position / GroupSize;
+    uint32_t used = ~matchEmpty(_ht->_control + group * GroupSize) &
+                    (0xffffu << (position % GroupSize)) & 0xffffu;
+    if (used != 0) {
+      _position = group * GroupSize + lowestBit(used);
+      return *this;
+    }
+    position = (group + 1) * GroupSize;
+  }
+
+  _position = _ht->end()._position;
+  return *this;
+}
+
+template <typename T, typename V>
+typename GroupHashTable<T, V>::Iterator GroupHashTable<T, V>::Iterator::operator+(
+    T moveBy) {
+  for (T i = 0; i < moveBy - 1; ++i) {
+    this->operator++();
+  }
+  return this->operator++();
+}
+
+template <typename T, typename V>
+bool GroupHashTable<T, V>::Iterator::operator!=(const Iterator& other) {
+  return (_position != other._position) || (_ht != other._ht);
+}
+
+template <typename T, typename V>
+typename GroupHashTable<T, V>::Iterator GroupHashTable<T, V>::begin() {
+  Iterator it;
+  it._position = 0;
+  it._ht = this;
+  if (_bucketsNo > 0 && _control[0] != EmptyControl) return it;
+  return ++it;
+}
+
+template <typename T, typename V>
+typename GroupHashTable<T, V>::Iterator GroupHashTable<T, V>::end() {
+  Iterator it;
+  it._position = _bucketsNo + 1;
+  it._ht = this;
+  return it;
+}
+
+template class GroupHashTable<uint32_t, double>;
+template class GroupHashTable<uint32_t, float>;
+template class GroupHashTable<uint32_t, int32_t>;
+template class GroupHashTable<uint32_t, uint16_t>;
+template class GroupHashTable<uint32_t, int16_t>;
+template class GroupHashTable<uint32_t, int8_t>;
+template class GroupHashTable<uint32_t, std::array<float, 2>>;
+template class GroupHashTable<uint32_t, std::array<float, 4>>;
+template class GroupHashTable<uint32_t, std::array<float, 8>>;
+template class GroupHashTable<uint64_t, double>;
+template class GroupHashTable<uint64_t, float>;
+template class GroupHashTable<uint64_t, int32_t>;
+template class GroupHashTable<uint64_t, uint16_t>;
+template class GroupHashTable<uint64_t, int16_t>;
+template class GroupHashTable<uint64_t, int8_t>;
+template class GroupHashTable<uint64_t, std::array<float, 2>>;
+template class GroupHashTable<uint64_t, std::array<float, 4>>;
+template class GroupHashTable<uint64_t, std::array<float, 8>>;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NSL_GROUP_HASH_TABLE_H
+#define NSL_GROUP_HASH_TABLE_H
+
+#include <cstdint>
+#include <iostream>
+
+#include "nansae/core/hash_table.h"
+
+namespace NSL {
+/**
+ * A hash table with the same interface as NSL::HashTable that probes whole
+ * groups of 16 buckets at once.
+ * Every bucket has a control byte holding a 7-bit tag taken from the id's
+ * hash, or the empty marker. A lookup compares the tag against the 16 control
+ * bytes of a group with a single SSE2 comparison and only checks the ids of
+ * the matching buckets. The number of buckets is always a power of two.
+ * It is instantiated for the same id and value types as NSL::HashTable.
+ */
+template <typename T, typename V = ValueType>
+class GroupHashTable {
+ public:
+  typedef V ValueType;
+
+ private:
+  T _bucketsNo;
+  T _usedUpBuckets = 0;
+
+  /**
+   * A single allocation holding the three bucket arrays below.
+   */
+  char* _storage = nullptr;
+  ValueType* _values = nullptr;
+  T* _ids = nullptr;
+
+  /**
+   * The control byte of each bucket.
+   */
+  uint8_t* _control = nullptr;
+
+  void allocate(T bucketsNo);
+  void rehash(T bucketsNo);
+  T findBucket(T id) const;
+
+ public:
+  struct Entry {
+    T id;
+    ValueType value;
+  };
+
+  class Iterator {
+    friend GroupHashTable;
+
+   private:
+    T _position;
+    GroupHashTable* _ht;
+
+   public:
+    Entry operator*();
+    Entry operator->();
+    Iterator operator++();
+    Iterator operator+(T moveBy);
+    bool operator!=(const Iterator& other);
+  };
+
+  /**
+   * The constructor.
+   * \param bucketsNo The minimal number of buckets, rounded up to a power of
+   * two of at least 16.
+   */
+  GroupHashTable(T bucketsNo = 256);
+  GroupHashTable(std::istream& is) { this->loadFromStream(is); }
+  ~GroupHashTable();
+
+  GroupHashTable(const GroupHashTable& other);
+  GroupHashTable(GroupHashTable&& other);
+
+  void writeToStream(std::ostream& os);
+
+  /**
+   * Replaces the table with one written by writeToStream. The table is left
+   * unchanged when the stream can't be read.
+   * \throws std::runtime_error for malformed streams.
+   * \throws std::ios_base::failure if the stream ends early.
+   */
+  void loadFromStream(std::istream& is);
+
+  int insert(T id, ValueType value);
+  ValueType retrieve(T id) const;
+  bool exists(T id) const;
+
+  uint32_t bucketsNo() { return this->_bucketsNo; }
+
+  Iterator begin();
+  Iterator end();
+};
+}
+#endif  // NSL_GROUP_HASH_TABLE_H
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/group_hash_table.h"
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+TEST(GroupHashTable, test32) {
+  NSL::GroupHashTable<uint32_t> ht(16);
+  std::stringstream s;
+
+  for (int i = 0; i < 30000; i++) {
+    ASSERT_EQ(ht.insert(i, 20 * i), 0);
+  }
+
+  for (int i = 0; i < 30000; i++) {
+    ASSERT_EQ(ht.insert(i, 3 * i), 1);
+    ASSERT_EQ(ht.insert(i, 1.1 * i), 1);
+  }
+
+  ht.writeToStream(s);
+
+  NSL::GroupHashTable<uint32_t> ht2(s);
+
+  for (int i = 29999; i >= 0; i--) {
+    double x = ht2.retrieve(i);
+    ASSERT_DOUBLE_EQ(x, 1.1 * i);
+  }
+  ASSERT_EQ(ht2.exists(30000), false);
+}
+
+TEST(GroupHashTable, test64) {
+  NSL::GroupHashTable<uint64_t> ht(65536);
+
+  for (uint64_t i = 0; i < 3000000; i += 100) {
+    ASSERT_EQ(ht.insert(i * 500000000, 20 * i), 0);
+  }
+
+  for (uint64_t i = 0; i < 3000000; i += 100) {
+    ASSERT_EQ(ht.insert(i * 500000000, 1.1 * i), 1);
+  }
+
+  NSL::GroupHashTable<uint64_t> ht2(ht);
+
+  for (uint64_t i = 0; i < 3000000; i += 100) {
+    ASSERT_DOUBLE_EQ(ht2.retrieve(i * 500000000), 1.1 * i);
+    ASSERT_EQ(ht2.exists(i * 500000000 + 1), false);
+  }
+}
+
+TEST(GroupHashTable, powerOfTwoBuckets) {
+  NSL::GroupHashTable<uint32_t> ht(100);
+  ASSERT_EQ(ht.bucketsNo(), 128);
+
+  for (uint32_t i = 0; i < 1000; i++) ht.insert(i, i);
+  ASSERT_EQ(ht.bucketsNo() & (ht.bucketsNo() - 1), 0);
+}
+
+TEST(GroupHashTable, iteration) {
+  NSL::GroupHashTable<uint32_t> ht(256);
+  std::unordered_map<uint32_t, double> expected;
+  for (uint32_t i = 0; i < 1000; i += 7) {
+    ht.insert(i * 13, 0.5 * i);
+    expected[i * 13] = 0.5 * i;
+  }
+
+  ASSERT_EQ((ht.end() != ht.end()), false);
+
+  // every entry is visited once, skipping the groups with no entries
+  for (NSL::GroupHashTable<uint32_t>::Entry e : ht) {
+    auto found = expected.find(e.id);
+    ASSERT_TRUE(found != expected.end());
+    ASSERT_DOUBLE_EQ(found->second, e.value);
+    expected.erase(found);
+  }
+  ASSERT_TRUE(expected.empty());
+
+  NSL::GroupHashTable<uint32_t> empty(256);
+  for (NSL::GroupHashTable<uint32_t>::Entry e : empty) {
+    FAIL() << "Unexpected entry " << e.id;
+  }
+}
+
+TEST(GroupHashTable, valueTypes) {
+  NSL::GroupHashTable<uint32_t, int32_t> counts(16);
+  NSL::GroupHashTable<uint64_t, std::array<float, 2>> pairs(16);
+
+  for (uint32_t i = 0; i < 1000; i++) {
+    counts.insert(i, -(int32_t)i);
+    pairs.insert(i, {{0.5f * i, 2.f * i}});
+  }
+
+  std::stringstream s;
+  pairs.writeToStream(s);
+  NSL::GroupHashTable<uint64_t, std::array<float, 2>> pairs2(s);
+
+  for (uint32_t i = 0; i < 1000; i++) {
+    ASSERT_EQ(counts.retrieve(i), -(int32_t)i);
+    ASSERT_FLOAT_EQ(pairs2.retrieve(i)[1], 2.f * i);
+  }
+}
+
+TEST(GroupHashTable, malformedStreams) {
+  NSL::GroupHashTable<uint32_t> ht(16);
+  for (uint32_t i = 0; i < 100; i++) ht.insert(i, i);
+  std::stringstream s;
+  ht.writeToStream(s);
+  std::string bytes = s.str();
+
+  NSL::GroupHashTable<uint32_t> loaded(16);
+  loaded.insert(1000, 2);
+
+  // [(T)buckets no, (T)used up buckets no, ...]
+  std::string oddBuckets = bytes;
+  uint32_t bucketsNo = 100;
+  std::memcpy(&oddBuckets[0], &bucketsNo, sizeof(bucketsNo));
+  std::stringstream odd(oddBuckets);
+  ASSERT_THROW(loaded.loadFromStream(odd), std::runtime_error);
+
+  std::string wrongCount = bytes;
+  uint32_t usedUpBuckets = 99;
+  std::memcpy(&wrongCount[4], &usedUpBuckets, sizeof(usedUpBuckets));
+  std::stringstream wrong(wrongCount);
+  ASSERT_THROW(loaded.loadFromStream(wrong), std::runtime_error);
+
+  std::stringstream truncated(bytes.substr(0, bytes.size() - 1));
+  ASSERT_THROW(loaded.loadFromStream(truncated), std::ios_base::failure);
+
+  // the table is left as it was
+  ASSERT_EQ(loaded.retrieve(1000), 2);
+  ASSERT_FALSE(loaded.exists(10));
+}
@@ -15,260 +15,836 @@
  */
 
 #include "nansae/core/hash_table.h"
+#include "nansae/core/hash.h"
 #include "nansae/core/stream_binary_io.h"
 
 #include <stdio.h>
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 namespace NSL {
 
-template <typename T>
-struct HashTable<T>::Bucket {
-  T id;
-  ValueType value;
-  bool used;
-};
-
-inline uint32_t hash(uint32_t h) {
-  /*x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = ((x >> 16) ^ x);*/
-  h ^= h >> 16;
-  h *= 0x85ebca6b;
-  h ^= h >> 13;
-  h *= 0xc2b2ae35;
-  h ^= h >> 16;
-  return h;
-}
-
-inline uint64_t hash(uint64_t h) {
-  h ^= h >> 33;
-  h *= 0xff51afd7ed558ccd;
-  h ^= h >> 33;
-  h *= 0xc4ceb9fe1a85ec53;
-  h ^= h >> 33;
-  return h;
-}
-
-template <typename T>
-HashTable<T>::HashTable(T bucketsNo) : _bucketsNo(bucketsNo) {
-  this->_buckets = (Bucket*)std::calloc(bucketsNo, sizeof(Bucket));
-}
-
-template <typename T>
-HashTable<T>::HashTable(const HashTable<T>& other)
-    : _bucketsNo(other._bucketsNo), _usedUpBuckets(other._usedUpBuckets) {
-  _buckets = (Bucket*)std::calloc(_bucketsNo, sizeof(Bucket));
-  for (int i = 0; i < _bucketsNo; i++) {
-    _buckets[i] = other._buckets[i];
-  }
-}
-
-template <typename T>
-HashTable<T>::HashTable(HashTable<T>&& other)
-    : _bucketsNo(other._bucketsNo), _usedUpBuckets(other._usedUpBuckets) {
-  _buckets = other._buckets;
-  other._buckets = nullptr;
+/**
+ * The largest probe distance that can be stored in a distance byte.
+ * Reaching it forces the table to grow.
+ */
+static const unsigned MaxDistance = UINT8_MAX - 1;
+
+template <typename T, typename V>
+HashTable<T, V>::HashTable(T bucketsNo) {
+  this->allocate(bucketsNo);
+}
+
+template <typename T, typename V>
+HashTable<T, V>::HashTable(const HashTable<T, V>& other)
+    : _usedUpBuckets(other._usedUpBuckets),
+      _maxLoadFactor(other._maxLoadFactor),
+      _growthFactor(other._growthFactor),
+      _incrementalRehash(other._incrementalRehash),
+      _rehashStep(other._rehashStep) {
+  this->allocate(other._bucketsNo);
+  std::memcpy(_ids, other._ids, _bucketsNo * sizeof(T));
+  std::memcpy(_values, other._values, _bucketsNo * sizeof(ValueType));
+  std::memcpy(_distances, other._distances, _bucketsNo * sizeof(uint8_t));
+  std::memcpy(_occupied, other._occupied, (_bucketsNo + 63) / 64 * 8);
+
+  // the copy doesn't inherit a pending rehash, move the rest over right away
+  for (T i = other._migratedBucketsNo; i < other._oldBucketsNo; i++) {
+    if (other._oldDistances[i] != 0) {
+      this->insertIntoBuckets(other._oldIds[i], other._oldValues[i]);
+    }
+  }
+}
+
+template <typename T, typename V>
+HashTable<T, V>::HashTable(HashTable<T, V>&& other)
+    : _bucketsNo(other._bucketsNo),
+      _usedUpBuckets(other._usedUpBuckets),
+      _storage(other._storage),
+      _values(other._values),
+      _ids(other._ids),
+      _distances(other._distances),
+      _occupied(other._occupied),
+      _maxLoadFactor(other._maxLoadFactor),
+      _growthFactor(other._growthFactor),
+      _oldStorage(other._oldStorage),
+      _oldValues(other._oldValues),
+      _oldIds(other._oldIds),
+      _oldDistances(other._oldDistances),
+      _oldBucketsNo(other._oldBucketsNo),
+      _oldUsedUpBuckets(other._oldUsedUpBuckets),
+      _migratedBucketsNo(other._migratedBucketsNo),
+      _incrementalRehash(other._incrementalRehash),
+      _rehashStep(other._rehashStep),
+      _minRehashStep(other._minRehashStep) {
+  other._storage = nullptr;
+  other._ids = nullptr;
+  other._values = nullptr;
+  other._distances = nullptr;
+  other._occupied = nullptr;
   other._bucketsNo = 0;
   other._usedUpBuckets = 0;
+  other._oldStorage = nullptr;
+  other._oldValues = nullptr;
+  other._oldIds = nullptr;
+  other._oldDistances = nullptr;
+  other._oldBucketsNo = 0;
+  other._oldUsedUpBuckets = 0;
+  other._migratedBucketsNo = 0;
+}
+
+/**
+ * Rounds an offset up to the given alignment.
+ */
+static inline size_t alignUp(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::allocate(T bucketsNo) {
+  size_t valuesOffset =
+      alignUp((bucketsNo + 63) / 64 * sizeof(uint64_t), alignof(ValueType));
+  size_t idsOffset =
+      alignUp(valuesOffset + bucketsNo * sizeof(ValueType), alignof(T));
+  size_t distancesOffset = idsOffset + bucketsNo * sizeof(T);
+
+  _bucketsNo = bucketsNo;
+  _storage = (char*)std::calloc(distancesOffset + bucketsNo, 1);
+  _occupied = (uint64_t*)_storage;
+  _values = (ValueType*)(_storage + valuesOffset);
+  _ids = (T*)(_storage + idsOffset);
+  _distances = (uint8_t*)(_storage + distancesOffset);
+}
+
+template <typename T, typename V>
+T HashTable<T, V>::nextUsed(T position) const {
+  if (position >= _bucketsNo) return _bucketsNo;
+
+  T word = position / 64;
+  T wordsNo = (_bucketsNo + 63) / 64;
+  uint64_t bits = _occupied[word] & (~uint64_t(0) << (position % 64));
+  while (bits == 0) {
+    if (++word == wordsNo) return _bucketsNo;
+    bits = _occupied[word];
+  }
+  return word * 64 + __builtin_ctzll(bits);
 }
 
-template <typename T>
-void HashTable<T>::loadFromStream(std::istream& is) {
-  _bucketsNo = StreamBinaryRead<T>(is);
-  _buckets = (Bucket*)std::calloc(_bucketsNo, sizeof(Bucket));
+/* SERIALIZATION FORMAT
+ * [(char[4])"NSLH", (uint16_t)version, (uint8_t)id bytes,
+ *  (uint8_t)value bytes, (T)buckets no, (T)used up buckets no,
+ *  (uint8_t[buckets no])distances, (T[used up buckets no])ids,
+ *  (V[used up buckets no])values]
+ * Only the occupied buckets' ids and values are written, in bucket order.
+ */
+
+/**
+ * The first bytes of every stream and the version of its layout. Streams
+ * written before the header was added start right with the buckets no.
+ */
+static const char HashTableMagic[4] = {'N', 'S', 'L', 'H'};
+static const uint16_t HashTableVersion = 1;
+
+template <typename T, typename V>
+void HashTable<T, V>::loadFromStream(std::istream& is) {
+  // read everything before replacing the buckets, so that a failed read
+  // leaves the table as it was
+  StreamBinaryReader reader(is);
+  char magic[4];
+  reader.readBytes(magic, sizeof(magic));
+  if (std::memcmp(magic, HashTableMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error(
+        "Not an NSL::HashTable stream, or one of the old layout without a "
+        "header that has to be written again.");
+  }
+  uint16_t version = reader.read<uint16_t>();
+  uint8_t idBytes = reader.read<uint8_t>();
+  uint8_t valueBytes = reader.read<uint8_t>();
+  if (version > HashTableVersion) {
+    throw std::runtime_error("The NSL::HashTable version isn't supported.");
+  }
+  if (idBytes != sizeof(T) || valueBytes != sizeof(ValueType)) {
+    throw std::runtime_error(
+        "The NSL::HashTable stream has other id or value types.");
+  }
 
-  for (T i = 0; i < _bucketsNo; i++) {
-    _buckets[i].id = StreamBinaryRead<T>(is);
-    _buckets[i].value = StreamBinaryRead<double>(is);
-    _buckets[i].used = true;
-    _buckets[i].used = StreamBinaryRead<bool>(is);
+  T bucketsNo = reader.read<T>();
+  T usedUpBuckets = reader.read<T>();
+  if (bucketsNo == 0 || usedUpBuckets > bucketsNo) {
+    throw std::runtime_error("Malformed NSL::HashTable stream.");
+  }
+  std::vector<uint8_t> distances(bucketsNo);
+  reader.readArray(distances.data(), distances.size());
+  // lookups stop probing past MaxDistance, and the ids and values are
+  // matched to the occupied buckets
+  T usedDistances = 0;
+  for (uint8_t distance : distances) {
+    if (distance > MaxDistance) {
+      throw std::runtime_error("Malformed NSL::HashTable stream.");
+    }
+    usedDistances += distance != 0;
+  }
+  if (usedDistances != usedUpBuckets) {
+    throw std::runtime_error("Malformed NSL::HashTable stream.");
+  }
+
+  std::vector<T> ids(usedUpBuckets);
+  std::vector<ValueType> values(usedUpBuckets);
+  reader.readArray(ids.data(), ids.size());
+  reader.readArray(values.data(), values.size());
+
+  std::free(_oldStorage);
+  _oldStorage = nullptr;
+  _oldBucketsNo = _oldUsedUpBuckets = _migratedBucketsNo = 0;
+  std::free(_storage);
+  this->allocate(bucketsNo);
+  _usedUpBuckets = usedUpBuckets;
+  std::memcpy(_distances, distances.data(), bucketsNo);
+
+  T read = 0;
+  for (T i = 0; i < _bucketsNo && read < _usedUpBuckets; i++) {
+    if (_distances[i] == 0) continue;
+    this->markUsed(i);
+    _ids[i] = ids[read];
+    _values[i] = values[read];
+    read++;
   }
 }
 
-template <typename T>
-void HashTable<T>::writeToStream(std::ostream& os) {
-  StreamBinaryWrite<T>(os, _bucketsNo);
-  for (T i = 0; i < _bucketsNo; i++) {
-    StreamBinaryWrite<T>(os, _buckets[i].id);
-    StreamBinaryWrite<double>(os, _buckets[i].value);
-    StreamBinaryWrite<bool>(os, _buckets[i].used);
+template <typename T, typename V>
+void HashTable<T, V>::writeToStream(std::ostream& os) {
+  this->finishRehash();
+  StreamBinaryWriter writer(os);
+  writer.writeBytes(HashTableMagic, sizeof(HashTableMagic));
+  writer.write<uint16_t>(HashTableVersion);
+  writer.write<uint8_t>(sizeof(T));
+  writer.write<uint8_t>(sizeof(ValueType));
+  writer.write<T>(_bucketsNo);
+  writer.write<T>(_usedUpBuckets);
+  writer.writeArray(_distances, _bucketsNo);
+
+  std::vector<T> ids;
+  std::vector<ValueType> values;
+  ids.reserve(_usedUpBuckets);
+  values.reserve(_usedUpBuckets);
+  for (T pos = nextUsed(0); pos < _bucketsNo; pos = nextUsed(pos + 1)) {
+    ids.push_back(_ids[pos]);
+    values.push_back(_values[pos]);
   }
+  writer.writeArray(ids.data(), ids.size());
+  writer.writeArray(values.data(), values.size());
+  writer.flush();
 }
 
-template <typename T>
-void HashTable<T>::rehash(T bucketsNo) {
-  Bucket* originalBuckets = _buckets;
+/**
+ * The flags of the compact stream header.
+ */
+static const uint8_t CompactDeltaKeys = 1;
+
+/**
+ * The codecs the compact chunks can be framed with, only uncompressed
+ * chunks are supported so far.
+ */
+static const uint8_t CompactCodecNone = 0;
+
+template <typename T, typename V>
+void HashTable<T, V>::writeCompactToStream(std::ostream& os, bool deltaKeys) {
+  this->finishRehash();
+  StreamBinaryWriter writer(os);
+  writer.write<uint8_t>(deltaKeys ? CompactDeltaKeys : 0);
+  writer.write<uint8_t>(CompactCodecNone);
+  writer.write<uint64_t>(_usedUpBuckets);
+
+  std::vector<T> positions;
+  positions.reserve(_usedUpBuckets);
+  for (T pos = nextUsed(0); pos < _bucketsNo; pos = nextUsed(pos + 1)) {
+    positions.push_back(pos);
+  }
+  if (deltaKeys) {
+    std::sort(positions.begin(), positions.end(),
+              [this](T a, T b) { return _ids[a] < _ids[b]; });
+  }
+
+  // every chunk is [u32 entries][u32 key bytes][keys][values], the first
+  // key of a delta encoded chunk is stored as is
+  std::string keys;
+  std::vector<T> ids;
+  std::vector<ValueType> values;
+  for (size_t begin = 0; begin < positions.size();
+       begin += CompactChunkEntriesNo) {
+    size_t end = std::min<size_t>(begin + CompactChunkEntriesNo,
+                                  positions.size());
+    keys.clear();
+    ids.clear();
+    values.clear();
+    T previous = 0;
+    for (size_t i = begin; i < end; i++) {
+      T id = _ids[positions[i]];
+      if (deltaKeys) {
+        VarintAppend(keys, id - previous);
+        previous = id;
+      } else {
+        ids.push_back(id);
+      }
+      values.push_back(_values[positions[i]]);
+    }
+
+    writer.write<uint32_t>(end - begin);
+    writer.write<uint32_t>(deltaKeys ? keys.size() : ids.size() * sizeof(T));
+    writer.writeBytes(keys.data(), keys.size());
+    writer.writeArray(ids.data(), ids.size());
+    writer.writeArray(values.data(), values.size());
+  }
+  writer.flush();
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::loadCompactFromStream(std::istream& is) {
+  StreamBinaryReader reader(is);
+  uint8_t flags = reader.read<uint8_t>();
+  uint8_t codec = reader.read<uint8_t>();
+  uint64_t entriesNo = reader.read<uint64_t>();
+  if (codec != CompactCodecNone) {
+    throw std::runtime_error("Unsupported NSL::HashTable compact stream.");
+  }
+
+  // decode every chunk before replacing the buckets, so that a failed read
+  // leaves the table as it was, and grow with the entries actually read
+  // rather than trusting the count in the header
+  std::string keys;
+  std::vector<T> ids;
+  std::vector<T> allIds;
+  std::vector<ValueType> values;
+  std::vector<ValueType> allValues;
+  allIds.reserve(std::min<uint64_t>(entriesNo, T(CompactChunkEntriesNo)));
+  allValues.reserve(allIds.capacity());
+  for (uint64_t read = 0; read < entriesNo;) {
+    uint32_t chunkEntriesNo = reader.read<uint32_t>();
+    uint32_t keyBytes = reader.read<uint32_t>();
+    // a varint takes at most 10 bytes
+    if (chunkEntriesNo == 0 || chunkEntriesNo > CompactChunkEntriesNo ||
+        read + chunkEntriesNo > entriesNo ||
+        keyBytes > (uint64_t)chunkEntriesNo * 10) {
+      throw std::runtime_error("Malformed NSL::HashTable compact stream.");
+    }
+
+    ids.resize(chunkEntriesNo);
+    if (flags & CompactDeltaKeys) {
+      keys.resize(keyBytes);
+      reader.readBytes(&keys[0], keyBytes);
+      const char* pos = keys.data();
+      T id = 0;
+      for (T& chunkId : ids) {
+        id += (T)VarintParse(pos, keys.data() + keys.size());
+        chunkId = id;
+      }
+    } else {
+      if (keyBytes != chunkEntriesNo * sizeof(T)) {
+        throw std::runtime_error("Malformed NSL::HashTable compact stream.");
+      }
+      reader.readArray(ids.data(), ids.size());
+    }
+    values.resize(chunkEntriesNo);
+    reader.readArray(values.data(), values.size());
+
+    allIds.insert(allIds.end(), ids.begin(), ids.end());
+    allValues.insert(allValues.end(), values.begin(), values.end());
+    read += chunkEntriesNo;
+  }
+
+  std::free(_oldStorage);
+  _oldStorage = nullptr;
+  _oldBucketsNo = _oldUsedUpBuckets = _migratedBucketsNo = 0;
+  std::free(_storage);
+  this->allocate(bucketsNoFor(allIds.size()));
+  _usedUpBuckets = 0;
+  for (size_t i = 0; i < allIds.size(); i++) {
+    this->insertIntoBuckets(allIds[i], allValues[i]);
+  }
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::rehash(T bucketsNo) {
+  char* originalStorage = _storage;
+  T* originalIds = _ids;
+  ValueType* originalValues = _values;
+  uint8_t* originalDistances = _distances;
   T originalBucketsNo = _bucketsNo;
 
-  _bucketsNo = bucketsNo;
-  _buckets = (Bucket*)std::calloc(_bucketsNo * 2, sizeof(Bucket));
+  this->allocate(bucketsNo);
   _usedUpBuckets = 0;
 
   for (T i = 0; i < originalBucketsNo; i++) {
-    if (originalBuckets[i].used) {
-      this->insert(originalBuckets[i].id, originalBuckets[i].value);
+    if (originalDistances[i] != 0) {
+      this->insertIntoBuckets(originalIds[i], originalValues[i]);
     }
   }
 
-  std::free(originalBuckets);
+  std::free(originalStorage);
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::grow() {
+  T bucketsNo = std::max<T>(_bucketsNo * _growthFactor, _bucketsNo + 1);
+
+  // while migrating, the new buckets are grown at once, which only happens
+  // when the inserts outpace the migration
+  if (_incrementalRehash && _oldStorage == nullptr) {
+    this->startRehash(bucketsNo);
+  } else {
+    this->rehash(bucketsNo);
+  }
 }
 
-template <typename T>
-int HashTable<T>::insert(T id, double value) {
-  if (_usedUpBuckets > .8f * _bucketsNo) {
-    this->rehash(2 * _bucketsNo);
+template <typename T, typename V>
+void HashTable<T, V>::startRehash(T bucketsNo) {
+  _oldStorage = _storage;
+  _oldValues = _values;
+  _oldIds = _ids;
+  _oldDistances = _distances;
+  _oldBucketsNo = _bucketsNo;
+  _oldUsedUpBuckets = _usedUpBuckets;
+  _migratedBucketsNo = 0;
+
+  // every insert adds at most one entry, so the old buckets have to be
+  // migrated within the inserts the new buckets have room for, one is
+  // left as a margin for the rounding of the load factor
+  double room =
+      std::floor(_maxLoadFactor * bucketsNo - (double)_usedUpBuckets) - 1;
+  _minRehashStep =
+      room < 1 ? _oldBucketsNo : (T)std::ceil(_oldBucketsNo / room);
+
+  this->allocate(bucketsNo);
+  _usedUpBuckets = 0;
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::migrate(T bucketsNo) {
+  T until = std::min<T>(_oldBucketsNo, _migratedBucketsNo + bucketsNo);
+  while (_migratedBucketsNo < until) {
+    T i = _migratedBucketsNo++;
+    if (_oldDistances[i] != 0) {
+      _oldUsedUpBuckets--;
+      this->insertIntoBuckets(_oldIds[i], _oldValues[i]);
+    }
+  }
+
+  if (_migratedBucketsNo == _oldBucketsNo) {
+    std::free(_oldStorage);
+    _oldStorage = nullptr;
+    _oldValues = nullptr;
+    _oldIds = nullptr;
+    _oldDistances = nullptr;
+    _oldBucketsNo = _oldUsedUpBuckets = _migratedBucketsNo = 0;
   }
+}
 
-  T hashValue = hash(id);
-  T desiredPosition = hashValue % _bucketsNo;
+template <typename T, typename V>
+void HashTable<T, V>::finishRehash() {
+  if (_oldStorage != nullptr) this->migrate(_oldBucketsNo);
+}
 
-  // find a non-used bucket
-  bool reachedStart = false;
-  for (T position = desiredPosition;
-       !(reachedStart && (position == _bucketsNo - 1));
-       position = (position + 1) % _bucketsNo) {
-    if (!_buckets[position].used) {
-      _buckets[position].id = id;
-      _buckets[position].value = value;
-      _buckets[position].used = true;
+template <typename T, typename V>
+void HashTable<T, V>::setIncrementalRehash(bool incremental,
+                                           T bucketsPerInsert) {
+  if (!incremental) this->finishRehash();
+  _incrementalRehash = incremental;
+  _rehashStep = std::max<T>(bucketsPerInsert, 2);
+}
+
+template <typename T, typename V>
+T HashTable<T, V>::bucketsNoFor(T entriesNo) const {
+  T bucketsNo = std::ceil(entriesNo / _maxLoadFactor);
+  while (entriesNo > _maxLoadFactor * bucketsNo) bucketsNo++;
+  return std::max<T>(bucketsNo, 1);
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::reserve(T entriesNo) {
+  this->finishRehash();
+  T bucketsNo = bucketsNoFor(entriesNo);
+  if (bucketsNo > _bucketsNo) this->rehash(bucketsNo);
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::shrinkToFit() {
+  this->finishRehash();
+  T bucketsNo = bucketsNoFor(_usedUpBuckets);
+  if (bucketsNo < _bucketsNo) this->rehash(bucketsNo);
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::setMaxLoadFactor(float maxLoadFactor) {
+  if (!(maxLoadFactor > 0 && maxLoadFactor <= .95f)) {
+    throw std::invalid_argument("The load factor must be from (0, 0.95].");
+  }
+  _maxLoadFactor = maxLoadFactor;
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::setGrowthFactor(float growthFactor) {
+  if (!(growthFactor > 1)) {
+    throw std::invalid_argument("The growth factor must be greater than 1.");
+  }
+  _growthFactor = growthFactor;
+}
+
+template <typename T, typename V>
+int HashTable<T, V>::insert(T id, ValueType value) {
+  if (_oldStorage == nullptr) return this->insertIntoBuckets(id, value);
+
+  // ids that haven't been migrated yet are updated in the old buckets
+  int result;
+  T oldPosition = findOldPosition(id);
+  if (oldPosition != _oldBucketsNo) {
+    _oldValues[oldPosition] = value;
+    result = 1;
+  } else {
+    result = this->insertIntoBuckets(id, value);
+  }
+
+  if (_oldStorage != nullptr) {
+    this->migrate(std::max(_rehashStep, _minRehashStep));
+  }
+  return result;
+}
+
+template <typename T, typename V>
+int HashTable<T, V>::insertIntoBuckets(T id, ValueType value) {
+  if (_bucketsNo == 0) this->grow();
+
+  T position = hash(id) % _bucketsNo;
+  unsigned distance = 1;
+  bool swapped = false;
+
+  for (;;) {
+    if (!swapped) {
+      if (_distances[position] >= distance) {
+        if (_ids[position] == id) {
+          _values[position] = value;
+          return 1;
+        }
+      } else if (this->size() + 1 > _maxLoadFactor * _bucketsNo) {
+        // the id is new, grow before modifying anything
+        this->grow();
+        return this->insertIntoBuckets(id, value);
+      }
+    }
+
+    if (_distances[position] == 0) {
+      _ids[position] = id;
+      _values[position] = value;
+      _distances[position] = distance;
+      this->markUsed(position);
       _usedUpBuckets++;
       return 0;
-    } else if (_buckets[position].id == id) {
-      _buckets[position].value = value;
-      return 1;
-    } else {
-      T dist = position - desiredPosition;
-      T currentBucketDist =
-          position - (hash(_buckets[position].id) % _bucketsNo);
-
+    } else if (_distances[position] < distance) {
       // swap if the current bucket is closer to its desired position than we
       // are to ours
-      if (currentBucketDist < dist) {
-        desiredPosition = hash(_buckets[position].id) % _bucketsNo;
-        std::swap(id, _buckets[position].id);
-        hashValue = hash(id);
-        std::swap(value, _buckets[position].value);
-      }
+      std::swap(id, _ids[position]);
+      std::swap(value, _values[position]);
+      uint8_t currentDistance = _distances[position];
+      _distances[position] = distance;
+      distance = currentDistance;
+      swapped = true;
+    }
+
+    if (++position == _bucketsNo) position = 0;
+    if (++distance > MaxDistance) {
+      // the probe sequence got too long, grow and place the displaced entry
+      this->grow();
+      this->insertIntoBuckets(id, value);
+      return 0;
     }
-    if (position == 0) reachedStart = true;
   }
-  return (-1);
 }
 
-template <typename T>
-double HashTable<T>::retrieve(T id) const {
-  T hashValue = hash(id);
-  T startingLocation = hashValue % _bucketsNo;
+template <typename T, typename V>
+T HashTable<T, V>::findPosition(const T* ids, const uint8_t* distances,
+                                T bucketsNo, T id) const {
+  if (bucketsNo == 0) return bucketsNo;
+  T position = hash(id) % bucketsNo;
+
+  // find the bucket with the correct id, an entry can't be further away from
+  // its desired position than the bucket we're probing
+  for (unsigned distance = 1; distances[position] >= distance; distance++) {
+    if (ids[position] == id) return position;
+    if (++position == bucketsNo) position = 0;
+  }
+  return bucketsNo;
+}
 
-  // find the bucket with the correct id
-  for (T i = startingLocation; i < _bucketsNo; i = (i + 1) % _bucketsNo) {
-    int dist = i - startingLocation;
-    if (!_buckets[i].used)
-      return 0;
-    else if (dist > i - (hash(_buckets[i].id) % _bucketsNo))
-      return 0;
-    else if (_buckets[i].id == id) {
-      return _buckets[i].value;
-    }
+template <typename T, typename V>
+T HashTable<T, V>::findOldPosition(T id) const {
+  T position = findPosition(_oldIds, _oldDistances, _oldBucketsNo, id);
+  if (position < _migratedBucketsNo) return _oldBucketsNo;
+  return position;
+}
+
+template <typename T, typename V>
+V HashTable<T, V>::retrieve(T id) const {
+  T position = findPosition(_ids, _distances, _bucketsNo, id);
+  if (position != _bucketsNo) return _values[position];
+
+  if (_oldStorage != nullptr) {
+    position = findOldPosition(id);
+    if (position != _oldBucketsNo) return _oldValues[position];
+  }
+  return ValueType();
+}
+
+template <typename T, typename V>
+bool HashTable<T, V>::exists(T id) const {
+  if (findPosition(_ids, _distances, _bucketsNo, id) != _bucketsNo) {
+    return true;
+  }
+  return _oldStorage != nullptr && findOldPosition(id) != _oldBucketsNo;
+}
+
+template <typename T, typename V>
+bool HashTable<T, V>::erase(T id) {
+  this->finishRehash();
+  T position = findPosition(_ids, _distances, _bucketsNo, id);
+  if (position == _bucketsNo) return false;
+
+  // shift the rest of the cluster back until an empty bucket or an entry
+  // sitting in its desired bucket
+  T next = position + 1 == _bucketsNo ? 0 : position + 1;
+  while (_distances[next] > 1) {
+    _ids[position] = _ids[next];
+    _values[position] = _values[next];
+    _distances[position] = _distances[next] - 1;
+    position = next;
+    if (++next == _bucketsNo) next = 0;
   }
-  return 0;
+
+  _distances[position] = 0;
+  this->markEmpty(position);
+  _usedUpBuckets--;
+  return true;
+}
+
+/**
+ * The smallest number of buckets worth a thread of its own.
+ */
+static const size_t MinBucketsPerThread = 1 << 14;
+
+/**
+ * Splits [0, n) into ranges and calls function(thread, begin, end) for each
+ * of them on a separate thread, or on the calling one for small ranges.
+ * \ret The number of ranges.
+ */
+template <typename Function>
+static unsigned parallelFor(size_t n, unsigned threadsNo, Function function) {
+  if (threadsNo == 0) threadsNo = std::thread::hardware_concurrency();
+  threadsNo = std::max<size_t>(
+      1, std::min<size_t>(threadsNo, n / MinBucketsPerThread));
+  if (threadsNo == 1) {
+    function(0, 0, n);
+    return 1;
+  }
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < threadsNo; t++) {
+    threads.emplace_back(function, t, n * t / threadsNo,
+                         n * (t + 1) / threadsNo);
+  }
+  for (std::thread& thread : threads) thread.join();
+  return threadsNo;
 }
 
-template <typename T>
-bool HashTable<T>::exists(T id) const {
-  T hashValue = hash(id);
-  T startingLocation = hashValue % _bucketsNo;
+template <typename V>
+static inline void addScaled(V& value, const V& other, double alpha) {
+  value = value + alpha * other;
+}
 
-  // find the bucket with the correct id
-  for (T i = startingLocation; i < _bucketsNo; i = (i + 1) % _bucketsNo) {
-    int dist = i - startingLocation;
-    if (!_buckets[i].used)
-      return false;
-    else if (dist > i - (hash(_buckets[i].id) % _bucketsNo))
-      return false;
-    else if (_buckets[i].id == id) {
-      return true;
+template <size_t N>
+static inline void addScaled(std::array<float, N>& value,
+                             const std::array<float, N>& other, double alpha) {
+  for (size_t i = 0; i < N; i++) value[i] += alpha * other[i];
+}
+
+template <typename V>
+static inline void scaleValue(V& value, double alpha) {
+  value = value * alpha;
+}
+
+template <size_t N>
+static inline void scaleValue(std::array<float, N>& value, double alpha) {
+  for (size_t i = 0; i < N; i++) value[i] *= alpha;
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::merge(const HashTable<T, V>& other, unsigned threadsNo) {
+  this->axpy(1, other, threadsNo);
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::axpy(double alpha, const HashTable<T, V>& other,
+                           unsigned threadsNo) {
+  this->finishRehash();
+
+  // update the ids present in both tables in parallel, every id has its own
+  // bucket so the threads never write to the same one
+  if (threadsNo == 0) threadsNo = std::thread::hardware_concurrency();
+  std::vector<std::vector<Entry>> missing(std::max(1u, threadsNo));
+  parallelFor(other._bucketsNo, threadsNo,
+              [&](unsigned thread, size_t begin, size_t end) {
+                for (T pos = other.nextUsed(begin); pos < end;
+                     pos = other.nextUsed(pos + 1)) {
+                  T position = findPosition(_ids, _distances, _bucketsNo,
+                                            other._ids[pos]);
+                  if (position != _bucketsNo) {
+                    addScaled(_values[position], other._values[pos], alpha);
+                  } else {
+                    missing[thread].push_back({other._ids[pos],
+                                               other._values[pos]});
+                  }
+                }
+              });
+  for (T pos = other._migratedBucketsNo; pos < other._oldBucketsNo; pos++) {
+    if (other._oldDistances[pos] == 0) continue;
+    T position =
+        findPosition(_ids, _distances, _bucketsNo, other._oldIds[pos]);
+    if (position != _bucketsNo) {
+      addScaled(_values[position], other._oldValues[pos], alpha);
+    } else {
+      missing[0].push_back({other._oldIds[pos], other._oldValues[pos]});
     }
   }
-  return false;
+
+  // then insert the rest, growing at most once
+  T missingNo = 0;
+  for (const std::vector<Entry>& entries : missing) missingNo += entries.size();
+  this->reserve(_usedUpBuckets + missingNo);
+  for (const std::vector<Entry>& entries : missing) {
+    for (const Entry& entry : entries) {
+      ValueType value = ValueType();
+      addScaled(value, entry.value, alpha);
+      this->insertIntoBuckets(entry.id, value);
+    }
+  }
+}
+
+template <typename T, typename V>
+void HashTable<T, V>::scale(double alpha, unsigned threadsNo) {
+  this->finishRehash();
+  parallelFor(_bucketsNo, threadsNo,
+              [&](unsigned, size_t begin, size_t end) {
+                for (T pos = nextUsed(begin); pos < end;
+                     pos = nextUsed(pos + 1)) {
+                  scaleValue(_values[pos], alpha);
+                }
+              });
 }
 
-template <typename T>
-HashTable<T>::~HashTable() {
-  std::free(this->_buckets);
+template <typename T, typename V>
+T HashTable<T, V>::intersect(const HashTable<T, V>& other) {
+  return this->pruneIf(
+      [&other](T id, const ValueType&) { return !other.exists(id); });
 }
 
-template <typename T>
-typename HashTable<T>::Entry HashTable<T>::Iterator::operator*() {
-  typename HashTable<T>::Bucket* b = _ht->_buckets + _position;
+template <typename T, typename V>
+HashTable<T, V>::~HashTable() {
+  std::free(this->_storage);
+  std::free(this->_oldStorage);
+}
+
+template <typename T, typename V>
+typename HashTable<T, V>::Entry HashTable<T, V>::Iterator::operator*() {
   Entry e;
-  e.id = b->id;
-  e.value = b->value;
+  e.id = _ht->_ids[_position];
+  e.value = _ht->_values[_position];
   return e;
 }
 
-template <typename T>
-typename HashTable<T>::Entry HashTable<T>::Iterator::operator->() {
+template <typename T, typename V>
+typename HashTable<T, V>::Entry HashTable<T, V>::Iterator::operator->() {
   return this->operator*();
 }
 
-template <typename T>
-typename HashTable<T>::Iterator HashTable<T>::Iterator::operator++() {
-  for (T newPosition = _position + 1; newPosition < _ht->_bucketsNo;
-       newPosition++) {
-    typename HashTable<T>::Bucket* b = _ht->_buckets + newPosition;
-    if (b->used) {
-      _position = newPosition;
+template <typename T, typename V>
+typename HashTable<T, V>::Iterator HashTable<T, V>::Iterator::operator++() {
+  _position = _ht->nextUsed(_position + 1);
+  if (_position == _ht->_bucketsNo) _position = _ht->end()._position;
+  return *this;
+}
+
+template <typename T, typename V>
+typename HashTable<T, V>::Iterator HashTable<T, V>::Iterator::operator+(
+    T moveBy) {
+  if (moveBy == 0 || _position >= _ht->_bucketsNo) return *this;
+
+  // skip whole words of the bitmap by counting their entries
+  const uint64_t* occupied = _ht->_occupied;
+  T wordsNo = (_ht->_bucketsNo + 63) / 64;
+  T word = _position / 64;
+  uint64_t bits = occupied[word] & (~uint64_t(1) << (_position % 64));
+  for (;;) {
+    T count = __builtin_popcountll(bits);
+    if (count >= moveBy) break;
+    moveBy -= count;
+    if (++word == wordsNo) {
+      _position = _ht->end()._position;
       return *this;
     }
+    bits = occupied[word];
   }
 
-  Iterator end = _ht->end();
-  _position = end._position;
+  // drop the lowest set bits until the wanted entry is the lowest one
+  for (T i = 1; i < moveBy; i++) bits &= bits - 1;
+  _position = word * 64 + __builtin_ctzll(bits);
   return *this;
-  // throw std::out_of_range("The NSL::HashTable doesn't contain any more
-  // entries.");
 }
 
-template <typename T>
-typename HashTable<T>::Iterator HashTable<T>::Iterator::operator+(T moveBy) {
-  for (T i = 0; i < moveBy - 1; ++i) {
-    this->operator++();
-  }
-  return this->operator++();
-}
-
-template <typename T>
-bool HashTable<T>::Iterator::operator!=(const Iterator& other) {
+template <typename T, typename V>
+bool HashTable<T, V>::Iterator::operator!=(const Iterator& other) {
   return (_position != other._position) || (_ht != other._ht);
 }
 
-template <typename T>
-typename HashTable<T>::Iterator HashTable<T>::begin() {
-  for (T pos = 0; pos < _bucketsNo; pos++) {
-    Bucket* b = _buckets + pos;
-    if (b->used) {
-      Iterator it;
-      it._position = pos;
-      it._ht = this;
-      return it;
-    }
-  }
+template <typename T, typename V>
+typename HashTable<T, V>::Iterator HashTable<T, V>::begin() {
+  this->finishRehash();
+  T pos = nextUsed(0);
+  if (pos == _bucketsNo) return this->end();
 
-  return this->end();
+  Iterator it;
+  it._position = pos;
+  it._ht = this;
+  return it;
 }
 
-template <typename T>
-typename HashTable<T>::Iterator HashTable<T>::end() {
+template <typename T, typename V>
+typename HashTable<T, V>::Iterator HashTable<T, V>::end() {
   Iterator it;
   it._position = _bucketsNo + 1;
   it._ht = this;
   return it;
 }
 
-template class HashTable<uint32_t>;
-template class HashTable<uint64_t>;
+template class HashTable<uint32_t, double>;
+template class HashTable<uint32_t, float>;
+template class HashTable<uint32_t, int32_t>;
+template class HashTable<uint32_t, uint16_t>;
+template class HashTable<uint32_t, int16_t>;
+template class HashTable<uint32_t, int8_t>;
+template class HashTable<uint32_t, std::array<float, 2>>;
+template class HashTable<uint32_t, std::array<float, 4>>;
+template class HashTable<uint32_t, std::array<float, 8>>;
+template class HashTable<uint64_t, double>;
+template class HashTable<uint64_t, float>;
+template class HashTable<uint64_t, int32_t>;
+template class HashTable<uint64_t, uint16_t>;
+template class HashTable<uint64_t, int16_t>;
+template class HashTable<uint64_t, int8_t>;
+template class HashTable<uint64_t, std::array<float, 2>>;
+template class HashTable<uint64_t, std::array<float, 4>>;
+template class HashTable<uint64_t, std::array<float, 8>>;
 }
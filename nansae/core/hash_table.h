@@ -17,21 +17,101 @@
 #ifndef NSL_HASH_TABLE_H
 #define NSL_HASH_TABLE_H
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <iostream>
 
 namespace NSL {
+/**
+ * The default value type of the hash tables.
+ */
 typedef double ValueType;
 
-template <typename T>
+/**
+ * A Robin Hood hash table mapping integer ids to values.
+ * The buckets are stored as separate arrays of ids, values and probe
+ * distances, so that probing only touches the distances and the ids.
+ * The table is instantiated for uint32_t and uint64_t ids with double, float,
+ * int32_t, uint16_t, int16_t, int8_t and std::array<float, N> (N = 2, 4, 8)
+ * values.
+ */
+template <typename T, typename V = ValueType>
 class HashTable {
+ public:
+  typedef V ValueType;
+
  private:
-  struct Bucket;
   T _bucketsNo;
-  Bucket* _buckets;
   T _usedUpBuckets = 0;
 
+  /**
+   * A single allocation holding the bucket arrays below.
+   */
+  char* _storage = nullptr;
+  ValueType* _values = nullptr;
+  T* _ids = nullptr;
+
+  /**
+   * The probe distance of each bucket plus one, zero marks an empty bucket.
+   */
+  uint8_t* _distances = nullptr;
+
+  /**
+   * One bit per bucket, set for the used ones, so that iteration can skip
+   * 64 empty buckets at a time.
+   */
+  uint64_t* _occupied = nullptr;
+
+  /**
+   * The share of used buckets above which the table grows.
+   */
+  float _maxLoadFactor = .8f;
+
+  /**
+   * The factor the number of buckets is multiplied by when growing.
+   */
+  float _growthFactor = 2;
+
+  /**
+   * The previous buckets while an incremental rehash is in progress.
+   * The buckets before _migratedBucketsNo have already been moved over and
+   * are ignored, the rest is still looked up and updated in place.
+   */
+  char* _oldStorage = nullptr;
+  ValueType* _oldValues = nullptr;
+  T* _oldIds = nullptr;
+  uint8_t* _oldDistances = nullptr;
+  T _oldBucketsNo = 0;
+  T _oldUsedUpBuckets = 0;
+  T _migratedBucketsNo = 0;
+
+  bool _incrementalRehash = false;
+
+  /**
+   * The number of old buckets migrated by each insert, and the least number
+   * that finishes the pending rehash before the new buckets fill up.
+   */
+  T _rehashStep = 64;
+  T _minRehashStep = 0;
+
+  void allocate(T bucketsNo);
   void rehash(T bucketsNo);
+  void grow();
+  void startRehash(T bucketsNo);
+  void migrate(T bucketsNo);
+  T bucketsNoFor(T entriesNo) const;
+  void markUsed(T position) {
+    _occupied[position / 64] |= uint64_t(1) << (position % 64);
+  }
+  void markEmpty(T position) {
+    _occupied[position / 64] &= ~(uint64_t(1) << (position % 64));
+  }
+  T nextUsed(T position) const;
+  T findPosition(const T* ids, const uint8_t* distances, T bucketsNo,
+                 T id) const;
+  T findOldPosition(T id) const;
+  int insertIntoBuckets(T id, ValueType value);
 
  public:
   struct Entry {
@@ -49,6 +129,14 @@ class HashTable {
    public:
     Entry operator*();
     Entry operator->();
+
+    /**
+     * Access the current entry without copying it.
+     */
+    T id() const { return _ht->_ids[_position]; }
+    const ValueType& value() const { return _ht->_values[_position]; }
+    ValueType& value() { return _ht->_values[_position]; }
+
     Iterator operator++();
     Iterator operator+(T moveBy);
     bool operator!=(const Iterator& other);
@@ -62,16 +150,227 @@ class HashTable {
   HashTable(HashTable&& other);
 
   void writeToStream(std::ostream& os);
+
+  /**
+   * Replaces the table with one written by writeToStream. The table is left
+   * unchanged when the stream can't be read.
+   * \param is The stream to read from.
+   * \throws std::runtime_error for streams of other types, of the old
+   * layout without a header, or with inconsistent buckets.
+   * \throws std::ios_base::failure if the stream ends early.
+   */
   void loadFromStream(std::istream& is);
 
+  /**
+   * Writes only the entries, without the bucket layout, in chunks of
+   * CompactChunkEntriesNo entries written with a single call each.
+   * With delta keys, the entries are sorted by id and each chunk stores the
+   * differences between consecutive ids as varints.
+   * \param os The stream to write to.
+   * \param deltaKeys Whether to delta and varint encode the ids.
+   */
+  void writeCompactToStream(std::ostream& os, bool deltaKeys = true);
+
+  /**
+   * Replaces the entries with ones written by writeCompactToStream, inserted
+   * into a table sized for them up front. The table is left unchanged when
+   * the stream can't be read.
+   * \param is The stream to read from.
+   * \throws std::runtime_error for truncated or unsupported streams.
+   */
+  void loadCompactFromStream(std::istream& is);
+
+  static const T CompactChunkEntriesNo = 1 << 14;
+
   int insert(T id, ValueType value);
   ValueType retrieve(T id) const;
   bool exists(T id) const;
 
-  uint32_t bucketsNo() { return this->_bucketsNo; }
+  /**
+   * Removes an entry. The following entries of the cluster are shifted back
+   * by one bucket, so no tombstones are left behind.
+   * Finishes a pending incremental rehash first.
+   * \param id The id of the entry.
+   * \ret True if the entry existed.
+   */
+  bool erase(T id);
+
+  /**
+   * Removes all entries the predicate holds for in a single pass over the
+   * buckets, shifting the remaining entries back as far as they can go.
+   * Finishes a pending incremental rehash first.
+   * \param predicate Called as predicate(id, value), returns true for the
+   * entries to remove.
+   * \ret The number of removed entries.
+   */
+  template <typename Predicate>
+  T pruneIf(Predicate predicate);
+
+  uint32_t bucketsNo() const { return this->_bucketsNo; }
+
+  /**
+   * Returns the number of entries.
+   */
+  T size() const { return _usedUpBuckets + _oldUsedUpBuckets; }
+
+  /**
+   * Makes room for the given number of entries, so that inserting them
+   * doesn't rehash. Allocates the buckets at once.
+   * \param entriesNo The number of entries.
+   */
+  void reserve(T entriesNo);
+
+  /**
+   * Rehashes the table into the smallest number of buckets that holds its
+   * entries without exceeding the maximal load factor.
+   */
+  void shrinkToFit();
+
+  /**
+   * Sets the share of used buckets above which the table grows.
+   * \param maxLoadFactor The load factor, from (0, 0.95].
+   * \throws std::invalid_argument for load factors out of range.
+   */
+  void setMaxLoadFactor(float maxLoadFactor);
+  float maxLoadFactor() const { return _maxLoadFactor; }
+
+  /**
+   * Sets the factor the number of buckets is multiplied by when growing.
+   * \param growthFactor The factor, greater than one.
+   * \throws std::invalid_argument for factors not greater than one.
+   */
+  void setGrowthFactor(float growthFactor);
+  float growthFactor() const { return _growthFactor; }
+
+  /**
+   * Enables or disables incremental rehashing.
+   * When enabled, growing keeps the old buckets around and every following
+   * insert moves a bounded number of them over, instead of a single insert
+   * reinserting the whole table. Lookups check both sets of buckets until
+   * the rehash is finished. Iterating, serializing, copying, reserving and
+   * shrinking finish a pending rehash first.
+   * \param incremental Whether to rehash incrementally.
+   * \param bucketsPerInsert The number of old buckets each insert migrates,
+   * at least 2. It's raised for a rehash whose new buckets would otherwise
+   * fill up first, e.g. with a small growth factor, and have to be grown at
+   * once.
+   */
+  void setIncrementalRehash(bool incremental, T bucketsPerInsert = 64);
+  bool incrementalRehash() const { return _incrementalRehash; }
+
+  /**
+   * Returns true while an incremental rehash is in progress.
+   */
+  bool rehashing() const { return _oldStorage != nullptr; }
+
+  /**
+   * Migrates all remaining buckets of a pending incremental rehash.
+   */
+  void finishRehash();
+
+  /**
+   * Adds the values of another table to the entries with the same ids,
+   * inserting the ids missing from this table.
+   * \param other The table to add.
+   * \param threadsNo The number of threads, zero to use all cores.
+   */
+  void merge(const HashTable& other, unsigned threadsNo = 0);
+
+  /**
+   * Adds the values of another table multiplied by alpha, this = this +
+   * alpha * other. The buckets of the other table are split into ranges
+   * processed by separate threads, ids found in this table are updated in
+   * place and the missing ones are inserted afterwards. Tables with the same
+   * number of buckets keep the ids of a range close together in both.
+   * Averaging a table over n + 1 models is scale(n / (n + 1.)) followed by
+   * axpy(1 / (n + 1.), other).
+   * \param alpha The factor to multiply the other values by.
+   * \param other The table to add.
+   * \param threadsNo The number of threads, zero to use all cores.
+   */
+  void axpy(double alpha, const HashTable& other, unsigned threadsNo = 0);
+
+  /**
+   * Multiplies all values by alpha.
+   * \param alpha The factor.
+   * \param threadsNo The number of threads, zero to use all cores.
+   */
+  void scale(double alpha, unsigned threadsNo = 0);
+
+  /**
+   * Removes the entries whose ids aren't in the other table.
+   * \param other The table to intersect with.
+   * \ret The number of removed entries.
+   */
+  T intersect(const HashTable& other);
+
+  /**
+   * Calls the function for every entry, without finishing a pending
+   * incremental rehash and without copying the values.
+   * \param function Called as function(id, value), with the value passed
+   * by const reference.
+   */
+  template <typename Function>
+  void forEach(Function function) const;
 
   Iterator begin();
   Iterator end();
 };
+
+template <typename T, typename V>
+template <typename Function>
+void HashTable<T, V>::forEach(Function function) const {
+  for (T pos = nextUsed(0); pos < _bucketsNo; pos = nextUsed(pos + 1)) {
+    function(_ids[pos], static_cast<const ValueType&>(_values[pos]));
+  }
+  for (T pos = _migratedBucketsNo; pos < _oldBucketsNo; pos++) {
+    if (_oldDistances[pos] == 0) continue;
+    function(_oldIds[pos], static_cast<const ValueType&>(_oldValues[pos]));
+  }
+}
+
+template <typename T, typename V>
+template <typename Predicate>
+T HashTable<T, V>::pruneIf(Predicate predicate) {
+  this->finishRehash();
+  if (_usedUpBuckets == 0) return 0;
+
+  // start at an empty bucket or an entry in its desired bucket, no entry is
+  // shifted back across either of them
+  T start = 0;
+  while (_distances[start] > 1) start++;
+
+  T removedNo = 0;
+  T holesNo = 0;  // empty buckets right before the current one in a cluster
+  T position = start;
+  for (T i = 0; i < _bucketsNo; i++) {
+    if (_distances[position] == 0) {
+      holesNo = 0;
+    } else if (predicate(_ids[position], _values[position])) {
+      _distances[position] = 0;
+      this->markEmpty(position);
+      removedNo++;
+      holesNo++;
+    } else {
+      // an entry can't move in front of its desired bucket
+      T shift = std::min<T>(holesNo, _distances[position] - 1);
+      if (shift > 0) {
+        T target = position >= shift ? position - shift
+                                     : position + _bucketsNo - shift;
+        _ids[target] = _ids[position];
+        _values[target] = _values[position];
+        _distances[target] = _distances[position] - shift;
+        _distances[position] = 0;
+        this->markUsed(target);
+        this->markEmpty(position);
+      }
+      holesNo = shift;
+    }
+    if (++position == _bucketsNo) position = 0;
+  }
+
+  _usedUpBuckets -= removedNo;
+  return removedNo;
+}
 }
 #endif  // NSL_HASH_TABLE_H
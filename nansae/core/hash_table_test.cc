@@ -17,8 +17,11 @@
 #include "nansae/core/hash_table.h"
 #include "gtest/gtest.h"
 
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <unordered_map>
+#include <vector>
 
 TEST(HashTable, test32) {
   NSL::HashTable<uint32_t> ht(65536);
@@ -102,3 +105,385 @@ TEST(HashTable, iteration) {
   }
   ASSERT_EQ(i, 0);
 }
+
+TEST(HashTable, writeOnlyUsedBuckets) {
+  NSL::HashTable<uint64_t> ht(1024);
+  for (uint64_t i = 0; i < 500; i++) {
+    ht.insert(i * 7919, 0.5 * i);
+  }
+
+  std::stringstream s;
+  ht.writeToStream(s);
+  // the header, buckets no, used up buckets no, a distance byte per bucket
+  // and the occupied ids and values
+  ASSERT_EQ(s.str().size(), 8 + 2 * sizeof(uint64_t) + 1024 +
+                                500 * (sizeof(uint64_t) + sizeof(double)));
+
+  NSL::HashTable<uint64_t> ht2(s);
+  int i = 0;
+  for (NSL::HashTable<uint64_t>::Entry e : ht2) {
+    ASSERT_EQ(e.id % 7919, 0);
+    ASSERT_DOUBLE_EQ(e.value, 0.5 * (e.id / 7919));
+    i++;
+  }
+  ASSERT_EQ(i, 500);
+  ASSERT_EQ(ht2.exists(7919 * 500), false);
+}
+
+TEST(HashTable, malformedStreams) {
+  NSL::HashTable<uint64_t> ht(1024);
+  for (uint64_t i = 0; i < 500; i++) ht.insert(i * 7919, 0.5 * i);
+  std::stringstream s;
+  ht.writeToStream(s);
+  std::string image = s.str();
+
+  NSL::HashTable<uint64_t> loaded;
+  loaded.insert(7, 3.5);
+  auto rejects = [&loaded](const std::string& stream) {
+    std::stringstream is(stream);
+    EXPECT_THROW(loaded.loadFromStream(is), std::runtime_error);
+    EXPECT_EQ(loaded.size(), 1);
+    EXPECT_EQ(loaded.retrieve(7), 3.5);
+  };
+
+  // the layout without a header
+  rejects(image.substr(8));
+  // other value types
+  NSL::HashTable<uint64_t, float> floats(16);
+  std::stringstream fs;
+  floats.writeToStream(fs);
+  rejects(fs.str());
+
+  // a distance lookups would never probe that far
+  std::string farDistance = image;
+  size_t distances = 8 + 2 * sizeof(uint64_t);
+  size_t used = image.find_first_not_of('\0', distances);
+  farDistance[used] = (char)255;
+  rejects(farDistance);
+
+  // fewer occupied buckets than the count says
+  std::string missingEntry = image;
+  missingEntry[used] = 0;
+  rejects(missingEntry);
+}
+
+TEST(HashTable, valueTypes) {
+  NSL::HashTable<uint64_t, float> floats(16);
+  NSL::HashTable<uint32_t, uint16_t> counts(16);
+  NSL::HashTable<uint64_t, std::array<float, 4>> vectors(16);
+
+  for (uint32_t i = 0; i < 1000; i++) {
+    floats.insert(i, 0.25f * i);
+    counts.insert(i, i % 300);
+    vectors.insert(i, {{1.f * i, 2.f * i, 3.f * i, 4.f * i}});
+  }
+
+  std::stringstream fs, cs, vs;
+  floats.writeToStream(fs);
+  counts.writeToStream(cs);
+  vectors.writeToStream(vs);
+
+  NSL::HashTable<uint64_t, float> floats2(fs);
+  NSL::HashTable<uint32_t, uint16_t> counts2(cs);
+  NSL::HashTable<uint64_t, std::array<float, 4>> vectors2(vs);
+
+  for (uint32_t i = 0; i < 1000; i++) {
+    ASSERT_FLOAT_EQ(floats2.retrieve(i), 0.25f * i);
+    ASSERT_EQ(counts2.retrieve(i), i % 300);
+    std::array<float, 4> v = vectors2.retrieve(i);
+    ASSERT_FLOAT_EQ(v[0], 1.f * i);
+    ASSERT_FLOAT_EQ(v[3], 4.f * i);
+  }
+
+  ASSERT_EQ(counts2.retrieve(1000), 0);
+  std::array<float, 4> missing = vectors2.retrieve(1000);
+  ASSERT_FLOAT_EQ(missing[0], 0.f);
+}
+
+TEST(HashTable, reserveAndShrink) {
+  NSL::HashTable<uint64_t> ht(16);
+  ht.setMaxLoadFactor(.5f);
+  ht.reserve(10000);
+  uint32_t reservedBucketsNo = ht.bucketsNo();
+  ASSERT_GE(reservedBucketsNo, 20000);
+  ASSERT_LT(reservedBucketsNo, 20010);
+
+  for (uint64_t i = 0; i < 10000; i++) ht.insert(i, i);
+  ASSERT_EQ(ht.bucketsNo(), reservedBucketsNo);
+  ASSERT_EQ(ht.size(), 10000);
+
+  // updating existing ids never grows the table
+  for (uint64_t i = 0; i < 10000; i++) ht.insert(i, 2.0 * i);
+  ASSERT_EQ(ht.bucketsNo(), reservedBucketsNo);
+
+  ht.setMaxLoadFactor(.9f);
+  ht.shrinkToFit();
+  ASSERT_LT(ht.bucketsNo(), 11200);
+  for (uint64_t i = 0; i < 10000; i++) {
+    ASSERT_DOUBLE_EQ(ht.retrieve(i), 2.0 * i);
+  }
+
+  ht.setGrowthFactor(1.5f);
+  uint32_t bucketsNo = ht.bucketsNo();
+  for (uint64_t i = 10000; i < 11200; i++) ht.insert(i, i);
+  ASSERT_LE(ht.bucketsNo(), bucketsNo * 1.5 + 1);
+
+  ASSERT_THROW(ht.setMaxLoadFactor(1.f), std::invalid_argument);
+  ASSERT_THROW(ht.setGrowthFactor(1.f), std::invalid_argument);
+
+  NSL::HashTable<uint32_t> empty(0);
+  ASSERT_EQ(empty.exists(1), false);
+  empty.insert(1, 1.5);
+  ASSERT_DOUBLE_EQ(empty.retrieve(1), 1.5);
+}
+
+TEST(HashTable, incrementalRehash) {
+  NSL::HashTable<uint32_t> ht(16);
+  ht.setIncrementalRehash(true, 4);
+
+  // fill the table until it starts a rehash
+  uint32_t inserted = 0;
+  while (!ht.rehashing()) {
+    ASSERT_EQ(ht.insert(inserted, inserted * 2.0), 0);
+    inserted++;
+  }
+  uint32_t bucketsNo = ht.bucketsNo();
+
+  // everything is reachable while the buckets are being migrated
+  for (uint32_t i = 0; i < inserted; i++) {
+    EXPECT_EQ(ht.retrieve(i), i * 2.0);
+    EXPECT_TRUE(ht.exists(i));
+  }
+  EXPECT_EQ(ht.size(), inserted);
+
+  // updates of entries that weren't migrated yet are kept
+  EXPECT_EQ(ht.insert(inserted - 1, -1.0), 1);
+  EXPECT_EQ(ht.retrieve(inserted - 1), -1.0);
+  ht.insert(inserted - 1, (inserted - 1) * 2.0);
+
+  // each insert migrates a few buckets, so the rehash ends without growing
+  while (ht.rehashing()) {
+    ht.insert(inserted, inserted * 2.0);
+    inserted++;
+  }
+  EXPECT_EQ(ht.bucketsNo(), bucketsNo);
+
+  for (uint32_t i = 0; i < 10000; i++) {
+    ht.insert(inserted, inserted * 2.0);
+    inserted++;
+    ASSERT_EQ(ht.size(), inserted);
+  }
+  for (uint32_t i = 0; i < inserted; i++) {
+    ASSERT_EQ(ht.retrieve(i), i * 2.0);
+  }
+
+  // copying and serializing see the same entries as a finished rehash
+  while (!ht.rehashing()) {
+    ht.insert(inserted, inserted * 2.0);
+    inserted++;
+  }
+  NSL::HashTable<uint32_t> copy(ht);
+  EXPECT_FALSE(copy.rehashing());
+  std::stringstream ss;
+  ht.writeToStream(ss);
+  EXPECT_FALSE(ht.rehashing());
+  NSL::HashTable<uint32_t> loaded(ss);
+  EXPECT_EQ(copy.size(), inserted);
+  EXPECT_EQ(loaded.size(), inserted);
+  for (uint32_t i = 0; i < inserted; i++) {
+    ASSERT_EQ(copy.retrieve(i), i * 2.0);
+    ASSERT_EQ(loaded.retrieve(i), i * 2.0);
+  }
+}
+
+TEST(HashTable, incrementalRehashSmallGrowth) {
+  // growing by a quarter leaves room for fewer inserts than there are old
+  // buckets, a step of 2 alone couldn't keep up
+  NSL::HashTable<uint32_t> ht(64);
+  ht.setGrowthFactor(1.25);
+  ht.setIncrementalRehash(true, 2);
+
+  uint32_t rehashes = 0;
+  for (uint32_t i = 0; i < 50000; i++) {
+    bool rehashing = ht.rehashing();
+    uint32_t bucketsNo = ht.bucketsNo();
+    ht.insert(i, i * 2.0);
+    // the new buckets never grow while the old ones are migrated
+    if (rehashing) ASSERT_EQ(ht.bucketsNo(), bucketsNo);
+    if (!rehashing && ht.rehashing()) rehashes++;
+  }
+  ASSERT_GT(rehashes, 10);
+  for (uint32_t i = 0; i < 50000; i++) ASSERT_EQ(ht.retrieve(i), i * 2.0);
+}
+
+TEST(HashTable, erase) {
+  NSL::HashTable<uint32_t> ht(64);
+  std::unordered_map<uint32_t, double> reference;
+  uint32_t seed = 7;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t id = (seed >> 8) % 4096;
+    if (seed % 3 == 0) {
+      ASSERT_EQ(ht.erase(id), reference.erase(id) == 1);
+    } else {
+      ht.insert(id, i);
+      reference[id] = i;
+    }
+  }
+
+  ASSERT_EQ(ht.size(), reference.size());
+  for (uint32_t id = 0; id < 4096; id++) {
+    ASSERT_EQ(ht.exists(id), reference.count(id) == 1);
+    if (reference.count(id)) {
+      ASSERT_EQ(ht.retrieve(id), reference[id]);
+    }
+  }
+  ASSERT_FALSE(ht.erase(5000));
+}
+
+TEST(HashTable, pruneIf) {
+  NSL::HashTable<uint64_t> ht(16);
+  for (uint64_t i = 0; i < 10000; i++) ht.insert(i * 7919, i % 10 - 4.5);
+
+  uint64_t removedNo = ht.pruneIf(
+      [](uint64_t /*id*/, double value) { return std::abs(value) < 2; });
+  ASSERT_EQ(removedNo, 4000);
+  ASSERT_EQ(ht.size(), 6000);
+
+  uint64_t iterated = 0;
+  for (NSL::HashTable<uint64_t>::Entry e : ht) {
+    ASSERT_GE(std::abs(e.value), 2);
+    iterated++;
+  }
+  ASSERT_EQ(iterated, 6000);
+  for (uint64_t i = 0; i < 10000; i++) {
+    ASSERT_EQ(ht.exists(i * 7919), std::abs(i % 10 - 4.5) >= 2);
+    if (std::abs(i % 10 - 4.5) >= 2) {
+      ASSERT_EQ(ht.retrieve(i * 7919), i % 10 - 4.5);
+    }
+  }
+
+  ASSERT_EQ(ht.pruneIf([](uint64_t, double) { return true; }), 6000);
+  ASSERT_EQ(ht.size(), 0);
+  ASSERT_FALSE(ht.begin() != ht.end());
+}
+
+TEST(HashTable, sparseIteration) {
+  NSL::HashTable<uint32_t> ht(16);
+  ht.reserve(100000);
+  for (uint32_t i = 0; i < 300; i++) ht.insert(i * 31, i);
+
+  std::vector<uint32_t> ids;
+  for (auto it = ht.begin(); it != ht.end(); ++it) {
+    ASSERT_EQ(it.value(), it.id() / 31);
+    ids.push_back(it.id());
+  }
+  ASSERT_EQ(ids.size(), 300);
+
+  // moving by several entries lands where stepping one by one does
+  for (uint32_t moveBy : {1, 2, 63, 64, 65, 150, 299}) {
+    auto it = ht.begin();
+    it + moveBy;
+    ASSERT_EQ(it.id(), ids[moveBy]);
+  }
+  auto it = ht.begin();
+  it + 300;
+  ASSERT_FALSE(it != ht.end());
+
+  double sum = 0;
+  uint32_t visited = 0;
+  ht.forEach([&](uint32_t /*id*/, const double& value) {
+    sum += value;
+    visited++;
+  });
+  ASSERT_EQ(visited, 300);
+  ASSERT_EQ(sum, 299 * 300 / 2);
+
+  // forEach also sees the entries that weren't migrated yet
+  NSL::HashTable<uint32_t> incremental(16);
+  incremental.setIncrementalRehash(true, 2);
+  uint32_t inserted = 0;
+  while (!incremental.rehashing()) incremental.insert(inserted++, 1);
+  visited = 0;
+  incremental.forEach([&](uint32_t, const double&) { visited++; });
+  ASSERT_EQ(visited, inserted);
+}
+
+TEST(HashTable, bulkOperations) {
+  NSL::HashTable<uint64_t> a(16), b(16);
+  for (uint64_t i = 0; i < 100000; i++) a.insert(i, i);
+  for (uint64_t i = 50000; i < 150000; i++) b.insert(i, 1);
+
+  a.merge(b, 4);
+  ASSERT_EQ(a.size(), 150000);
+  for (uint64_t i = 0; i < 150000; i++) {
+    double expected = (i < 100000 ? i : 0) + (i >= 50000 ? 1 : 0);
+    ASSERT_EQ(a.retrieve(i), expected);
+  }
+
+  // averaging the third model into the first two
+  a.scale(2 / 3., 4);
+  a.axpy(1 / 3., b, 4);
+  for (uint64_t i = 0; i < 150000; i += 7) {
+    double expected = (i < 100000 ? i : 0) + (i >= 50000 ? 1 : 0);
+    expected = expected * 2 / 3. + (i >= 50000 ? 1 / 3. : 0);
+    ASSERT_DOUBLE_EQ(a.retrieve(i), expected);
+  }
+
+  ASSERT_EQ(a.intersect(b), 50000);
+  ASSERT_EQ(a.size(), 100000);
+  ASSERT_FALSE(a.exists(49999));
+  ASSERT_TRUE(a.exists(50000));
+
+  NSL::HashTable<uint32_t, std::array<float, 2>> vectors(16), other(16);
+  vectors.insert(1, {{1.f, 2.f}});
+  other.insert(1, {{1.f, 1.f}});
+  other.insert(2, {{2.f, 4.f}});
+  vectors.axpy(.5, other);
+  vectors.scale(2);
+  ASSERT_FLOAT_EQ(vectors.retrieve(1)[0], 3.f);
+  ASSERT_FLOAT_EQ(vectors.retrieve(1)[1], 5.f);
+  ASSERT_FLOAT_EQ(vectors.retrieve(2)[0], 2.f);
+  ASSERT_FLOAT_EQ(vectors.retrieve(2)[1], 4.f);
+}
+
+TEST(HashTable, compactStream) {
+  NSL::HashTable<uint64_t> ht(16);
+  for (uint64_t i = 0; i < 40000; i++) ht.insert(i * 3 + (i % 5), i * .5);
+
+  std::stringstream full, delta, raw;
+  ht.writeToStream(full);
+  ht.writeCompactToStream(delta);
+  ht.writeCompactToStream(raw, false);
+  ASSERT_LT(delta.str().size(), raw.str().size());
+  ASSERT_LT(raw.str().size(), full.str().size());
+
+  for (std::stringstream* ss : {&delta, &raw}) {
+    NSL::HashTable<uint64_t> loaded(4);
+    loaded.insert(1000000, 1);
+    loaded.loadCompactFromStream(*ss);
+    ASSERT_EQ(loaded.size(), 40000);
+    ASSERT_FALSE(loaded.exists(1000000));
+    ASSERT_LE(loaded.bucketsNo(), 40000 / loaded.maxLoadFactor() + 1);
+    for (uint64_t i = 0; i < 40000; i++) {
+      ASSERT_EQ(loaded.retrieve(i * 3 + (i % 5)), i * .5);
+    }
+  }
+
+  // a failed load leaves the table as it was
+  std::stringstream truncated(delta.str().substr(0, 1000));
+  NSL::HashTable<uint64_t> loaded;
+  loaded.insert(7, 3.5);
+  ASSERT_THROW(loaded.loadCompactFromStream(truncated), std::runtime_error);
+  ASSERT_EQ(loaded.size(), 1);
+  ASSERT_EQ(loaded.retrieve(7), 3.5);
+
+  // so does a chunk larger than any the writer makes
+  std::string oversized = raw.str();
+  uint32_t chunkEntriesNo = 30000;
+  std::memcpy(&oversized[10], &chunkEntriesNo, sizeof(chunkEntriesNo));
+  std::stringstream oversizedStream(oversized);
+  ASSERT_THROW(loaded.loadCompactFromStream(oversizedStream),
+               std::runtime_error);
+  ASSERT_EQ(loaded.size(), 1);
+}
@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/perfect_hash_table.h"
+#include "nansae/core/hash.h"
+#include "nansae/core/stream_binary_io.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace NSL {
+
+/* SERIALIZATION FORMAT
+ * [(Header)header, (uint16_t[buckets no])pilots,
+ *  (T[positions no - entries no])remap,
+ *  (uint8_t[entries no * fingerprint bytes])fingerprints,
+ *  (V[entries no])values]
+ * Every array starts at an offset aligned to 8 bytes.
+ */
+
+/**
+ * The first bytes of every image and the version of its layout.
+ */
+static const char PerfectHashTableMagic[4] = {'N', 'S', 'L', 'P'};
+static const uint16_t PerfectHashTableVersion = 1;
+
+template <typename T, typename V>
+struct PerfectHashTable<T, V>::Header {
+  char magic[4];
+  uint16_t version;
+
+  /**
+   * The widths of T and V, so that an image isn't read with other types.
+   */
+  uint8_t idBytes;
+  uint8_t valueBytes;
+
+  uint64_t entriesNo;
+  uint64_t positionsNo;
+  uint64_t bucketsNo;
+  uint64_t seed;
+  uint64_t fingerprintBytes;
+};
+
+/**
+ * The offsets of the arrays in a serialized image.
+ */
+struct PerfectHashTableLayout {
+  size_t pilots;
+  size_t remap;
+  size_t fingerprints;
+  size_t values;
+  size_t size;
+};
+
+static inline size_t alignUp(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+template <typename T, typename V, typename H>
+static PerfectHashTableLayout layoutFor(const H& header) {
+  PerfectHashTableLayout layout;
+  layout.pilots = alignUp(sizeof(H), 8);
+  layout.remap = alignUp(
+      layout.pilots + header.bucketsNo * sizeof(uint16_t), 8);
+  layout.fingerprints = alignUp(
+      layout.remap + (header.positionsNo - header.entriesNo) * sizeof(T), 8);
+  layout.values = alignUp(
+      layout.fingerprints + header.entriesNo * header.fingerprintBytes, 8);
+  layout.size =
+      alignUp(layout.values + header.entriesNo * sizeof(V), 8);
+  return layout;
+}
+
+/**
+ * Checks that an image was written by a table of the same types and that
+ * its header describes a valid layout.
+ * \throws std::runtime_error if it doesn't.
+ */
+template <typename T, typename V, typename H>
+static void checkHeader(const H& header) {
+  if (std::memcmp(header.magic, PerfectHashTableMagic,
+                  sizeof(PerfectHashTableMagic)) != 0) {
+    throw std::runtime_error("Not an NSL::PerfectHashTable image.");
+  }
+  if (header.version > PerfectHashTableVersion) {
+    throw std::runtime_error(
+        "The NSL::PerfectHashTable version isn't supported.");
+  }
+  if (header.idBytes != sizeof(T) || header.valueBytes != sizeof(V)) {
+    throw std::runtime_error(
+        "The NSL::PerfectHashTable image has other id or value types.");
+  }
+  // bounds the counts so that computing the layout can't overflow
+  const uint64_t maxCount = std::numeric_limits<size_t>::max() / 64;
+  uint64_t f = header.fingerprintBytes;
+  if (header.bucketsNo == 0 || header.positionsNo <= header.entriesNo ||
+      header.bucketsNo > maxCount || header.positionsNo > maxCount ||
+      (f != 0 && f != 1 && f != 2 && f != sizeof(T))) {
+    throw std::runtime_error("The NSL::PerfectHashTable image is corrupt.");
+  }
+}
+
+static inline uint64_t keyHash(uint64_t id, uint64_t seed) {
+  return hash(id ^ seed);
+}
+
+static inline uint64_t pilotPosition(uint64_t keyHash, uint16_t pilot,
+                                     uint64_t positionsNo) {
+  return hash(keyHash ^ hash((uint64_t)(pilot + 0x9e3779b97f4a7c15ull))) %
+         positionsNo;
+}
+
+static inline uint64_t fingerprint(uint64_t keyHash) {
+  return hash(keyHash + 1);
+}
+
+template <typename T, typename V>
+PerfectHashTable<T, V>::PerfectHashTable(const HashTable<T, V>& table,
+                                         unsigned fingerprintBits) {
+  if (fingerprintBits != 0 && fingerprintBits != 8 && fingerprintBits != 16 &&
+      fingerprintBits != sizeof(T) * 8) {
+    throw std::invalid_argument(
+        "The fingerprint must be 0, 8, 16 bits or the width of the id.");
+  }
+
+  std::vector<T> ids;
+  std::vector<V> values;
+  ids.reserve(table.size());
+  values.reserve(table.size());
+  table.forEach([&ids, &values](T id, const V& value) {
+    ids.push_back(id);
+    values.push_back(value);
+  });
+
+  Header header;
+  std::memcpy(header.magic, PerfectHashTableMagic, sizeof(header.magic));
+  header.version = PerfectHashTableVersion;
+  header.idBytes = sizeof(T);
+  header.valueBytes = sizeof(V);
+  header.entriesNo = ids.size();
+  header.positionsNo = header.entriesNo + header.entriesNo / 32 + 1;
+  header.bucketsNo = header.entriesNo / 4 + 1;
+  header.seed = 0;
+  header.fingerprintBytes = fingerprintBits / 8;
+
+  std::vector<uint16_t> pilots(header.bucketsNo);
+  std::vector<uint64_t> positions(header.entriesNo);
+  std::vector<bool> taken;
+
+  for (;; header.seed++) {
+    // 1. sort the ids into their buckets
+    std::vector<uint32_t> bucketStart(header.bucketsNo + 1, 0);
+    for (T id : ids) {
+      bucketStart[keyHash(id, header.seed) % header.bucketsNo + 1]++;
+    }
+    uint32_t largestBucket = 0;
+    for (uint64_t b = 0; b < header.bucketsNo; b++) {
+      largestBucket = std::max(largestBucket, bucketStart[b + 1]);
+      bucketStart[b + 1] += bucketStart[b];
+    }
+    std::vector<uint32_t> bucketed(ids.size());
+    std::vector<uint32_t> filled(bucketStart.begin(), bucketStart.end() - 1);
+    for (uint32_t i = 0; i < ids.size(); i++) {
+      uint64_t b = keyHash(ids[i], header.seed) % header.bucketsNo;
+      bucketed[filled[b]++] = i;
+    }
+
+    // 2. place the largest buckets first while there's the most room
+    std::vector<std::vector<uint64_t>> bucketsBySize(largestBucket + 1);
+    for (uint64_t b = 0; b < header.bucketsNo; b++) {
+      bucketsBySize[bucketStart[b + 1] - bucketStart[b]].push_back(b);
+    }
+
+    taken.assign(header.positionsNo, false);
+    bool placedAll = true;
+    std::vector<uint64_t> bucketPositions;
+    for (uint32_t size = largestBucket; size > 0 && placedAll; size--) {
+      for (uint64_t b : bucketsBySize[size]) {
+        bool placed = false;
+        for (uint32_t pilot = 0; pilot <= UINT16_MAX && !placed; pilot++) {
+          bucketPositions.clear();
+          placed = true;
+          for (uint32_t k = bucketStart[b]; k < bucketStart[b + 1]; k++) {
+            uint64_t p =
+                pilotPosition(keyHash(ids[bucketed[k]], header.seed), pilot,
+                              header.positionsNo);
+            bool collides = taken[p];
+            for (uint64_t other : bucketPositions) collides |= (other == p);
+            if (collides) {
+              placed = false;
+              break;
+            }
+            bucketPositions.push_back(p);
+          }
+          if (placed) {
+            pilots[b] = pilot;
+            for (uint32_t k = bucketStart[b]; k < bucketStart[b + 1]; k++) {
+              uint64_t p = bucketPositions[k - bucketStart[b]];
+              taken[p] = true;
+              positions[bucketed[k]] = p;
+            }
+          }
+        }
+        if (!placed) {
+          placedAll = false;
+          break;
+        }
+      }
+    }
+    if (placedAll) break;
+  }
+
+  // 3. allocate and fill the image, remapping the positions past the number
+  // of entries into the free positions below it
+  PerfectHashTableLayout layout = layoutFor<T, V>(header);
+  _storage = (char*)std::calloc(layout.size, 1);
+  if (_storage == nullptr) throw std::bad_alloc();
+  std::memcpy(_storage, &header, sizeof(Header));
+  this->mapImage(_storage, layout.size);
+
+  std::memcpy(_storage + layout.pilots, pilots.data(),
+              pilots.size() * sizeof(uint16_t));
+  T* remap = (T*)(_storage + layout.remap);
+  uint64_t freePosition = 0;
+  for (uint64_t p = header.entriesNo; p < header.positionsNo; p++) {
+    if (!taken[p]) continue;
+    while (taken[freePosition]) freePosition++;
+    remap[p - header.entriesNo] = freePosition++;
+  }
+
+  uint8_t* fingerprints = (uint8_t*)(_storage + layout.fingerprints);
+  V* finalValues = (V*)(_storage + layout.values);
+  for (uint64_t i = 0; i < ids.size(); i++) {
+    uint64_t p = positions[i];
+    if (p >= header.entriesNo) p = remap[p - header.entriesNo];
+    finalValues[p] = values[i];
+
+    uint64_t f = fingerprint(keyHash(ids[i], header.seed));
+    if (header.fingerprintBytes == sizeof(T)) {
+      ((T*)fingerprints)[p] = ids[i];
+    } else if (header.fingerprintBytes == 2) {
+      ((uint16_t*)fingerprints)[p] = (uint16_t)f;
+    } else if (header.fingerprintBytes == 1) {
+      fingerprints[p] = (uint8_t)f;
+    }
+  }
+}
+
+template <typename T, typename V>
+PerfectHashTable<T, V>::PerfectHashTable(std::istream& is) {
+  this->loadFromStream(is);
+}
+
+template <typename T, typename V>
+PerfectHashTable<T, V>::PerfectHashTable(const char* image, size_t size) {
+  this->mapImage(image, size);
+}
+
+template <typename T, typename V>
+PerfectHashTable<T, V>::PerfectHashTable(PerfectHashTable<T, V>&& other)
+    : _storage(other._storage),
+      _header(other._header),
+      _pilots(other._pilots),
+      _remap(other._remap),
+      _fingerprints(other._fingerprints),
+      _values(other._values) {
+  other._storage = nullptr;
+  other._header = nullptr;
+}
+
+template <typename T, typename V>
+PerfectHashTable<T, V>::~PerfectHashTable() {
+  std::free(_storage);
+}
+
+template <typename T, typename V>
+void PerfectHashTable<T, V>::mapImage(const char* image, size_t size) {
+  if (size < sizeof(Header)) {
+    throw std::runtime_error("The NSL::PerfectHashTable image is truncated.");
+  }
+  checkHeader<T, V>(*(const Header*)image);
+  PerfectHashTableLayout layout = layoutFor<T, V>(*(const Header*)image);
+  if (size < layout.size) {
+    throw std::runtime_error("The NSL::PerfectHashTable image is truncated.");
+  }
+  _header = (const Header*)image;
+  _pilots = (const uint16_t*)(image + layout.pilots);
+  _remap = (const T*)(image + layout.remap);
+  _fingerprints = (const uint8_t*)(image + layout.fingerprints);
+  _values = (const V*)(image + layout.values);
+}
+
+template <typename T, typename V>
+void PerfectHashTable<T, V>::writeToStream(std::ostream& os) {
+  StreamBinaryWriter writer(os);
+  writer.writeBytes((const char*)_header, imageSize());
+  writer.flush();
+}
+
+template <typename T, typename V>
+void PerfectHashTable<T, V>::loadFromStream(std::istream& is) {
+  // the image is read as is, in the host's byte order like a mapped one,
+  // and replaces the table only once all of it has been read
+  StreamBinaryReader reader(is);
+  Header header;
+  reader.readBytes((char*)&header, sizeof(Header));
+  checkHeader<T, V>(header);
+  size_t size = layoutFor<T, V>(header).size;
+
+  char* storage = (char*)std::malloc(size);
+  if (storage == nullptr) throw std::bad_alloc();
+  std::memcpy(storage, &header, sizeof(Header));
+  try {
+    reader.readBytes(storage + sizeof(Header), size - sizeof(Header));
+  } catch (...) {
+    std::free(storage);
+    throw;
+  }
+  std::free(_storage);
+  _storage = storage;
+  this->mapImage(_storage, size);
+}
+
+template <typename T, typename V>
+uint64_t PerfectHashTable<T, V>::position(T id) const {
+  uint64_t h = keyHash(id, _header->seed);
+  uint64_t p = pilotPosition(h, _pilots[h % _header->bucketsNo],
+                             _header->positionsNo);
+  if (p >= _header->entriesNo) p = _remap[p - _header->entriesNo];
+  return p;
+}
+
+template <typename T, typename V>
+bool PerfectHashTable<T, V>::matchesFingerprint(uint64_t position,
+                                                T id) const {
+  if (_header->fingerprintBytes == sizeof(T)) {
+    return ((const T*)_fingerprints)[position] == id;
+  }
+
+  uint64_t f = fingerprint(keyHash(id, _header->seed));
+  if (_header->fingerprintBytes == 2) {
+    return ((const uint16_t*)_fingerprints)[position] == (uint16_t)f;
+  } else if (_header->fingerprintBytes == 1) {
+    return _fingerprints[position] == (uint8_t)f;
+  }
+  return true;
+}
+
+template <typename T, typename V>
+V PerfectHashTable<T, V>::retrieve(T id) const {
+  if (_header->entriesNo == 0) return ValueType();
+  uint64_t p = position(id);
+  if (!matchesFingerprint(p, id)) return ValueType();
+  return _values[p];
+}
+
+template <typename T, typename V>
+bool PerfectHashTable<T, V>::exists(T id) const {
+  if (_header->entriesNo == 0) return false;
+  return matchesFingerprint(position(id), id);
+}
+
+template <typename T, typename V>
+uint64_t PerfectHashTable<T, V>::size() const {
+  return _header->entriesNo;
+}
+
+template <typename T, typename V>
+size_t PerfectHashTable<T, V>::imageSize() const {
+  return layoutFor<T, V>(*_header).size;
+}
+
+template class PerfectHashTable<uint32_t, double>;
+template class PerfectHashTable<uint32_t, float>;
+template class PerfectHashTable<uint32_t, int32_t>;
+template class PerfectHashTable<uint32_t, uint16_t>;
+template class PerfectHashTable<uint32_t, int16_t>;
+template class PerfectHashTable<uint32_t, int8_t>;
+template class PerfectHashTable<uint32_t, std::array<float, 2>>;
+template class PerfectHashTable<uint32_t, std::array<float, 4>>;
+template class PerfectHashTable<uint32_t, std::array<float, 8>>;
+template class PerfectHashTable<uint64_t, double>;
+template class PerfectHashTable<uint64_t, float>;
+template class PerfectHashTable<uint64_t, int32_t>;
+template class PerfectHashTable<uint64_t, uint16_t>;
+template class PerfectHashTable<uint64_t, int16_t>;
+template class PerfectHashTable<uint64_t, int8_t>;
+template class PerfectHashTable<uint64_t, std::array<float, 2>>;
+template class PerfectHashTable<uint64_t, std::array<float, 4>>;
+template class PerfectHashTable<uint64_t, std::array<float, 8>>;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NSL_PERFECT_HASH_TABLE_H
+#define NSL_PERFECT_HASH_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+#include "nansae/core/hash_table.h"
+
+namespace NSL {
+/**
+ * A read-only table built from a populated NSL::HashTable using a minimal
+ * perfect hash function, so it has no empty buckets.
+ * Every id is hashed into a small bucket and each bucket stores a 16-bit
+ * pilot that moves its ids to free positions (PTHash). The positions past
+ * the number of entries are remapped into the holes left below it, which
+ * makes the table minimal.
+ *
+ * Instead of the full ids the table can keep a short fingerprint per entry
+ * or nothing at all. With a fingerprint of b bits an id that was never in
+ * the table is reported to exist (and retrieves another id's value) with a
+ * probability of 2^-b; without any fingerprint it always is.
+ *
+ * The serialized table is a flat image that can be used in place, e.g. from
+ * a memory mapped file.
+ */
+template <typename T, typename V = ValueType>
+class PerfectHashTable {
+ public:
+  typedef V ValueType;
+
+ private:
+  struct Header;
+
+  /**
+   * The serialized image when owned by the table, nullptr for views.
+   */
+  char* _storage = nullptr;
+
+  const Header* _header = nullptr;
+  const uint16_t* _pilots = nullptr;
+  const T* _remap = nullptr;
+  const uint8_t* _fingerprints = nullptr;
+  const V* _values = nullptr;
+
+  void mapImage(const char* image, size_t size);
+  uint64_t position(T id) const;
+  bool matchesFingerprint(uint64_t position, T id) const;
+
+ public:
+  /**
+   * Builds the table from a populated hash table.
+   * \param table The table.
+   * \param fingerprintBits The number of bits kept per id, either 0, 8, 16 or
+   * the width of T to keep the full ids.
+   * \throws std::invalid_argument for other fingerprint widths.
+   */
+  explicit PerfectHashTable(const HashTable<T, V>& table,
+                            unsigned fingerprintBits = sizeof(T) * 8);
+
+  /**
+   * Deserializes a table from a stream into memory owned by the table.
+   * \throws std::runtime_error if the stream holds no image of a table of
+   * the same types.
+   * \throws std::ios_base::failure if the stream ends early.
+   */
+  explicit PerfectHashTable(std::istream& is);
+
+  /**
+   * Uses a serialized image in place without copying it.
+   * The memory must stay valid and 8-byte aligned for the lifetime of the
+   * table.
+   * \param image The image, as written by writeToStream.
+   * \param size The size of the memory holding the image in bytes.
+   * \throws std::runtime_error if it's no image of a table of the same
+   * types or it doesn't fit in the given size.
+   */
+  PerfectHashTable(const char* image, size_t size);
+
+  ~PerfectHashTable();
+
+  PerfectHashTable(const PerfectHashTable& other) = delete;
+  PerfectHashTable& operator=(const PerfectHashTable& other) = delete;
+  PerfectHashTable(PerfectHashTable&& other);
+
+  void writeToStream(std::ostream& os);
+
+  /**
+   * Replaces the table with one deserialized from a stream. The table is
+   * left unchanged when it fails.
+   * \throws std::runtime_error if the stream holds no image of a table of
+   * the same types.
+   * \throws std::ios_base::failure if the stream ends early.
+   */
+  void loadFromStream(std::istream& is);
+
+  ValueType retrieve(T id) const;
+  bool exists(T id) const;
+
+  /**
+   * Returns the number of entries.
+   */
+  uint64_t size() const;
+
+  /**
+   * Returns the size of the serialized image in bytes.
+   */
+  size_t imageSize() const;
+};
+}
+#endif  // NSL_PERFECT_HASH_TABLE_H
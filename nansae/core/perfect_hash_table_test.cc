@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/perfect_hash_table.h"
+#include "gtest/gtest.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+TEST(PerfectHashTable, fullKeys) {
+  NSL::HashTable<uint64_t> ht(1024);
+  for (uint64_t i = 0; i < 100000; i++) {
+    ht.insert(i * 500000000, 1.1 * i);
+  }
+
+  NSL::PerfectHashTable<uint64_t> pht(ht);
+  ASSERT_EQ(pht.size(), 100000);
+
+  for (uint64_t i = 0; i < 100000; i++) {
+    ASSERT_EQ(pht.exists(i * 500000000), true);
+    ASSERT_DOUBLE_EQ(pht.retrieve(i * 500000000), 1.1 * i);
+    ASSERT_EQ(pht.exists(i * 500000000 + 1), false);
+    ASSERT_EQ(pht.retrieve(i * 500000000 + 1), 0);
+  }
+}
+
+TEST(PerfectHashTable, fingerprints) {
+  NSL::HashTable<uint64_t, float> ht(1024);
+  for (uint64_t i = 0; i < 20000; i++) ht.insert(i * 7, 0.5f * i);
+
+  NSL::PerfectHashTable<uint64_t, float> pht(ht, 16);
+  NSL::PerfectHashTable<uint64_t, float> noFingerprints(ht, 0);
+
+  int falsePositives = 0;
+  for (uint64_t i = 0; i < 20000; i++) {
+    ASSERT_FLOAT_EQ(pht.retrieve(i * 7), 0.5f * i);
+    ASSERT_FLOAT_EQ(noFingerprints.retrieve(i * 7), 0.5f * i);
+    falsePositives += pht.exists(i * 7 + 1);
+  }
+  ASSERT_LT(falsePositives, 10);
+  ASSERT_LT(noFingerprints.imageSize(), pht.imageSize());
+
+  NSL::HashTable<uint64_t, float> empty(16);
+  ASSERT_THROW((NSL::PerfectHashTable<uint64_t, float>(empty, 12)),
+               std::invalid_argument);
+}
+
+TEST(PerfectHashTable, writeLoadInPlace) {
+  NSL::HashTable<uint32_t> ht(256);
+  for (uint32_t i = 0; i < 5000; i++) ht.insert(i * 3, -2.0 * i);
+
+  NSL::PerfectHashTable<uint32_t> pht(ht);
+  std::stringstream s;
+  pht.writeToStream(s);
+  std::string image = s.str();
+  ASSERT_EQ(image.size(), pht.imageSize());
+
+  NSL::PerfectHashTable<uint32_t> loaded(s);
+
+  // an 8-byte aligned copy, like a memory mapped file would be
+  uint64_t* aligned = (uint64_t*)std::malloc(image.size());
+  std::memcpy(aligned, image.data(), image.size());
+  NSL::PerfectHashTable<uint32_t> view((const char*)aligned, image.size());
+
+  for (uint32_t i = 0; i < 5000; i++) {
+    ASSERT_DOUBLE_EQ(loaded.retrieve(i * 3), -2.0 * i);
+    ASSERT_DOUBLE_EQ(view.retrieve(i * 3), -2.0 * i);
+    ASSERT_EQ(view.exists(i * 3 + 1), false);
+  }
+  std::free(aligned);
+
+  NSL::HashTable<uint32_t> empty(16);
+  NSL::PerfectHashTable<uint32_t> emptyPht(empty);
+  ASSERT_EQ(emptyPht.exists(1), false);
+}
+
+TEST(PerfectHashTable, foreignImages) {
+  NSL::HashTable<uint64_t, float> ht(256);
+  for (uint64_t i = 0; i < 1000; i++) ht.insert(i, 0.25f * i);
+  NSL::PerfectHashTable<uint64_t, float> pht(ht);
+  std::stringstream s;
+  pht.writeToStream(s);
+  std::string image = s.str();
+
+  uint64_t* aligned = (uint64_t*)std::malloc(image.size());
+  std::memcpy(aligned, image.data(), image.size());
+  ASSERT_THROW(
+      NSL::PerfectHashTable<uint32_t>((const char*)aligned, image.size()),
+      std::runtime_error);
+  // an image cut short is rejected before anything past it is read
+  ASSERT_THROW((NSL::PerfectHashTable<uint64_t, float>(
+                   (const char*)aligned, image.size() - 8)),
+               std::runtime_error);
+  ASSERT_THROW(
+      (NSL::PerfectHashTable<uint64_t, float>((const char*)aligned, 4)),
+      std::runtime_error);
+  ((char*)aligned)[0] = 'X';
+  ASSERT_THROW((NSL::PerfectHashTable<uint64_t, float>((const char*)aligned,
+                                                       image.size())),
+               std::runtime_error);
+  std::free(aligned);
+
+  std::stringstream wrongTypes(image);
+  ASSERT_THROW((NSL::PerfectHashTable<uint64_t, double>(wrongTypes)),
+               std::runtime_error);
+
+  // a failed load leaves the table as it was
+  std::stringstream truncated(image.substr(0, image.size() / 2));
+  ASSERT_THROW(pht.loadFromStream(truncated), std::ios_base::failure);
+  ASSERT_EQ(pht.size(), 1000);
+  ASSERT_FLOAT_EQ(pht.retrieve(10), 2.5f);
+}
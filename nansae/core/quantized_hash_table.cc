@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/quantized_hash_table.h"
+#include "nansae/core/stream_binary_io.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace NSL {
+
+/**
+ * Returns the scale that maps the given magnitude onto the largest code.
+ */
+template <typename Q>
+static double scaleForMagnitude(ValueType maxMagnitude) {
+  maxMagnitude = std::fabs(maxMagnitude);
+  if (maxMagnitude == 0) return 1;
+  return maxMagnitude / std::numeric_limits<Q>::max();
+}
+
+/**
+ * Reads the scale in front of the codes, leaving the stream right after it.
+ */
+static double readScale(std::istream& is) {
+  StreamBinaryReader reader(is);
+  return reader.read<double>();
+}
+
+template <typename T, typename Q>
+QuantizedHashTable<T, Q>::QuantizedHashTable(ValueType maxMagnitude,
+                                             T bucketsNo)
+    : _scale(scaleForMagnitude<Q>(maxMagnitude)), _table(bucketsNo) {}
+
+template <typename T, typename Q>
+QuantizedHashTable<T, Q>::QuantizedHashTable(
+    const HashTable<T, ValueType>& table)
+    : _table(table.bucketsNo()) {
+  ValueType maxMagnitude = 0;
+  table.forEach([&maxMagnitude](T, const ValueType& value) {
+    maxMagnitude = std::max(maxMagnitude, std::fabs(value));
+  });
+  _scale = scaleForMagnitude<Q>(maxMagnitude);
+
+  table.forEach(
+      [this](T id, const ValueType& value) { this->insert(id, value); });
+}
+
+template <typename T, typename Q>
+QuantizedHashTable<T, Q>::QuantizedHashTable(std::istream& is)
+    : _scale(readScale(is)), _table(is) {}
+
+template <typename T, typename Q>
+QuantizedHashTable<T, Q> QuantizedHashTable<T, Q>::FromHashTableStream(
+    std::istream& is) {
+  HashTable<T, ValueType> table(is);
+  return QuantizedHashTable<T, Q>(table);
+}
+
+/* SERIALIZATION FORMAT
+ * [(double)scale, (HashTable<T, Q>)codes]
+ */
+
+template <typename T, typename Q>
+void QuantizedHashTable<T, Q>::writeToStream(std::ostream& os) {
+  StreamBinaryWriter writer(os);
+  writer.write<double>(_scale);
+  writer.flush();
+  _table.writeToStream(os);
+}
+
+template <typename T, typename Q>
+void QuantizedHashTable<T, Q>::loadFromStream(std::istream& is) {
+  // the scale is only replaced along with the codes
+  double scale = readScale(is);
+  _table.loadFromStream(is);
+  _scale = scale;
+}
+
+template <typename T, typename Q>
+Q QuantizedHashTable<T, Q>::quantize(ValueType value) const {
+  double code = std::round(value / _scale);
+  code = std::min<double>(code, std::numeric_limits<Q>::max());
+  code = std::max<double>(code, -std::numeric_limits<Q>::max());
+  return (Q)code;
+}
+
+template <typename T, typename Q>
+int QuantizedHashTable<T, Q>::insert(T id, ValueType value) {
+  return _table.insert(id, quantize(value));
+}
+
+template <typename T, typename Q>
+ValueType QuantizedHashTable<T, Q>::retrieve(T id) const {
+  return _table.retrieve(id) * _scale;
+}
+
+template <typename T, typename Q>
+bool QuantizedHashTable<T, Q>::exists(T id) const {
+  return _table.exists(id);
+}
+
+template <typename T, typename Q>
+typename QuantizedHashTable<T, Q>::Entry
+QuantizedHashTable<T, Q>::Iterator::operator*() {
+  typename HashTable<T, Q>::Entry code = *_it;
+  Entry e;
+  e.id = code.id;
+  e.value = code.value * _scale;
+  return e;
+}
+
+template <typename T, typename Q>
+typename QuantizedHashTable<T, Q>::Entry
+QuantizedHashTable<T, Q>::Iterator::operator->() {
+  return this->operator*();
+}
+
+template <typename T, typename Q>
+typename QuantizedHashTable<T, Q>::Iterator
+QuantizedHashTable<T, Q>::Iterator::operator++() {
+  ++_it;
+  return *this;
+}
+
+template <typename T, typename Q>
+typename QuantizedHashTable<T, Q>::Iterator
+QuantizedHashTable<T, Q>::Iterator::operator+(T moveBy) {
+  _it = _it + moveBy;
+  return *this;
+}
+
+template <typename T, typename Q>
+bool QuantizedHashTable<T, Q>::Iterator::operator!=(const Iterator& other) {
+  return _it != other._it;
+}
+
+template <typename T, typename Q>
+typename QuantizedHashTable<T, Q>::Iterator QuantizedHashTable<T, Q>::begin() {
+  Iterator it;
+  it._it = _table.begin();
+  it._scale = _scale;
+  return it;
+}
+
+template <typename T, typename Q>
+typename QuantizedHashTable<T, Q>::Iterator QuantizedHashTable<T, Q>::end() {
+  Iterator it;
+  it._it = _table.end();
+  it._scale = _scale;
+  return it;
+}
+
+template class QuantizedHashTable<uint32_t, int8_t>;
+template class QuantizedHashTable<uint32_t, int16_t>;
+template class QuantizedHashTable<uint64_t, int8_t>;
+template class QuantizedHashTable<uint64_t, int16_t>;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NSL_QUANTIZED_HASH_TABLE_H
+#define NSL_QUANTIZED_HASH_TABLE_H
+
+#include <cstdint>
+#include <iostream>
+
+#include "nansae/core/hash_table.h"
+
+namespace NSL {
+/**
+ * A hash table storing its values quantized to 8 or 16-bit integers.
+ * Values are quantized symmetrically with a single per-table scale, i.e. a
+ * value v is stored as round(v / scale), so zero stays exactly zero and ids
+ * that aren't in the table retrieve 0 like they do in NSL::HashTable.
+ * Values beyond the magnitude the table was created for are clamped.
+ * The table is instantiated for uint32_t and uint64_t ids with int8_t and
+ * int16_t codes.
+ */
+template <typename T, typename Q = int8_t>
+class QuantizedHashTable {
+ private:
+  double _scale;
+  HashTable<T, Q> _table;
+
+  Q quantize(ValueType value) const;
+
+ public:
+  struct Entry {
+    T id;
+    ValueType value;
+  };
+
+  class Iterator {
+    friend QuantizedHashTable;
+
+   private:
+    typename HashTable<T, Q>::Iterator _it;
+    double _scale;
+
+   public:
+    Entry operator*();
+    Entry operator->();
+    Iterator operator++();
+    Iterator operator+(T moveBy);
+    bool operator!=(const Iterator& other);
+  };
+
+  /**
+   * Creates an empty table.
+   * \param maxMagnitude The largest absolute value the table has to hold.
+   * \param bucketsNo The number of buckets.
+   */
+  explicit QuantizedHashTable(ValueType maxMagnitude, T bucketsNo = 256);
+
+  /**
+   * Quantizes an existing double valued table, choosing the scale from its
+   * largest absolute value.
+   * \param table The table.
+   */
+  explicit QuantizedHashTable(const HashTable<T, ValueType>& table);
+
+  /**
+   * Deserializes a table written by QuantizedHashTable::writeToStream.
+   */
+  explicit QuantizedHashTable(std::istream& is);
+
+  /**
+   * Reads a double valued NSL::HashTable<T> from a stream written by
+   * HashTable::writeToStream and quantizes it.
+   * \param is The stream.
+   * \ret The quantized table.
+   * \throws std::runtime_error as HashTable::loadFromStream does, e.g. for
+   * streams of the old layout without a header.
+   */
+  static QuantizedHashTable FromHashTableStream(std::istream& is);
+
+  void writeToStream(std::ostream& os);
+  void loadFromStream(std::istream& is);
+
+  int insert(T id, ValueType value);
+  ValueType retrieve(T id) const;
+  bool exists(T id) const;
+
+  /**
+   * Returns the value represented by a single quantization step.
+   */
+  double scale() const { return _scale; }
+
+  uint32_t bucketsNo() { return _table.bucketsNo(); }
+
+  Iterator begin();
+  Iterator end();
+};
+}
+#endif  // NSL_QUANTIZED_HASH_TABLE_H
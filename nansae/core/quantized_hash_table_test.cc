@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/quantized_hash_table.h"
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <type_traits>
+
+TEST(QuantizedHashTable, insertRetrieve) {
+  NSL::QuantizedHashTable<uint32_t, int8_t> ht(2.0);
+
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(ht.insert(i, std::sin(i) * 2), 0);
+  }
+
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_NEAR(ht.retrieve(i), std::sin(i) * 2, ht.scale() / 2);
+  }
+
+  ASSERT_EQ(ht.exists(1000), false);
+  ASSERT_EQ(ht.retrieve(1000), 0);
+
+  // values beyond the magnitude are clamped
+  ht.insert(0, 5.0);
+  ASSERT_NEAR(ht.retrieve(0), 2.0, 1e-9);
+}
+
+TEST(QuantizedHashTable, fromHashTableStream) {
+  NSL::HashTable<uint64_t> weights(1024);
+  for (uint64_t i = 0; i < 5000; i++) {
+    weights.insert(i * 1000003, std::cos(i) * 0.01 * (i % 7));
+  }
+
+  std::stringstream doubleStream;
+  weights.writeToStream(doubleStream);
+
+  NSL::QuantizedHashTable<uint64_t, int16_t> quantized =
+      NSL::QuantizedHashTable<uint64_t, int16_t>::FromHashTableStream(
+          doubleStream);
+
+  std::stringstream quantizedStream;
+  quantized.writeToStream(quantizedStream);
+  NSL::QuantizedHashTable<uint64_t, int16_t> loaded(quantizedStream);
+
+  ASSERT_LT(quantizedStream.str().size(), doubleStream.str().size());
+
+  int entries = 0;
+  for (NSL::QuantizedHashTable<uint64_t, int16_t>::Entry e : loaded) {
+    ASSERT_NEAR(e.value, weights.retrieve(e.id), loaded.scale() / 2);
+    entries++;
+  }
+  ASSERT_EQ(entries, 5000);
+
+  // streams written before the hash table header are rejected
+  std::stringstream oldStream(doubleStream.str().substr(8));
+  ASSERT_THROW(
+      (NSL::QuantizedHashTable<uint64_t, int16_t>::FromHashTableStream(
+          oldStream)),
+      std::runtime_error);
+}
+
+TEST(QuantizedHashTable, fromHashTable) {
+  NSL::HashTable<uint32_t> weights(64);
+  for (uint32_t i = 0; i < 500; i++) weights.insert(i, std::sin(i));
+
+  const NSL::HashTable<uint32_t>& constWeights = weights;
+  NSL::QuantizedHashTable<uint32_t, int8_t> quantized(constWeights);
+  for (uint32_t i = 0; i < 500; i++) {
+    ASSERT_NEAR(quantized.retrieve(i), std::sin(i), quantized.scale() / 2);
+  }
+
+  // a magnitude or a table doesn't silently turn into a quantized table
+  static_assert(
+      !std::is_convertible<double,
+                           NSL::QuantizedHashTable<uint32_t, int8_t>>::value,
+      "The magnitude constructor must be explicit.");
+  static_assert(
+      !std::is_convertible<NSL::HashTable<uint32_t>,
+                           NSL::QuantizedHashTable<uint32_t, int8_t>>::value,
+      "The conversion from a HashTable must be explicit.");
+}
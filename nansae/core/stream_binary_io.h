@@ -6,7 +6,17 @@
  * Proprietary and confidential.
  */
 
+#ifndef NSL_STREAM_BINARY_IO_H
+#define NSL_STREAM_BINARY_IO_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 namespace NSL {
   template <typename T>
@@ -33,4 +43,256 @@ namespace NSL {
       char c = (char)value;
       StreamBinaryWrite<char>(os, c);
     }
+
+/**
+ * Converts values between the host byte order and little endian, the byte
+ * order of everything written by StreamBinaryWriter. A no-op on little
+ * endian hosts.
+ */
+template <typename T>
+inline void SwapLittleEndian(T* values, size_t n) {
+  static_assert(std::is_arithmetic<T>::value,
+                "Only arithmetic values have a byte order.");
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  for (size_t i = 0; i < n; i++) {
+    char* bytes = reinterpret_cast<char*>(values + i);
+    std::reverse(bytes, bytes + sizeof(T));
+  }
+#else
+  (void)values;
+  (void)n;
+#endif
+}
+
+template <typename T, size_t N>
+inline void SwapLittleEndian(std::array<T, N>* values, size_t n) {
+  SwapLittleEndian(reinterpret_cast<T*>(values), n * N);
+}
+
+/**
+ * Appends a LEB128 varint, seven bits per byte starting with the lowest.
+ */
+inline void VarintAppend(std::string& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer.push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back((char)value);
+}
+
+/**
+ * Parses a varint written by VarintAppend and advances the position.
+ * \throws std::ios_base::failure if the varint doesn't end before end.
+ */
+inline uint64_t VarintParse(const char*& pos, const char* end) {
+  uint64_t value = 0;
+  for (unsigned shift = 0; pos < end && shift < 64; shift += 7) {
+    uint8_t byte = *pos++;
+    value |= uint64_t(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return value;
+  }
+  throw std::ios_base::failure("Malformed varint.");
+}
+
+/**
+ * Writes binary data to a stream through a buffer, so that scalars don't
+ * cost a stream call each. Everything is written in little endian.
+ * The buffer is flushed when full, by flush() and by the destructor, only
+ * flush() reports failures.
+ */
+class StreamBinaryWriter {
+ private:
+  std::ostream& _os;
+  std::vector<char> _buffer;
+  size_t _used = 0;
+
+ public:
+  explicit StreamBinaryWriter(std::ostream& os, size_t bufferSize = 1 << 16)
+      : _os(os), _buffer(std::max<size_t>(bufferSize, 16)) {}
+
+  ~StreamBinaryWriter() {
+    try {
+      this->flush();
+    } catch (const std::ios_base::failure&) {
+    }
+  }
+
+  StreamBinaryWriter(const StreamBinaryWriter&) = delete;
+  StreamBinaryWriter& operator=(const StreamBinaryWriter&) = delete;
+
+  void writeBytes(const char* bytes, size_t n) {
+    // bytes may be null when there are none, e.g. an empty vector's data
+    if (n == 0) return;
+    if (_used + n > _buffer.size()) {
+      this->flush();
+      if (n > _buffer.size()) {
+        this->put(bytes, n);
+        return;
+      }
+    }
+    std::memcpy(_buffer.data() + _used, bytes, n);
+    _used += n;
+  }
+
+  template <typename T>
+  void write(T value) {
+    SwapLittleEndian(&value, 1);
+    this->writeBytes(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  /**
+   * Writes an array of arithmetic values or std::arrays of them.
+   */
+  template <typename T>
+  void writeArray(const T* values, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; i < n; i++) this->write(values[i]);
+#else
+    this->writeBytes(reinterpret_cast<const char*>(values), n * sizeof(T));
+#endif
+  }
+
+  void writeVarint(uint64_t value) {
+    char bytes[10];
+    size_t n = 0;
+    while (value >= 0x80) {
+      bytes[n++] = (char)(value | 0x80);
+      value >>= 7;
+    }
+    bytes[n++] = (char)value;
+    this->writeBytes(bytes, n);
+  }
+
+  /**
+   * Writes out the buffer.
+   * \throws std::ios_base::failure if the stream doesn't take all of it.
+   */
+  void flush() {
+    if (_used == 0) return;
+    size_t used = _used;
+    _used = 0;
+    this->put(_buffer.data(), used);
+  }
+
+ private:
+  void put(const char* bytes, size_t n) {
+    if (!_os || _os.rdbuf()->sputn(bytes, n) != (std::streamsize)n) {
+      _os.setstate(std::ios_base::badbit);
+      throw std::ios_base::failure("Writing to the stream failed.");
+    }
+  }
+};
+
+/**
+ * Reads binary data written by StreamBinaryWriter through a buffer.
+ * The reader reads ahead of what it has been asked for. The bytes it
+ * didn't consume are put back into the stream when it's destroyed by
+ * seeking back, so that others can go on reading the stream. Streams that
+ * can't seek, such as pipes, are read without reading ahead instead.
+ * All reads throw std::ios_base::failure when the stream ends early.
+ */
+class StreamBinaryReader {
+ private:
+  std::istream& _is;
+  std::vector<char> _buffer;
+  size_t _position = 0;
+  size_t _available = 0;
+  bool _seekable;
+
+ public:
+  explicit StreamBinaryReader(std::istream& is, size_t bufferSize = 1 << 16)
+      : _is(is),
+        _buffer(std::max<size_t>(bufferSize, 16)),
+        _seekable(is.rdbuf() != nullptr &&
+                  is.rdbuf()->pubseekoff(0, std::ios_base::cur,
+                                         std::ios_base::in) !=
+                      std::streampos(std::streamoff(-1))) {}
+
+  ~StreamBinaryReader() {
+    size_t unread = _available - _position;
+    if (unread == 0) return;
+    if (_is.rdbuf()->pubseekoff(-(std::streamoff)unread, std::ios_base::cur,
+                                std::ios_base::in) ==
+        std::streampos(std::streamoff(-1))) {
+      // the stream is positioned past bytes nobody has read, destructors
+      // mustn't throw even if the stream's exception mask asks for it
+      try {
+        _is.setstate(std::ios_base::failbit);
+      } catch (...) {
+      }
+    }
+  }
+
+  StreamBinaryReader(const StreamBinaryReader&) = delete;
+  StreamBinaryReader& operator=(const StreamBinaryReader&) = delete;
+
+  void readBytes(char* bytes, size_t n) {
+    if (n == 0) return;
+    size_t buffered = std::min(n, _available - _position);
+    std::memcpy(bytes, _buffer.data() + _position, buffered);
+    _position += buffered;
+    bytes += buffered;
+    n -= buffered;
+    if (n == 0) return;
+
+    // large reads, and any on streams that can't seek back, go around the
+    // buffer
+    if (n >= _buffer.size() || !_seekable) {
+      this->get(bytes, n, n);
+      return;
+    }
+    _available = this->get(_buffer.data(), _buffer.size(), n);
+    std::memcpy(bytes, _buffer.data(), n);
+    _position = n;
+  }
+
+  template <typename T>
+  T read() {
+    T value;
+    this->readBytes(reinterpret_cast<char*>(&value), sizeof(T));
+    SwapLittleEndian(&value, 1);
+    return value;
+  }
+
+  /**
+   * Reads an array of arithmetic values or std::arrays of them.
+   */
+  template <typename T>
+  void readArray(T* values, size_t n) {
+    this->readBytes(reinterpret_cast<char*>(values), n * sizeof(T));
+    SwapLittleEndian(values, n);
+  }
+
+  uint64_t readVarint() {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = this->read<uint8_t>();
+      value |= uint64_t(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) return value;
+    }
+    throw std::ios_base::failure("Malformed varint.");
+  }
+
+ private:
+  /**
+   * Reads up to n bytes, at least required of them.
+   */
+  size_t get(char* bytes, size_t n, size_t required) {
+    size_t read = 0;
+    if (_is) {
+      while (read < n) {
+        std::streamsize got = _is.rdbuf()->sgetn(bytes + read, n - read);
+        if (got <= 0) break;
+        read += got;
+      }
+    }
+    if (read < required) {
+      _is.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+      throw std::ios_base::failure("Unexpected end of the stream.");
+    }
+    return read;
+  }
+};
 }
+
+#endif  // NSL_STREAM_BINARY_IO_H
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/stream_binary_io.h"
+#include "gtest/gtest.h"
+
+#include <sstream>
+
+TEST(StreamBinaryIO, roundTrip) {
+  std::stringstream ss;
+  std::vector<uint32_t> array(100000);
+  for (uint32_t i = 0; i < array.size(); i++) array[i] = i * 7;
+  {
+    NSL::StreamBinaryWriter writer(ss, 64);
+    writer.write<uint8_t>(7);
+    writer.write<int64_t>(-5);
+    writer.write<double>(.25);
+    writer.writeVarint(0);
+    writer.writeVarint(300);
+    writer.writeVarint(UINT64_MAX);
+    writer.writeArray(array.data(), array.size());
+    writer.write<uint16_t>(0x1234);
+    writer.flush();
+  }
+  // little endian regardless of the host
+  ASSERT_EQ(ss.str()[1], (char)0xfb);
+  ASSERT_EQ(ss.str()[2], (char)0xff);
+
+  ss << "tail";
+  {
+    NSL::StreamBinaryReader reader(ss, 64);
+    ASSERT_EQ(reader.read<uint8_t>(), 7);
+    ASSERT_EQ(reader.read<int64_t>(), -5);
+    ASSERT_EQ(reader.read<double>(), .25);
+    ASSERT_EQ(reader.readVarint(), 0);
+    ASSERT_EQ(reader.readVarint(), 300);
+    ASSERT_EQ(reader.readVarint(), UINT64_MAX);
+    std::vector<uint32_t> read(array.size());
+    reader.readArray(read.data(), read.size());
+    ASSERT_EQ(read, array);
+    ASSERT_EQ(reader.read<uint16_t>(), 0x1234);
+  }
+
+  // the bytes the reader read ahead are back in the stream
+  std::string tail;
+  ss >> tail;
+  ASSERT_EQ(tail, "tail");
+}
+
+TEST(StreamBinaryIO, failures) {
+  std::stringstream ss("abc");
+  NSL::StreamBinaryReader reader(ss);
+  ASSERT_THROW(reader.read<uint32_t>(), std::ios_base::failure);
+  ASSERT_TRUE(ss.fail());
+
+  std::stringstream varint("\xff\xff");
+  NSL::StreamBinaryReader varintReader(varint);
+  ASSERT_THROW(varintReader.readVarint(), std::ios_base::failure);
+
+  std::ostringstream os;
+  os.setstate(std::ios_base::badbit);
+  NSL::StreamBinaryWriter writer(os);
+  writer.write<uint32_t>(1);
+  ASSERT_THROW(writer.flush(), std::ios_base::failure);
+}
+
+/**
+ * Reads a string without supporting seeks, like a pipe.
+ */
+class UnseekableBuf : public std::streambuf {
+ private:
+  std::string _data;
+
+ public:
+  explicit UnseekableBuf(std::string data) : _data(std::move(data)) {
+    setg(&_data[0], &_data[0], &_data[0] + _data.size());
+  }
+};
+
+TEST(StreamBinaryIO, unseekableStream) {
+  std::stringstream ss;
+  NSL::StreamBinaryWriter writer(ss);
+  writer.write<double>(.5);
+  writer.write<uint32_t>(42);
+  writer.flush();
+
+  // a reader doesn't read ahead what it couldn't put back
+  UnseekableBuf buf(ss.str() + "tail");
+  std::istream is(&buf);
+  {
+    NSL::StreamBinaryReader reader(is);
+    ASSERT_EQ(reader.read<double>(), .5);
+  }
+  {
+    NSL::StreamBinaryReader reader(is);
+    ASSERT_EQ(reader.read<uint32_t>(), 42);
+  }
+  std::string tail;
+  is >> tail;
+  ASSERT_EQ(tail, "tail");
+}
@@ -14,71 +14,187 @@
  * limitations under the License.
  */
 
+
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <new>
+#include <queue>
 #include <sstream>
+#include <stdexcept>
+#include <unordered_map>
 
 #include "nansae/core/stream_binary_io.h"
 #include "nansae/core/string.h"
 #include "nansae/core/trie.h"
+#include "nansae/core/trie_format.h"
 
 namespace NSL {
 struct Trie::IteratorImpl {
-  char *_snaPointer;
-  uint8_t _childrenLeft;
-  std::shared_ptr<IteratorImpl> _parent;
+  /**
+   * A node on the path to the current word, the number of its siblings
+   * still to be visited and the length of its parent's path.
+   */
+  struct Frame {
+    TrieNodeRef node;
+    uint64_t childrenLeft;
+    size_t prefixLength;
+  };
+
+  /**
+   * The path from a child of the root to the current leaf, empty at the
+   * end. The prefix holds the labels along the path, the frames only their
+   * lengths, so moving on doesn't allocate once the buffers are large
+   * enough.
+   */
+  std::vector<Frame> _stack;
   std::string _prefix;
-  Trie::TrieImpl *_trie;
+  Trie::TrieImpl *_trie = nullptr;
 
   ////
   // Public methods
   ////
   WordIdPair value();
-  IteratorImpl next(bool descend = true);
+  void next();
+  void descend();
   bool notEqualTo(const IteratorImpl &other);
 };
 
 struct Trie::TrieImpl {
   /**
    * The struct representing a node of the trie in editing mode.
+   * Nodes live in the _nodes arena and refer to each other by index, their
+   * values are slices of the _values arena.
    */
   struct TrieNode {
     /**
-     * The node's value.
+     * The node's value, a slice of _values.
      */
-    std::string value;
-
-    /**
-     * The node's children.
-     */
-    std::vector<TrieNode> children;
+    uint64_t valueOffset;
+    uint32_t valueLength;
 
     /**
      * The nodes id.
      * Do not attemp to use this value if the node isn't a leaf node.
      */
     uint32_t id;
+
+    /**
+     * The node's children, a list linked through nextSibling.
+     */
+    uint32_t firstChild;
+    uint32_t lastChild;
+    uint32_t nextSibling;
+    uint32_t childrenNo;
   };
 
+  /**
+   * Marks the absence of a node.
+   */
+  static const uint32_t NoNode = UINT32_MAX;
+
+  /**
+   * The index of the root node.
+   */
+  static const uint32_t Root = 0;
+
   /**
    * Signifies whether the trie is in editing mode or frozen.
    */
   bool _editingMode = true;
 
   /**
-   * Contains the children of root.
+   * The format of the serialized node array.
+   */
+  Format _format = Format::Narrow;
+
+  /**
+   * The nodes in editing mode, starting with the root.
+   */
+  std::vector<TrieNode> _nodes;
+
+  /**
+   * The values of the nodes in editing mode, one after another. Splitting a
+   * node splits its slice without copying.
    */
-  std::vector<TrieNode> _rootChildren;
+  std::string _values;
 
   /**
    * Contains the serialized node array when in frozen mode.
    */
   char *_serializedNodeArray = nullptr;
 
+  /**
+   * Whether the serialized node array was allocated by the trie, rather
+   * than being a mapped image.
+   */
+  bool _ownsSerializedNodeArray = true;
+
   /*
    * The size of the serialized node array.
    */
-  uint32_t _serializedNodeArraySize = 0;
+  uint64_t _serializedNodeArraySize = 0;
+
+  /**
+   * The highest score below an inner node of the serialized node array.
+   */
+  struct SubtreeScore {
+    uint64_t pos;
+    uint64_t rank;
+    float score;
+
+    bool operator<(const SubtreeScore &other) const {
+      return pos != other.pos ? pos < other.pos : rank < other.rank;
+    }
+  };
+
+  /**
+   * The scores of the words by id, and the highest score below each inner
+   * node sorted by node, computed when first needed.
+   */
+  std::vector<float> _scores;
+  std::vector<SubtreeScore> _subtreeScores;
+  bool _subtreeScoresValid = false;
+
+  float score(uint32_t id) const {
+    return id < _scores.size() ? _scores[id]
+                               : -std::numeric_limits<float>::infinity();
+  }
+  float subtreeScore(TrieNodeRef node) const;
+
+  /**
+   * The reverse index of the serialized node array, computed when first
+   * needed: the position of every node in the order of the trie and the
+   * index of its parent's entry, kept apart to take 12 bytes per node, and
+   * the entry of each word's leaf sorted by id. A shared subtree of the Dawg
+   * format has entries for every path to it.
+   */
+  std::vector<uint64_t> _indexedNodePositions;
+  std::vector<uint32_t> _indexedNodeParents;
+  std::vector<std::pair<uint32_t, uint32_t>> _leavesById;
+  bool _wordIndexValid = false;
+
+  /**
+   * The table of the values of the words added with addWordValues: the
+   * values with index i are _valueData[_valueOffsets[i]] up to
+   * _valueData[_valueOffsets[i + 1]]. The pointers refer to the owned
+   * vectors, or into a mapped image.
+   */
+  std::vector<uint32_t> _ownedValueOffsets;
+  std::vector<uint32_t> _ownedValueData;
+  const uint32_t *_valueOffsets = nullptr;
+  const uint32_t *_valueData = nullptr;
+  uint32_t _valueSetsNo = 0;
+
+  void pointAtOwnedValues();
+  void ownValues();
+  void clearValues();
+  void compactValues();
+  uint32_t insertWord(const String &str, uint32_t id, bool replace);
 
   /**
    * Prints out the serialized node array in a human readable format.
@@ -88,168 +204,754 @@ struct Trie::TrieImpl {
   ////
   // Serialization helper functions.
   ////
-  static uint8_t getChildrenNo(char *na);
-  static uint32_t getChildrenOffset(char *na, char *start = nullptr);
-  static uint32_t getId(char *na);
-  static std::string getValue(char *na);
-  static char *getValuePtr(char *na);
-  static uint8_t getLenght(char *na);
-  static TrieNode readNodeAndChildren(char *na);
-  static uint32_t getBranchLength(const std::vector<TrieNode> &children,
-                                  uint32_t length);
-  static uint32_t writeChildren(char *na,
-                                const std::vector<TrieNode> &children);
-  static int compareHStr(uint8_t *hstr1, uint8_t *hstr2);
-  static int compareHStr(std::string hstr1, std::string hstr2);
-  static int compareHStr(std::string hstr1, std::string hstr2, size_t offset);
+  void resetNodes();
+  uint32_t newNode(uint64_t valueOffset, uint32_t valueLength, uint32_t id);
+  uint32_t newNode(const char *value, uint32_t valueLength, uint32_t id);
+  void appendChild(uint32_t parent, uint32_t child);
+  template <typename F>
+  void readChildren(const F &f, TrieNodeRef node, uint32_t parent);
+  template <typename F>
+  uint64_t getBranchLength(uint32_t parent) const;
+  template <typename F>
+  uint64_t writeChildren(char *na, uint64_t pos, uint32_t parent) const;
+  bool fitsNarrow() const;
+  template <typename F>
+  void serialize();
+  template <typename F>
+  uint64_t writeDawgChildren(
+      const F &f, TrieNodeRef parent, std::string &na,
+      std::unordered_map<std::string, uint64_t> &groups,
+      std::vector<uint32_t> &ids, uint64_t *wordsNo) const;
+  void convert(Format format);
+  void releaseSerializedNodeArray();
+  void setScores(std::vector<float> scores);
+  std::vector<WordIdPair> complete(const String &prefix, size_t k);
+  String wordForId(uint32_t id);
+  void setSerializedNodeArray(const std::string &na, Format format);
+  struct ReadNodes;
+  struct Minimize;
+  struct ScoreSubtrees;
+  struct Complete;
+  struct IndexWords;
+  struct Succinct;
+  uint32_t compareHStr(const std::string &hstr, size_t offset,
+                       uint32_t node) const;
+
+  /**
+   * Calls the operation with the format of the serialized node array.
+   * Operations are functors with a Result typedef and a templated call
+   * operator taking the format.
+   */
+  template <typename Operation>
+  typename Operation::Result withFormat(const Operation &operation) const;
+
+  ////
+  // Node access for the iterator, dispatched on the format at runtime.
+  ////
+  uint64_t childrenNo(TrieNodeRef node) const;
+  TrieNodeRef firstChild(TrieNodeRef node) const;
+  TrieNodeRef nextSibling(TrieNodeRef node) const;
+  const char *label(TrieNodeRef node) const;
+  uint32_t id(TrieNodeRef node) const;
 
   ////
   // Public methods
   ////
-  TrieImpl() = default;
+  TrieImpl() { resetNodes(); }
   ~TrieImpl();
   void makeEditable();
-  void freeze();
+  void freeze(Format format);
+  void adoptSerializedNodeArray(char *array, uint64_t size, Format format);
   uint32_t addWord(const String &str, uint32_t id, bool replace);
+  uint32_t addWordValues(const String &str,
+                         const std::vector<uint32_t> &values);
   uint32_t findWord(const String &str);
   std::vector<WordIdPair> findWordPrefixes(const String &str);
+  Values findWordValues(const String &str);
+  std::vector<WordValuesPair> findWordPrefixValues(const String &str);
+  Values values(uint32_t id) const;
+  std::vector<WordIdDistance> findWordsWithin(const String &str,
+                                              uint32_t maxEdits);
+  std::vector<WordIdPair> findPattern(
+      const std::vector<SyllablePattern> &pattern);
   void writeToStream(std::ostream &s);
   void loadFromStream(std::istream &s);
+  void mapImage(const char *image);
   bool editingMode();
   IteratorImpl begin();
   IteratorImpl end();
+  std::vector<IteratorImpl> partition(size_t rangesNo);
+  void forEach(
+      const std::function<void(const std::string &, uint32_t)> &function);
 };
 
 ////
 // Serialization helper functions.
 ////
 
-/* SERIALIZATION FORMAT
- * [(uint8_t)root children no],[(uint8_t)children no, (uint16_t)children offset,
- * (uint8_t[])value, \0], ...
- * children offset is counted from the beginning of the current node
+/* SERIALIZATION FORMATS
+ * See NarrowTrieFormat and WideTrieFormat in trie_format.h, both lay out
+ * the children of a node next to each other, followed by the children of
+ * each of them in turn. DawgTrieFormat is converted from either of them.
  */
 
-uint8_t Trie::TrieImpl::getChildrenNo(char *na) {
-  uint8_t r = *((uint8_t *)na);
-  return r;
+void Trie::TrieImpl::resetNodes() {
+  _nodes.clear();
+  _values.clear();
+  newNode(uint64_t(0), 0, 0);
 }
 
-uint32_t Trie::TrieImpl::getChildrenOffset(char *na, char *start) {
-  if (na - start == 0) return sizeof(uint8_t);
-  uint32_t r = *((uint32_t *)(na + sizeof(uint8_t)));
-  return r;
+uint32_t Trie::TrieImpl::newNode(uint64_t valueOffset, uint32_t valueLength,
+                                 uint32_t id) {
+  TrieNode t;
+  t.valueOffset = valueOffset;
+  t.valueLength = valueLength;
+  t.id = id;
+  t.firstChild = t.lastChild = t.nextSibling = NoNode;
+  t.childrenNo = 0;
+  _nodes.push_back(t);
+  return _nodes.size() - 1;
 }
 
-uint32_t Trie::TrieImpl::getId(char *na) {
-  uint32_t r = *((uint32_t *)(na + sizeof(uint8_t)));
-  return r;
+uint32_t Trie::TrieImpl::newNode(const char *value, uint32_t valueLength,
+                                 uint32_t id) {
+  uint64_t valueOffset = _values.size();
+  _values.append(value, valueLength);
+  return newNode(valueOffset, valueLength, id);
 }
 
-std::string Trie::TrieImpl::getValue(char *na) {
-  return std::string((char *)na + sizeof(uint8_t) + sizeof(uint32_t));
+void Trie::TrieImpl::appendChild(uint32_t parent, uint32_t child) {
+  TrieNode &p = _nodes[parent];
+  if (p.lastChild == NoNode) {
+    p.firstChild = child;
+  } else {
+    _nodes[p.lastChild].nextSibling = child;
+  }
+  p.lastChild = child;
+  p.childrenNo++;
 }
 
-char *Trie::TrieImpl::getValuePtr(char *na) {
-  return (char *)na + sizeof(uint8_t) + sizeof(uint32_t);
+template <typename F>
+void Trie::TrieImpl::readChildren(const F &f, TrieNodeRef node,
+                                  uint32_t parent) {
+  uint64_t childrenNo = f.childrenNo(node);
+  TrieNodeRef child = f.firstChild(node);
+  for (uint64_t i = 0; i < childrenNo; i++) {
+    if (i > 0) child = f.nextSibling(child);
+    const char *label = f.label(child);
+    bool leaf = f.childrenNo(child) == 0;
+    uint32_t n = newNode(label, std::strlen(label), leaf ? f.id(child) : 0);
+    appendChild(parent, n);
+    if (!leaf) readChildren(f, child, n);
+  }
 }
 
-uint8_t Trie::TrieImpl::getLenght(char *na) {
-  return sizeof(uint8_t) + sizeof(uint32_t) + std::strlen(getValuePtr(na)) + 1;
+template <typename F>
+uint64_t Trie::TrieImpl::getBranchLength(uint32_t parent) const {
+  uint64_t length = 0;
+  for (uint32_t c = _nodes[parent].firstChild; c != NoNode;
+       c = _nodes[c].nextSibling) {
+    length += F::nodeSize(_nodes[c].childrenNo, _nodes[c].valueLength);
+    length += getBranchLength<F>(c);
+  }
+  return length;
 }
 
-Trie::TrieImpl::TrieNode Trie::TrieImpl::readNodeAndChildren(char *na) {
-  std::string value = getValue(na);
-  uint32_t childrenOffset = getChildrenOffset(na);
-  uint8_t childrenNo = getChildrenNo(na);
+template <typename F>
+uint64_t Trie::TrieImpl::writeChildren(char *na, uint64_t pos,
+                                       uint32_t parent) const {
+  // the children are written next to each other, followed by their own
+  // children in the same order
+  uint64_t next = pos;
+  for (uint32_t c = _nodes[parent].firstChild; c != NoNode;
+       c = _nodes[c].nextSibling) {
+    next += F::nodeSize(_nodes[c].childrenNo, _nodes[c].valueLength);
+  }
 
-  TrieNode t;
-  t.value = value;
-  if (childrenNo > 0)
-    t.children.reserve(childrenNo);
-  else
-    t.id = getId(na);
+  for (uint32_t c = _nodes[parent].firstChild; c != NoNode;
+       c = _nodes[c].nextSibling) {
+    const TrieNode &t = _nodes[c];
+    F::writeNode(na, pos, t.childrenNo, next, t.id,
+                 _values.data() + t.valueOffset, t.valueLength);
+    pos += F::nodeSize(t.childrenNo, t.valueLength);
+    if (t.childrenNo > 0) next = writeChildren<F>(na, next, c);
+  }
+
+  return next;
+}
 
-  uint32_t childrenRead = 0;
-  for (int i = 0; i < childrenNo; i++) {
-    t.children.push_back(
-        readNodeAndChildren(na + childrenOffset + childrenRead));
-    childrenRead += getLenght(na + childrenOffset + childrenRead);
+bool Trie::TrieImpl::fitsNarrow() const {
+  for (const TrieNode &t : _nodes) {
+    if (t.childrenNo > NarrowTrieFormat::MaxChildrenNo) return false;
+  }
+  return true;
+}
+
+template <typename F>
+void Trie::TrieImpl::serialize() {
+  uint64_t rootSize = F::rootSize(_nodes[Root].childrenNo);
+  uint64_t size = rootSize + getBranchLength<F>(Root);
+  if (size > F::MaxSize) {
+    throw std::length_error("The trie is too large for its format.");
   }
 
-  return t;
+  _serializedNodeArray = (char *)std::malloc(size);
+  _serializedNodeArraySize = size;
+  F::writeRoot(_serializedNodeArray, _nodes[Root].childrenNo);
+  writeChildren<F>(_serializedNodeArray, rootSize, Root);
 }
 
-uint32_t Trie::TrieImpl::getBranchLength(
-    const std::vector<Trie::TrieImpl::TrieNode> &children, uint32_t length) {
-  for (const TrieNode &t : children) {
-    // if (t.children.size() == 0) // leaf node
-    length += sizeof(uint8_t) + sizeof(uint32_t) + t.value.length() + 1;
-    // else // non-leaf node
-    // length += sizeof(uint8_t) + sizeof(uint16_t) + t.value.length() + 1;
+/**
+ * Returns the number of characters the string from the offset on has in
+ * common with the value of the node.
+ */
+uint32_t Trie::TrieImpl::compareHStr(const std::string &hstr, size_t offset,
+                                     uint32_t node) const {
+  const char *value = _values.data() + _nodes[node].valueOffset;
+  uint32_t length = std::min<uint64_t>(_nodes[node].valueLength,
+                                       hstr.length() - offset);
+  uint32_t i = 0;
+  while (i < length && value[i] == hstr[offset + i]) i++;
+  return i;
+}
 
-    length = getBranchLength(t.children, length);
+template <typename Operation>
+typename Operation::Result Trie::TrieImpl::withFormat(
+    const Operation &operation) const {
+  switch (_format) {
+    case Format::Wide:
+      return operation(WideTrieFormat(_serializedNodeArray));
+    case Format::Dawg:
+      return operation(DawgTrieFormat(_serializedNodeArray));
+    case Format::Louds:
+      return operation(LoudsTrieFormat(_serializedNodeArray));
+    default:
+      return operation(NarrowTrieFormat(_serializedNodeArray));
   }
-  return length;
 }
 
-uint32_t Trie::TrieImpl::writeChildren(
-    char *na, const std::vector<Trie::TrieImpl::TrieNode> &children) {
-  // 1. write the nodes
-  uint32_t currentLevelSize = 0;  // size of the current children combined
-  for (const TrieNode &t : children) {
-    // write the node
-    *(na + currentLevelSize) = t.children.size();
-    // leaf node:
-    if (t.children.size() == 0) {
-      // write the node id
-      *((uint32_t *)(na + currentLevelSize + sizeof(uint8_t))) = t.id;
-      // and the string
-      std::strcpy((na + currentLevelSize + sizeof(uint8_t) + sizeof(uint32_t)),
-                  t.value.c_str());
-    } else {  // non-leaf node
-      std::strcpy((na + currentLevelSize + sizeof(uint8_t) + sizeof(uint32_t)),
-                  t.value.c_str());
+namespace {
+struct ChildrenNo {
+  typedef uint64_t Result;
+  TrieNodeRef node;
+  template <typename F>
+  uint64_t operator()(const F &f) const {
+    return f.childrenNo(node);
+  }
+};
+
+struct FirstChild {
+  typedef TrieNodeRef Result;
+  TrieNodeRef node;
+  template <typename F>
+  TrieNodeRef operator()(const F &f) const {
+    return f.firstChild(node);
+  }
+};
+
+struct NextSibling {
+  typedef TrieNodeRef Result;
+  TrieNodeRef node;
+  template <typename F>
+  TrieNodeRef operator()(const F &f) const {
+    return f.nextSibling(node);
+  }
+};
+
+struct Label {
+  typedef const char *Result;
+  TrieNodeRef node;
+  template <typename F>
+  const char *operator()(const F &f) const {
+    return f.label(node);
+  }
+};
+
+struct Id {
+  typedef uint32_t Result;
+  TrieNodeRef node;
+  template <typename F>
+  uint32_t operator()(const F &f) const {
+    return f.id(node);
+  }
+};
+
+/**
+ * Returns the length of the label if the string starts with it, zero
+ * otherwise.
+ */
+inline size_t matchLabel(const char *str, const char *label) {
+  size_t i = 0;
+  while (label[i] != '\0') {
+    if (str[i] != label[i]) return 0;
+    i++;
+  }
+  return i;
+}
+
+struct FindWord {
+  typedef uint32_t Result;
+  const std::string &hstr;
+
+  template <typename F>
+  uint32_t operator()(const F &f) const {
+    TrieNodeRef node = f.root();
+    if (f.childrenNo(node) == 0) return NIME_TRIE_WORD_NOT_FOUND;
+    size_t strOffset = 0;
+
+    while (strOffset < hstr.length()) {
+      uint64_t childrenNo = f.childrenNo(node);
+      bool foundNodeToDescendTo = false;
+
+      // for each child of the current node
+      TrieNodeRef child = f.firstChild(node);
+      for (uint64_t i = 0; i < childrenNo; i++) {
+        if (i > 0) child = f.nextSibling(child);
+        size_t matched = matchLabel(hstr.c_str() + strOffset, f.label(child));
+
+        // exact match -> descend into the children node
+        if (matched > 0) {
+          strOffset += matched;
+          node = child;
+          foundNodeToDescendTo = true;
+          break;
+        }
+      }
+      if (!foundNodeToDescendTo) {
+        return NIME_TRIE_WORD_NOT_FOUND;
+      }
     }
 
-    // increment the currentLevelSize
-    currentLevelSize +=
-        sizeof(uint8_t) + sizeof(uint32_t) + t.value.length() + 1;
+    uint64_t childrenNo = f.childrenNo(node);
+    if (childrenNo == 0)  // we've arrived to the leaf node
+      return f.id(node);
+
+    TrieNodeRef child = f.firstChild(node);
+    for (uint64_t i = 0; i < childrenNo; i++) {
+      if (i > 0) child = f.nextSibling(child);
+      if (f.label(child)[0] == '\0') return f.id(child);
+    }
+    return NIME_TRIE_WORD_NOT_FOUND;
+  }
+};
+
+struct FindWordPrefixes {
+  typedef std::vector<Trie::WordIdPair> Result;
+  const std::string &hstr;
+
+  Trie::WordIdPair prefix(size_t length, uint32_t id) const {
+    Trie::WordIdPair wp;
+    wp.id = id;
+    wp.str = String(HangulString(hstr.substr(0, length)));
+    return wp;
   }
 
-  // 2. write their children and set their children offset
-  uint32_t offset = 0;
-  for (const TrieNode &t : children) {
-    if (t.children.size() > 0) {
-      *((uint32_t *)(na + offset + sizeof(uint8_t))) =
-          currentLevelSize - offset;
-      currentLevelSize += writeChildren(na + currentLevelSize, t.children);
+  template <typename F>
+  std::vector<Trie::WordIdPair> operator()(const F &f) const {
+    std::vector<Trie::WordIdPair> prefixes;
+    TrieNodeRef node = f.root();
+    if (f.childrenNo(node) == 0) return prefixes;
+    size_t strOffset = 0;
+
+    while (strOffset < hstr.length()) {
+      uint64_t childrenNo = f.childrenNo(node);
+      bool foundNodeToDescendTo = false;
+      TrieNodeRef descendTo;
+      size_t newStrOffset = 0;
+      bool foundZeroNode = false;
+
+      // find a node to descend to and add all nodes with value of '/0' to
+      // the prefixes
+      TrieNodeRef child = f.firstChild(node);
+      for (uint64_t i = 0; i < childrenNo; i++) {
+        if (i > 0) child = f.nextSibling(child);
+        const char *label = f.label(child);
+        size_t matched = matchLabel(hstr.c_str() + strOffset, label);
+
+        // exact match -> descend into the children node
+        if (matched > 0) {
+          newStrOffset = strOffset + matched;
+          descendTo = child;
+          foundNodeToDescendTo = true;
+        } else if (label[0] == '\0') {
+          prefixes.push_back(prefix(strOffset, f.id(child)));
+          foundZeroNode = true;
+        }
+      }
+
+      if (!foundNodeToDescendTo) {
+        if (foundZeroNode) return prefixes;
+        break;
+      }
+      node = descendTo;
+      strOffset = newStrOffset;
     }
-    offset += getLenght(na + offset);
+
+    uint64_t childrenNo = f.childrenNo(node);
+    if (childrenNo == 0) {  // we've arrived to the leaf node
+      prefixes.push_back(prefix(strOffset, f.id(node)));
+    } else {
+      TrieNodeRef child = f.firstChild(node);
+      for (uint64_t i = 0; i < childrenNo; i++) {
+        if (i > 0) child = f.nextSibling(child);
+        if (f.label(child)[0] == '\0') {
+          prefixes.push_back(prefix(strOffset, f.id(child)));
+        }
+      }
+    }
+
+    return prefixes;
   }
+};
 
-  return currentLevelSize;
+/**
+ * Returns the position in its syllable of a byte of a HangulString, 0 to 2
+ * for choseong, jungseong and jongseong, 3 for non Hangul characters,
+ * given the position following the previous byte.
+ */
+inline unsigned jamoPosition(char c, unsigned expected) {
+  return c == HangulString::NonHangulCode ? 3 : expected;
+}
+
+inline unsigned nextJamoPosition(unsigned position) {
+  return position == 3 ? 0 : (position + 1) % 3;
 }
 
-int Trie::TrieImpl::compareHStr(uint8_t *hstr1, uint8_t *hstr2) {
-  int i = 0;
-  while (hstr1[i] != 0 && hstr2[i] != 0) {
-    if (hstr1[i] == hstr2[i])
-      i++;
-    else
-      return i;
+/**
+ * A depth first search keeping a row of the Levenshtein matrix for every
+ * jamo of the current path, the distances between the path and each prefix
+ * of the searched string.
+ */
+template <typename F>
+class WithinSearch {
+ private:
+  const F &_f;
+  const std::string &_hstr;
+  uint32_t _maxEdits;
+  std::vector<unsigned> _positions;
+
+  /**
+   * The path and the rows, row d belonging to the first d jamo of the path.
+   */
+  std::string _path;
+  std::vector<unsigned> _pathPositions;
+  std::vector<uint32_t> _rows;
+  std::vector<Trie::WordIdDistance> &_found;
+
+  uint32_t *row(size_t depth) { return &_rows[depth * (_hstr.size() + 1)]; }
+
+  /**
+   * Appends a jamo to the path.
+   * \ret Whether a word continuing the path can still be close enough.
+   */
+  bool push(char c) {
+    size_t depth = _path.size();
+    size_t n = _hstr.size();
+    unsigned expected =
+        depth == 0 ? 0 : nextJamoPosition(_pathPositions.back());
+    unsigned position = jamoPosition(c, expected);
+    _path.push_back(c);
+    _pathPositions.push_back(position);
+    if (_rows.size() < (depth + 2) * (n + 1)) {
+      _rows.resize((depth + 2) * (n + 1));
+    }
+
+    const uint32_t *previous = row(depth);
+    uint32_t *current = row(depth + 1);
+    current[0] = previous[0] + 1;
+    uint32_t best = current[0];
+    for (size_t j = 1; j <= n; j++) {
+      bool same = c == _hstr[j - 1] && position == _positions[j - 1];
+      current[j] = std::min(std::min(previous[j], current[j - 1]) + 1,
+                            previous[j - 1] + (same ? 0 : 1));
+      best = std::min(best, current[j]);
+    }
+    return best <= _maxEdits;
   }
-  return i;
+
+  void pop(size_t depth) {
+    _path.resize(depth);
+    _pathPositions.resize(depth);
+  }
+
+ public:
+  WithinSearch(const F &f, const std::string &hstr, uint32_t maxEdits,
+               std::vector<Trie::WordIdDistance> &found)
+      : _f(f), _hstr(hstr), _maxEdits(maxEdits), _found(found) {
+    unsigned position = 0;
+    for (char c : hstr) {
+      position = jamoPosition(c, position);
+      _positions.push_back(position);
+      position = nextJamoPosition(position);
+    }
+    _rows.resize(hstr.size() + 1);
+    for (size_t j = 0; j <= hstr.size(); j++) _rows[j] = j;
+  }
+
+  void search(TrieNodeRef node) {
+    size_t depth = _path.size();
+    uint64_t childrenNo = _f.childrenNo(node);
+    TrieNodeRef child = _f.firstChild(node);
+    for (uint64_t i = 0; i < childrenNo; i++) {
+      if (i > 0) child = _f.nextSibling(child);
+      bool close = true;
+      for (const char *label = _f.label(child); *label != '\0' && close;
+           label++) {
+        close = push(*label);
+      }
+
+      if (close) {
+        if (_f.childrenNo(child) > 0) {
+          search(child);
+        } else {
+          uint32_t distance = row(_path.size())[_hstr.size()];
+          if (distance <= _maxEdits) {
+            Trie::WordIdDistance wd;
+            wd.str = String(HangulString(_path));
+            wd.id = _f.id(child);
+            wd.distance = distance;
+            _found.push_back(wd);
+          }
+        }
+      }
+      pop(depth);
+    }
+  }
+};
+
+struct FindWordsWithin {
+  typedef std::vector<Trie::WordIdDistance> Result;
+  const std::string &hstr;
+  uint32_t maxEdits;
+
+  template <typename F>
+  std::vector<Trie::WordIdDistance> operator()(const F &f) const {
+    std::vector<Trie::WordIdDistance> found;
+    WithinSearch<F>(f, hstr, maxEdits, found).search(f.root());
+    std::stable_sort(found.begin(), found.end(),
+                     [](const Trie::WordIdDistance &a,
+                        const Trie::WordIdDistance &b) {
+                       return a.distance < b.distance;
+                     });
+    return found;
+  }
+};
+
+/**
+ * Jamo bytes are counted from one, a zero in a pattern matches any jamo of
+ * its position in the syllable, up to the number of choseong, jungseong and
+ * jongseong (including none) respectively.
+ */
+static const char PatternWildcard = '\0';
+static const char PatternJamoNo[3] = {19, 21, 28};
+
+/**
+ * Returns true if a byte matches the byte at the given position of a
+ * pattern. Non Hangul characters never match, as patterns only consist of
+ * syllables.
+ */
+inline bool matchesPattern(const std::string &pattern, size_t position,
+                           char c) {
+  if (pattern[position] != PatternWildcard) return pattern[position] == c;
+  return c >= 1 && c <= PatternJamoNo[position % 3];
 }
 
-int Trie::TrieImpl::compareHStr(std::string hstr1, std::string hstr2) {
-  return compareHStr((uint8_t *)hstr1.c_str(), (uint8_t *)hstr2.c_str());
+template <typename F>
+class PatternSearch {
+ private:
+  const F &_f;
+  const std::string &_pattern;
+  std::string _path;
+  std::vector<Trie::WordIdPair> &_found;
+
+  void found(TrieNodeRef leaf) {
+    Trie::WordIdPair wip;
+    wip.str = String(HangulString(_path));
+    wip.id = _f.id(leaf);
+    _found.push_back(wip);
+  }
+
+ public:
+  PatternSearch(const F &f, const std::string &pattern,
+                std::vector<Trie::WordIdPair> &found)
+      : _f(f), _pattern(pattern), _found(found) {}
+
+  void search(TrieNodeRef node) {
+    size_t depth = _path.size();
+    uint64_t childrenNo = _f.childrenNo(node);
+    TrieNodeRef child = _f.firstChild(node);
+    for (uint64_t i = 0; i < childrenNo; i++) {
+      if (i > 0) child = _f.nextSibling(child);
+      const char *label = _f.label(child);
+      size_t matched = 0;
+      while (label[matched] != '\0' && depth + matched < _pattern.size() &&
+             matchesPattern(_pattern, depth + matched, label[matched])) {
+        matched++;
+      }
+      if (label[matched] != '\0') continue;
+
+      _path.append(label, matched);
+      if (_f.childrenNo(child) > 0) {
+        search(child);
+      } else if (_path.size() == _pattern.size()) {
+        found(child);
+      }
+      _path.resize(depth);
+    }
+  }
+};
+
+struct FindPattern {
+  typedef std::vector<Trie::WordIdPair> Result;
+  const std::string &pattern;
+
+  template <typename F>
+  std::vector<Trie::WordIdPair> operator()(const F &f) const {
+    std::vector<Trie::WordIdPair> found;
+    PatternSearch<F>(f, pattern, found).search(f.root());
+    return found;
+  }
+};
+}
+
+struct Trie::TrieImpl::ReadNodes {
+  typedef void Result;
+  TrieImpl *trie;
+
+  template <typename F>
+  void operator()(const F &f) const {
+    trie->readChildren(f, f.root(), Root);
+  }
+};
+
+/**
+ * Writes the children of a node, the children's own groups first so that
+ * the group can refer to them, unless the same group has been written
+ * already. The ids of the leaves are collected in the order of the trie.
+ * \ret The position of the children group.
+ */
+template <typename F>
+uint64_t Trie::TrieImpl::writeDawgChildren(
+    const F &f, TrieNodeRef parent, std::string &na,
+    std::unordered_map<std::string, uint64_t> &groups,
+    std::vector<uint32_t> &ids, uint64_t *wordsNo) const {
+  std::string group;
+  *wordsNo = 0;
+  uint64_t childrenNo = f.childrenNo(parent);
+  TrieNodeRef child = f.firstChild(parent);
+  for (uint64_t i = 0; i < childrenNo; i++) {
+    if (i > 0) child = f.nextSibling(child);
+    const char *label = f.label(child);
+    uint64_t cn = f.childrenNo(child);
+    uint64_t childWordsNo = 1;
+    uint64_t childrenPos = 0;
+    if (cn > 0) {
+      childrenPos = writeDawgChildren(f, child, na, groups, ids,
+                                      &childWordsNo);
+    } else {
+      ids.push_back(f.id(child));
+    }
+    DawgTrieFormat::appendNode(group, cn, childWordsNo, childrenPos, label,
+                               std::strlen(label));
+    *wordsNo += childWordsNo;
+  }
+
+  // the children positions make equal groups have equal subtrees
+  auto found = groups.find(group);
+  if (found != groups.end()) return found->second;
+  uint64_t pos = na.size();
+  na.append(group);
+  groups.emplace(std::move(group), pos);
+  return pos;
+}
+
+struct Trie::TrieImpl::Minimize {
+  typedef void Result;
+  TrieImpl *trie;
+
+  template <typename F>
+  void operator()(const F &f) const {
+    std::string na(DawgTrieFormat::HeaderSize, '\0');
+    std::unordered_map<std::string, uint64_t> groups;
+    std::vector<uint32_t> ids;
+    uint64_t wordsNo;
+    uint64_t rootChildrenNo = f.childrenNo(f.root());
+    uint64_t rootChildrenPos =
+        trie->writeDawgChildren(f, f.root(), na, groups, ids, &wordsNo);
+
+    na.resize((na.size() + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1));
+    uint64_t idsOffset = na.size();
+    na.append((const char *)ids.data(), ids.size() * sizeof(uint32_t));
+    DawgTrieFormat::writeHeader(&na[0], idsOffset, rootChildrenNo,
+                                rootChildrenPos);
+    trie->setSerializedNodeArray(na, Format::Dawg);
+  }
+};
+
+struct Trie::TrieImpl::Succinct {
+  typedef void Result;
+  TrieImpl *trie;
+
+  template <typename F>
+  void operator()(const F &f) const {
+    trie->setSerializedNodeArray(LoudsTrieFormat::convert(f), Format::Louds);
+  }
+};
+
+/**
+ * Converts the frozen trie to one of the formats converted from another
+ * one, Dawg or Louds.
+ */
+void Trie::TrieImpl::convert(Format format) {
+  if (_editingMode || _format == format) return;
+  if (format == Format::Dawg) {
+    withFormat(Minimize{this});
+  } else if (format == Format::Louds) {
+    withFormat(Succinct{this});
+  }
+}
+
+void Trie::TrieImpl::releaseSerializedNodeArray() {
+  if (_ownsSerializedNodeArray) std::free(_serializedNodeArray);
+  _serializedNodeArray = nullptr;
+  _serializedNodeArraySize = 0;
+  _ownsSerializedNodeArray = true;
+  std::vector<SubtreeScore>().swap(_subtreeScores);
+  _subtreeScoresValid = false;
+  std::vector<uint64_t>().swap(_indexedNodePositions);
+  std::vector<uint32_t>().swap(_indexedNodeParents);
+  std::vector<std::pair<uint32_t, uint32_t>>().swap(_leavesById);
+  _wordIndexValid = false;
 }
 
-int Trie::TrieImpl::compareHStr(std::string hstr1, std::string hstr2,
-                                size_t offset) {
-  return compareHStr((uint8_t *)hstr1.c_str() + offset,
-                     (uint8_t *)hstr2.c_str());
+void Trie::TrieImpl::setSerializedNodeArray(const std::string &na,
+                                            Format format) {
+  char *array = (char *)std::malloc(std::max<size_t>(na.size(), 1));
+  std::memcpy(array, na.data(), na.size());
+  releaseSerializedNodeArray();
+  _serializedNodeArray = array;
+  _serializedNodeArraySize = na.size();
+  _format = format;
+}
+
+uint64_t Trie::TrieImpl::childrenNo(TrieNodeRef node) const {
+  return withFormat(ChildrenNo{node});
+}
+
+TrieNodeRef Trie::TrieImpl::firstChild(TrieNodeRef node) const {
+  return withFormat(FirstChild{node});
+}
+
+TrieNodeRef Trie::TrieImpl::nextSibling(TrieNodeRef node) const {
+  return withFormat(NextSibling{node});
+}
+
+const char *Trie::TrieImpl::label(TrieNodeRef node) const {
+  return withFormat(Label{node});
+}
+
+uint32_t Trie::TrieImpl::id(TrieNodeRef node) const {
+  return withFormat(Id{node});
 }
 
 ////
@@ -257,91 +959,127 @@ int Trie::TrieImpl::compareHStr(std::string hstr1, std::string hstr2,
 ////
 
 void Trie::TrieImpl::makeEditable() {
-  uint8_t rootChildrenNo = 0;
-  _rootChildren.clear();
+  resetNodes();
   _editingMode = true;
 
   if (_serializedNodeArray == nullptr) return;
 
-  char *naPtr = _serializedNodeArray;
-  rootChildrenNo = getChildrenNo(naPtr);
-  naPtr += sizeof(uint8_t);  // move to the start
+  withFormat(ReadNodes{this});
+  ownValues();
+  releaseSerializedNodeArray();
+}
 
-  _rootChildren.reserve(rootChildrenNo);
+void Trie::TrieImpl::freeze(Format format) {
+  if (!_editingMode) return;
 
-  for (int i = 0; i < rootChildrenNo; i++) {
-    _rootChildren.push_back(readNodeAndChildren(naPtr));
-    naPtr += getLenght(naPtr);
+  bool autoFormat = format == Format::Auto;
+  if (autoFormat) {
+    format = fitsNarrow() ? Format::Narrow : Format::Wide;
+  } else if (format == Format::Narrow && !fitsNarrow()) {
+    throw std::length_error(
+        "The trie has nodes with more children than the narrow format "
+        "supports.");
   }
+  compactValues();
+
+  if (format == Format::Narrow) {
+    try {
+      serialize<NarrowTrieFormat>();
+    } catch (const std::length_error &) {
+      // too large for 32-bit offsets
+      if (!autoFormat) throw;
+      format = Format::Wide;
+    }
+  }
+  // the other formats are converted from the wide one
+  bool converted = format == Format::Dawg || format == Format::Louds;
+  if (format == Format::Wide || converted) serialize<WideTrieFormat>();
 
-  std::free(_serializedNodeArray);
-  _serializedNodeArray = nullptr;
-}
-
-void Trie::TrieImpl::freeze() {
+  _format = converted ? Format::Wide : format;
   _editingMode = false;
-  if (_rootChildren.size() == 0) return;
+  if (converted) convert(format);
 
-  // count the size to allocate first
-  uint32_t size = getBranchLength(_rootChildren, 0);
+  // release the arenas, keeping just the root
+  std::vector<TrieNode>().swap(_nodes);
+  std::string().swap(_values);
+  resetNodes();
+}
 
-  _serializedNodeArray = (char *)std::malloc(sizeof(uint8_t) + size);
-  _serializedNodeArraySize = sizeof(uint8_t) + size;
-  *_serializedNodeArray = (uint8_t)_rootChildren.size();
+void Trie::TrieImpl::adoptSerializedNodeArray(char *array, uint64_t size,
+                                              Format format) {
+  releaseSerializedNodeArray();
+  clearValues();
+  _serializedNodeArray = array;
+  _serializedNodeArraySize = size;
+  _format = format;
+  _editingMode = false;
 
-  writeChildren(_serializedNodeArray + sizeof(uint8_t), _rootChildren);
+  std::vector<TrieNode>().swap(_nodes);
+  std::string().swap(_values);
+  resetNodes();
 }
 
 uint32_t Trie::TrieImpl::addWord(const String &str, uint32_t id, bool replace) {
   if (!_editingMode) return 0;
+  if (_valueSetsNo > 0) {
+    throw std::invalid_argument(
+        "Words without values can't be added to a trie with values.");
+  }
+  return insertWord(str, id, replace);
+}
+
+/**
+ * Adds a word with an id, which for a trie with values is the index of its
+ * values.
+ */
+uint32_t Trie::TrieImpl::insertWord(const String &str, uint32_t id,
+                                    bool replace) {
   std::string hstr = str.toHangulString().theString;
   size_t strOffset = 0;
 
-  TrieNode *currentNode = nullptr;
-  std::vector<TrieNode> *currentNodeChildrenRef = &_rootChildren;
+  // the nodes are referred to by index, adding nodes may move them
+  uint32_t currentNode = Root;
 
   while (strOffset < hstr.length()) {
     bool foundNodeToDescendTo = false;
-    for (int c = 0; c < currentNodeChildrenRef->size(); c++) {
-      TrieNode &n = (*currentNodeChildrenRef)[c];
-      int charactersInCommon = compareHStr(hstr, n.value, strOffset);
+    for (uint32_t c = _nodes[currentNode].firstChild; c != NoNode;
+         c = _nodes[c].nextSibling) {
+      uint32_t valueLength = _nodes[c].valueLength;
+      uint32_t charactersInCommon = compareHStr(hstr, strOffset, c);
 
       // exact match -> descend into the children node
-      if (charactersInCommon == n.value.length() && n.value != "") {
+      if (charactersInCommon == valueLength && valueLength > 0) {
         strOffset += charactersInCommon;
-
-        currentNodeChildrenRef = &n.children;
-        currentNode = &n;
-
+        currentNode = c;
         foundNodeToDescendTo = true;
-
         break;
       }
 
       // non-exact match:
       else if (charactersInCommon > 0) {
-        // 1. shorten the current node value
-        std::string originalString = n.value;
-        n.value = hstr.substr(strOffset, charactersInCommon);
+        // 1. move the rest of the value and the children to a new node
+        uint32_t existingNodes =
+            newNode(_nodes[c].valueOffset + charactersInCommon,
+                    valueLength - charactersInCommon, _nodes[c].id);
+        TrieNode &e = _nodes[existingNodes];
+        TrieNode &n = _nodes[c];
+        e.firstChild = n.firstChild;
+        e.lastChild = n.lastChild;
+        e.childrenNo = n.childrenNo;
+
+        // 2. shorten the current node value
+        n.valueLength = charactersInCommon;
+        n.firstChild = n.lastChild = NoNode;
+        n.childrenNo = 0;
         strOffset += charactersInCommon;
 
-        // 2. create a new branch for the existing nodes
-        std::vector<TrieNode> existingChildren = std::move(n.children);
-        n.children.clear();
-
-        TrieNode existingNodes;
-        existingNodes.value = originalString.substr(charactersInCommon);
-        existingNodes.children = std::move(existingChildren);
-        existingNodes.id = n.id;
-
         // 3. create a new branch for the string that is being inserted
-        TrieNode newBranch;
-        newBranch.value = hstr.substr(strOffset);
-        newBranch.id = id;
+        uint32_t newBranch = newNode(hstr.c_str() + strOffset,
+                                     hstr.length() - strOffset, id);
 
         // 4. push them back and exit
-        n.children.push_back(std::move(newBranch));
-        n.children.push_back(std::move(existingNodes));
+        appendChild(c, newBranch);
+        appendChild(c, existingNodes);
 
         return id;
       }
@@ -350,330 +1088,784 @@ uint32_t Trie::TrieImpl::addWord(const String &str, uint32_t id, bool replace) {
     // create a new node and exit if we couldn't descend
     if (!foundNodeToDescendTo) {
       //  create two (preserve the original) if current node is final
-      if (currentNodeChildrenRef->size() == 0 &&
-          currentNodeChildrenRef != &_rootChildren) {
-        std::vector<TrieNode> oldChildren = std::move(*currentNodeChildrenRef);
-        currentNodeChildrenRef->clear();
+      if (_nodes[currentNode].childrenNo == 0 && currentNode != Root) {
         // zero node
-        TrieNode z;
-        z.value = "";
-        z.children = std::move(oldChildren);
-        if (z.children.size() == 0 && currentNode != nullptr)
-          z.id = currentNode->id;
-        currentNodeChildrenRef->push_back(std::move(z));
+        uint32_t z = newNode(uint64_t(0), 0, _nodes[currentNode].id);
+        appendChild(currentNode, z);
       }
 
       // new node
-      TrieNode n;
-      n.value = hstr.substr(strOffset);
-      n.id = id;
-      currentNodeChildrenRef->push_back(std::move(n));
+      uint32_t n =
+          newNode(hstr.c_str() + strOffset, hstr.length() - strOffset, id);
+      appendChild(currentNode, n);
       return id;
     }
   }
 
   // replace or return id if we're finished
-  if (strOffset == hstr.length() && currentNode != nullptr) {
+  if (strOffset == hstr.length() && currentNode != Root) {
     // descend to node with value of "" if the current one is not a leaf one
     // create one if not found
-    if (currentNode->children.size() > 0) {
-      bool foundLeafNode = false;
-      for (int c = 0; c < currentNodeChildrenRef->size(); c++) {
-        TrieNode &n = (*currentNodeChildrenRef)[c];
-        if (n.value == "") {
-          currentNode = &n;
-          foundLeafNode = true;
-        }
+    if (_nodes[currentNode].childrenNo > 0) {
+      uint32_t leafNode = NoNode;
+      for (uint32_t c = _nodes[currentNode].firstChild; c != NoNode;
+           c = _nodes[c].nextSibling) {
+        if (_nodes[c].valueLength == 0) leafNode = c;
       }
-      if (!foundLeafNode) {
-        TrieNode newNode;
-        newNode.value = "";
-        newNode.id = id;
-        currentNodeChildrenRef->push_back(std::move(newNode));
-        currentNode = &currentNodeChildrenRef->back();
+      if (leafNode == NoNode) {
+        leafNode = newNode(uint64_t(0), 0, id);
+        appendChild(currentNode, leafNode);
       }
+      currentNode = leafNode;
     }
-    if (replace) currentNode->id = id;
-    return currentNode->id;
+    if (replace) _nodes[currentNode].id = id;
+    return _nodes[currentNode].id;
   }
   return id;
 }
 
-uint32_t Trie::TrieImpl::findWord(const String &str) {
-  if (_editingMode) return NIME_TRIE_WORD_NOT_FOUND;
+void Trie::TrieImpl::pointAtOwnedValues() {
+  _valueOffsets = _ownedValueOffsets.data();
+  _valueData = _ownedValueData.data();
+  _valueSetsNo =
+      _ownedValueOffsets.empty() ? 0 : _ownedValueOffsets.size() - 1;
+}
 
-  std::string hstr = str.toHangulString().theString;
-  size_t strOffset = 0;
+/**
+ * Copies the values table of a mapped image, to be edited.
+ */
+void Trie::TrieImpl::ownValues() {
+  if (_valueSetsNo > 0 && _valueOffsets != _ownedValueOffsets.data()) {
+    _ownedValueOffsets.assign(_valueOffsets,
+                              _valueOffsets + _valueSetsNo + 1);
+    _ownedValueData.assign(_valueData,
+                           _valueData + _valueOffsets[_valueSetsNo]);
+  }
+  pointAtOwnedValues();
+}
 
-  char *currentNodePtr = _serializedNodeArray;
+void Trie::TrieImpl::clearValues() {
+  std::vector<uint32_t>().swap(_ownedValueOffsets);
+  std::vector<uint32_t>().swap(_ownedValueData);
+  pointAtOwnedValues();
+}
 
-  while (strOffset < hstr.length()) {
-    uint8_t childrenNo = getChildrenNo(currentNodePtr);
-    uint32_t read = 0;
-    bool foundNodeToDescendTo = false;
+/**
+ * Drops the values no word refers to any more, such as those replaced by
+ * adding a word again, and renumbers the rest.
+ */
+void Trie::TrieImpl::compactValues() {
+  if (_valueSetsNo == 0) return;
+
+  std::vector<uint32_t> offsets(1, 0);
+  std::vector<uint32_t> data;
+  std::vector<uint32_t> renumbered(_valueSetsNo, uint32_t(NoNode));
+  for (uint32_t n = Root + 1; n < _nodes.size(); n++) {
+    TrieNode &node = _nodes[n];
+    // only the ids of leaves are used
+    if (node.childrenNo > 0 || node.id >= _valueSetsNo) continue;
+    uint32_t &index = renumbered[node.id];
+    if (index == NoNode) {
+      index = offsets.size() - 1;
+      data.insert(data.end(), _valueData + _valueOffsets[node.id],
+                  _valueData + _valueOffsets[node.id + 1]);
+      offsets.push_back(data.size());
+    }
+    node.id = index;
+  }
+  _ownedValueOffsets.swap(offsets);
+  _ownedValueData.swap(data);
+  pointAtOwnedValues();
+}
 
-    // for each child of the current node
-    for (int i = 0; i < childrenNo; i++) {
-      char *childPointer =
-          currentNodePtr +
-          getChildrenOffset(currentNodePtr, _serializedNodeArray) + read;
-      char *value = getValuePtr(childPointer);
-      int charactersInCommon =
-          compareHStr((uint8_t *)(hstr.c_str() + strOffset), (uint8_t *)value);
+uint32_t Trie::TrieImpl::addWordValues(const String &str,
+                                       const std::vector<uint32_t> &values) {
+  if (!_editingMode) return 0;
+  // the id of a word added with addWord would be taken for an index
+  if (_valueSetsNo == 0 && _nodes.size() > 1) {
+    throw std::invalid_argument(
+        "Words with values can't be added to a trie without values.");
+  }
 
-      // exact match -> descend into the children node
-      if (charactersInCommon == std::strlen((char *)value) &&
-          value[0] != '\0') {
-        strOffset += charactersInCommon;
-        currentNodePtr = childPointer;
-        foundNodeToDescendTo = true;
-        break;
-      }
-      read += getLenght(childPointer);
-    }
-    if (!foundNodeToDescendTo) {
-      return NIME_TRIE_WORD_NOT_FOUND;
-    }
+  ownValues();
+  if (_ownedValueOffsets.empty()) _ownedValueOffsets.push_back(0);
+  if (_ownedValueData.size() + values.size() > UINT32_MAX ||
+      _ownedValueOffsets.size() >= NoNode) {
+    throw std::length_error("The trie has too many values.");
   }
+  uint32_t index = _ownedValueOffsets.size() - 1;
+  _ownedValueData.insert(_ownedValueData.end(), values.begin(),
+                         values.end());
+  _ownedValueOffsets.push_back(_ownedValueData.size());
+  pointAtOwnedValues();
+  return insertWord(str, index, true);
+}
 
-  uint8_t childrenNo = getChildrenNo(currentNodePtr);
-  if (childrenNo == 0)  // we've arrived to the leaf node
-    return getId(currentNodePtr);
-  else {
-    uint32_t read = 0;
-    for (int i = 0; i < childrenNo; i++) {
-      char *childPointer =
-          currentNodePtr +
-          getChildrenOffset(currentNodePtr, _serializedNodeArray) + read;
-      uint8_t *value = (uint8_t *)getValuePtr(childPointer);
-      if (value[0] == '\0') return getId(childPointer);
-      read += getLenght(childPointer);
-    }
+Trie::Values Trie::TrieImpl::values(uint32_t id) const {
+  if (_editingMode || id >= _valueSetsNo) return {nullptr, 0};
+  return {_valueData + _valueOffsets[id],
+          _valueOffsets[id + 1] - _valueOffsets[id]};
+}
+
+Trie::Values Trie::TrieImpl::findWordValues(const String &str) {
+  return values(findWord(str));
+}
+
+std::vector<Trie::WordValuesPair> Trie::TrieImpl::findWordPrefixValues(
+    const String &str) {
+  std::vector<WordValuesPair> prefixes;
+  for (WordIdPair &wip : findWordPrefixes(str)) {
+    prefixes.push_back({std::move(wip.str), values(wip.id)});
   }
+  return prefixes;
+}
+
+uint32_t Trie::TrieImpl::findWord(const String &str) {
+  if (_editingMode) return NIME_TRIE_WORD_NOT_FOUND;
 
-  return NIME_TRIE_WORD_NOT_FOUND;
+  std::string hstr = str.toHangulString().theString;
+  return withFormat(FindWord{hstr});
 }
 
 std::vector<Trie::WordIdPair> Trie::TrieImpl::findWordPrefixes(
     const String &str) {
-  std::vector<WordIdPair> prefixes;
-  if (_editingMode) return prefixes;
+  if (_editingMode) return std::vector<WordIdPair>();
 
-  char *currentNodePtr = _serializedNodeArray;
   std::string hstr = str.toHangulString().theString;
-  size_t strOffset = 0;
-  size_t newStrOffset = 0;
+  return withFormat(FindWordPrefixes{hstr});
+}
 
-  while (strOffset < hstr.length()) {
-    uint8_t childrenNo = getChildrenNo(currentNodePtr);
-    uint32_t read = 0;
-    bool foundNodeToDescendTo = false;
+std::vector<Trie::WordIdDistance> Trie::TrieImpl::findWordsWithin(
+    const String &str, uint32_t maxEdits) {
+  if (_editingMode) return std::vector<WordIdDistance>();
 
-    char *descendToNodePtr = nullptr;
-    bool foundZeroNode = false;
-    // find a node to descend to and add all nodes with value of '/0' to the
-    // prefixes
-    for (int i = 0; i < childrenNo; i++) {
-      char *childPointer =
-          currentNodePtr +
-          getChildrenOffset(currentNodePtr, _serializedNodeArray) + read;
-      uint8_t *value = (uint8_t *)getValuePtr(childPointer);
-      int charactersInCommon =
-          compareHStr((uint8_t *)(hstr.c_str() + strOffset), (uint8_t *)value);
+  std::string hstr = str.toHangulString().theString;
+  return withFormat(FindWordsWithin{hstr, maxEdits});
+}
 
-      // exact match -> descend into the children node
-      if (charactersInCommon == std::strlen((char *)value) &&
-          value[0] != '\0') {
-        newStrOffset = strOffset + charactersInCommon;
-        descendToNodePtr = childPointer;
-        foundNodeToDescendTo = true;
-      } else if (value[0] == '\0') {
-        WordIdPair wp;
-        wp.id = getId(childPointer);
-        wp.str = String(HangulString(hstr.substr(0, strOffset)));
-        prefixes.push_back(wp);
-        foundZeroNode = true;
+struct Trie::TrieImpl::ScoreSubtrees {
+  typedef void Result;
+  TrieImpl *trie;
+
+  template <typename F>
+  float score(const F &f, TrieNodeRef node) const {
+    uint64_t childrenNo = f.childrenNo(node);
+    if (childrenNo == 0) return trie->score(f.id(node));
+
+    float best = -std::numeric_limits<float>::infinity();
+    TrieNodeRef child = f.firstChild(node);
+    for (uint64_t i = 0; i < childrenNo; i++) {
+      if (i > 0) child = f.nextSibling(child);
+      best = std::max(best, score(f, child));
+    }
+    trie->_subtreeScores.push_back({node.pos, node.rank, best});
+    return best;
+  }
+
+  template <typename F>
+  void operator()(const F &f) const {
+    trie->_subtreeScores.clear();
+    // the root of an empty trie isn't a leaf
+    if (f.childrenNo(f.root()) == 0) return;
+    score(f, f.root());
+    std::sort(trie->_subtreeScores.begin(), trie->_subtreeScores.end());
+  }
+};
+
+float Trie::TrieImpl::subtreeScore(TrieNodeRef node) const {
+  SubtreeScore key = {node.pos, node.rank, 0};
+  auto found =
+      std::lower_bound(_subtreeScores.begin(), _subtreeScores.end(), key);
+  return found->score;
+}
+
+/**
+ * Descends to the node the prefix ends in and then takes the nodes with
+ * the highest scores below them first. Since an inner node's score is the
+ * highest of its subtree, the leaves come out best first.
+ */
+struct Trie::TrieImpl::Complete {
+  typedef std::vector<WordIdPair> Result;
+  const TrieImpl *trie;
+  const std::string &hprefix;
+  size_t k;
+
+  /**
+   * A node reached by the search and the entry of its parent, whose labels
+   * make up its path.
+   */
+  struct Entry {
+    TrieNodeRef node;
+    size_t parent;
+  };
+
+  template <typename F>
+  std::vector<WordIdPair> operator()(const F &f) const {
+    std::vector<WordIdPair> completions;
+    if (k == 0) return completions;
+
+    // the node the prefix ends in, and its path
+    TrieNodeRef node = f.root();
+    std::string path;
+    while (path.size() < hprefix.size()) {
+      uint64_t childrenNo = f.childrenNo(node);
+      bool foundNodeToDescendTo = false;
+      TrieNodeRef child = f.firstChild(node);
+      for (uint64_t i = 0; i < childrenNo; i++) {
+        if (i > 0) child = f.nextSibling(child);
+        const char *label = f.label(child);
+        size_t matched = 0;
+        while (label[matched] != '\0' &&
+               path.size() + matched < hprefix.size() &&
+               label[matched] == hprefix[path.size() + matched]) {
+          matched++;
+        }
+        if (matched > 0 && (label[matched] == '\0' ||
+                            path.size() + matched == hprefix.size())) {
+          path.append(label);
+          node = child;
+          foundNodeToDescendTo = true;
+          break;
+        }
       }
-      read += getLenght(childPointer);
+      if (!foundNodeToDescendTo) return completions;
     }
+    // an empty trie
+    if (path.empty() && f.childrenNo(node) == 0) return completions;
+
+    std::vector<Entry> entries = {{node, 0}};
+    typedef std::pair<float, size_t> Candidate;
+    auto worse = [](const Candidate &a, const Candidate &b) {
+      // ties go to the entry found first, which is first in the trie
+      return a.first != b.first ? a.first < b.first : a.second > b.second;
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>, decltype(worse)>
+        candidates(worse);
+    candidates.push({0, 0});
+
+    while (!candidates.empty() && completions.size() < k) {
+      size_t e = candidates.top().second;
+      candidates.pop();
+      TrieNodeRef current = entries[e].node;
+      uint64_t childrenNo = f.childrenNo(current);
+
+      if (childrenNo == 0) {
+        std::vector<const char *> labels;
+        for (size_t p = e; p != 0; p = entries[p].parent) {
+          labels.push_back(f.label(entries[p].node));
+        }
+        std::string word = path;
+        for (size_t l = labels.size(); l-- > 0;) word.append(labels[l]);
+
+        WordIdPair wip;
+        wip.str = String(HangulString(word));
+        wip.id = f.id(current);
+        completions.push_back(wip);
+        continue;
+      }
 
-    if (!foundNodeToDescendTo) {
-      if (foundZeroNode) return prefixes;
-      goto finalize;
-    } else {
-      currentNodePtr = descendToNodePtr;
-      strOffset = newStrOffset;
+      TrieNodeRef child = f.firstChild(current);
+      for (uint64_t i = 0; i < childrenNo; i++) {
+        if (i > 0) child = f.nextSibling(child);
+        float score = f.childrenNo(child) == 0 ? trie->score(f.id(child))
+                                               : trie->subtreeScore(child);
+        entries.push_back({child, e});
+        candidates.push({score, entries.size() - 1});
+      }
     }
+    return completions;
   }
+};
 
-finalize:
-  uint8_t childrenNo = getChildrenNo(currentNodePtr);
-  if (childrenNo == 0) {  // we've arrived to the leaf node
-    WordIdPair wp;
-    wp.id = getId(currentNodePtr);
-    wp.str = String(HangulString(hstr.substr(0, strOffset)));
-    prefixes.push_back(wp);
-  } else {
-    uint32_t read = 0;
-    for (int i = 0; i < childrenNo; i++) {
-      char *childPointer =
-          currentNodePtr +
-          getChildrenOffset(currentNodePtr, _serializedNodeArray) + read;
-      uint8_t *value = (uint8_t *)getValuePtr(childPointer);
-      if (value[0] == '\0') {
-        WordIdPair wp;
-        wp.id = getId(childPointer);
-        wp.str = String(HangulString(hstr.substr(0, strOffset)));
-        prefixes.push_back(wp);
-      }
-      read += getLenght(childPointer);
+void Trie::TrieImpl::setScores(std::vector<float> scores) {
+  _scores = std::move(scores);
+  _subtreeScoresValid = false;
+}
+
+std::vector<Trie::WordIdPair> Trie::TrieImpl::complete(const String &prefix,
+                                                       size_t k) {
+  if (_editingMode) return std::vector<WordIdPair>();
+
+  if (!_subtreeScoresValid) {
+    withFormat(ScoreSubtrees{this});
+    _subtreeScoresValid = true;
+  }
+  std::string hprefix = prefix.toHangulString().theString;
+  return withFormat(Complete{this, hprefix, k});
+}
+
+/**
+ * Builds the reverse index, recording the parent of every node and the
+ * leaf of every word.
+ */
+struct Trie::TrieImpl::IndexWords {
+  typedef void Result;
+  TrieImpl *trie;
+
+  template <typename F>
+  void index(const F &f, TrieNodeRef node, uint32_t parent) const {
+    uint32_t entry = (uint32_t)trie->_indexedNodePositions.size();
+    if (entry == NoNode) {
+      throw std::length_error("The trie has too many nodes to index.");
+    }
+    trie->_indexedNodePositions.push_back(node.pos);
+    trie->_indexedNodeParents.push_back(parent);
+
+    uint64_t childrenNo = f.childrenNo(node);
+    if (childrenNo == 0) {
+      trie->_leavesById.push_back({f.id(node), entry});
+      return;
+    }
+    TrieNodeRef child = f.firstChild(node);
+    for (uint64_t i = 0; i < childrenNo; i++) {
+      if (i > 0) child = f.nextSibling(child);
+      index(f, child, entry);
     }
   }
 
-  return prefixes;
+  template <typename F>
+  void operator()(const F &f) const {
+    trie->_indexedNodePositions.clear();
+    trie->_indexedNodeParents.clear();
+    trie->_leavesById.clear();
+    TrieNodeRef root = f.root();
+    uint64_t childrenNo = f.childrenNo(root);
+    TrieNodeRef child = f.firstChild(root);
+    for (uint64_t i = 0; i < childrenNo; i++) {
+      if (i > 0) child = f.nextSibling(child);
+      index(f, child, NoNode);
+    }
+    // the first word in the order of the trie wins when ids repeat
+    std::stable_sort(trie->_leavesById.begin(), trie->_leavesById.end(),
+                     [](const std::pair<uint32_t, uint32_t> &a,
+                        const std::pair<uint32_t, uint32_t> &b) {
+                       return a.first < b.first;
+                     });
+  }
+};
+
+String Trie::TrieImpl::wordForId(uint32_t id) {
+  if (_editingMode) return String();
+
+  if (!_wordIndexValid) {
+    withFormat(IndexWords{this});
+    _wordIndexValid = true;
+  }
+  auto leaf = std::lower_bound(
+      _leavesById.begin(), _leavesById.end(), id,
+      [](const std::pair<uint32_t, uint32_t> &entry, uint32_t id) {
+        return entry.first < id;
+      });
+  if (leaf == _leavesById.end() || leaf->first != id) return String();
+
+  // the labels from the leaf up, joined from the root down
+  std::vector<const char *> labels;
+  for (uint32_t entry = leaf->second; entry != NoNode;
+       entry = _indexedNodeParents[entry]) {
+    labels.push_back(label({_indexedNodePositions[entry], 0}));
+  }
+  std::string hstr;
+  for (size_t i = labels.size(); i-- > 0;) hstr.append(labels[i]);
+  return String(HangulString(hstr));
+}
+
+std::vector<Trie::WordIdPair> Trie::TrieImpl::findPattern(
+    const std::vector<SyllablePattern> &pattern) {
+  if (_editingMode) return std::vector<WordIdPair>();
+
+  // the jamo of each syllable as encoded by String::toHangulString, with
+  // wildcards standing in for Any
+  typedef Character::HangulJamo Jamo;
+  std::string hpattern;
+  for (const SyllablePattern &syllable : pattern) {
+    Character c(syllable.choseong == Jamo::Any ? Jamo::Giyeok
+                                               : syllable.choseong,
+                syllable.jungseong == Jamo::Any ? Jamo::A
+                                                : syllable.jungseong,
+                syllable.jongseong == Jamo::Any ? Jamo::None
+                                                : syllable.jongseong);
+    std::string jamo = String(c).toHangulString().theString;
+    if (syllable.choseong == Jamo::Any) jamo[0] = PatternWildcard;
+    if (syllable.jungseong == Jamo::Any) jamo[1] = PatternWildcard;
+    if (syllable.jongseong == Jamo::Any) jamo[2] = PatternWildcard;
+    hpattern.append(jamo);
+  }
+  return withFormat(FindPattern{hpattern});
 }
 
 void Trie::TrieImpl::_debugSNA() {
-  char *snaPtr = _serializedNodeArray;
-  printf("[cn: %d]", *snaPtr);
-  snaPtr++;
-  while (snaPtr < _serializedNodeArray + _serializedNodeArraySize) {
-    uint8_t cn = getChildrenNo(snaPtr);
-    printf("[cn: %d, ", cn);
-    if (cn == 0) {
-      printf("id: %d, ", getId(snaPtr));
-    } else {
-      printf("co: %d, ", getChildrenOffset(snaPtr));
-    }
-    printf("v: |");
-    for (uint8_t *vPtr = (uint8_t *)getValuePtr(snaPtr); *vPtr != 0; vPtr++) {
-      printf("%d|", *vPtr);
+  if (_editingMode) return;
+
+  std::vector<TrieNodeRef> groups = {TrieNodeRef{0, 0}};
+  while (!groups.empty()) {
+    TrieNodeRef parent = groups.back();
+    groups.pop_back();
+    uint64_t childrenNo = this->childrenNo(parent);
+    printf("[cn: %llu] ", (unsigned long long)childrenNo);
+    if (childrenNo == 0) continue;
+
+    TrieNodeRef node = firstChild(parent);
+    for (uint64_t i = 0; i < childrenNo; i++) {
+      if (i > 0) node = nextSibling(node);
+      uint64_t cn = this->childrenNo(node);
+      printf("[@%llu cn: %llu, ", (unsigned long long)node.pos,
+             (unsigned long long)cn);
+      if (cn == 0) {
+        printf("id: %u, ", id(node));
+      } else {
+        printf("co: %llu, ", (unsigned long long)firstChild(node).pos);
+        groups.push_back(node);
+      }
+      printf("v: |");
+      for (const uint8_t *vPtr = (const uint8_t *)label(node); *vPtr != 0;
+           vPtr++) {
+        printf("%d|", *vPtr);
+      }
+      printf("]");
     }
-    uint32_t length = getLenght(snaPtr);
-    printf(" (%d)]", length);
-    snaPtr += length;
   }
   printf("\n");
 }
 
+/**
+ * Streams of the narrow format start with the 32-bit size of the node
+ * array, other formats with this marker followed by the format, three
+ * padding bytes and the 64-bit size.
+ */
+static const uint32_t FormatMarker = UINT32_MAX;
+
+/**
+ * Set in the flags byte following the format when the node array is
+ * followed by the values table: [u32 sets][u32 values][u32 offsets of the
+ * sets and the end][u32 values], padded to 4 bytes from the start of the
+ * trie.
+ */
+static const uint8_t HasValuesFlag = 1;
+
+/**
+ * The padding between a node array of the given size and the values.
+ */
+static inline uint64_t valuesPadding(uint64_t size) {
+  return (4 - size % 4) % 4;
+}
+
 void Trie::TrieImpl::writeToStream(std::ostream &s) {
   if (_editingMode) return;
 
-  StreamBinaryWrite<uint32_t>(s, _serializedNodeArraySize);
-  s.write(_serializedNodeArray, _serializedNodeArraySize);
+  StreamBinaryWriter writer(s);
+  bool hasValues = _valueSetsNo > 0;
+  if (_format == Format::Narrow && !hasValues) {
+    writer.write<uint32_t>(_serializedNodeArraySize);
+  } else {
+    writer.write<uint32_t>(FormatMarker);
+    writer.write<uint8_t>((uint8_t)_format);
+    writer.write<uint8_t>(hasValues ? HasValuesFlag : 0);
+    writer.writeBytes("\0\0", 2);
+    writer.write<uint64_t>(_serializedNodeArraySize);
+  }
+  writer.writeBytes(_serializedNodeArray, _serializedNodeArraySize);
+  if (hasValues) {
+    writer.writeBytes("\0\0\0", valuesPadding(_serializedNodeArraySize));
+    uint32_t valuesNo = _valueOffsets[_valueSetsNo];
+    writer.write<uint32_t>(_valueSetsNo);
+    writer.write<uint32_t>(valuesNo);
+    writer.writeArray(_valueOffsets, _valueSetsNo + 1);
+    writer.writeArray(_valueData, valuesNo);
+  }
+  writer.flush();
 }
 
 void Trie::TrieImpl::loadFromStream(std::istream &s) {
   if (_editingMode) return;
 
-  std::free(_serializedNodeArray);
+  StreamBinaryReader reader(s);
+  Format format = Format::Narrow;
+  uint8_t flags = 0;
+  uint64_t size = reader.read<uint32_t>();
+  if (size == FormatMarker) {
+    format = (Format)reader.read<uint8_t>();
+    flags = reader.read<uint8_t>();
+    char padding[2];
+    reader.readBytes(padding, 2);
+    size = reader.read<uint64_t>();
+    if (format != Format::Narrow && format != Format::Wide &&
+        format != Format::Dawg && format != Format::Louds) {
+      throw std::runtime_error("Unknown NSL::Trie format.");
+    }
+  }
+
+  // read everything before replacing the trie, so that a failed read
+  // leaves it as it was
+  char *array = (char *)std::malloc(std::max<uint64_t>(size, 1));
+  if (array == nullptr) throw std::bad_alloc();
+  std::vector<uint32_t> valueOffsets;
+  std::vector<uint32_t> valueData;
+  try {
+    reader.readBytes(array, size);
+    if (flags & HasValuesFlag) {
+      char padding[3];
+      reader.readBytes(padding, valuesPadding(size));
+      uint32_t setsNo = reader.read<uint32_t>();
+      uint32_t valuesNo = reader.read<uint32_t>();
+      valueOffsets.resize((uint64_t)setsNo + 1);
+      reader.readArray(valueOffsets.data(), valueOffsets.size());
+      if (valueOffsets.front() != 0 || valueOffsets.back() != valuesNo ||
+          !std::is_sorted(valueOffsets.begin(), valueOffsets.end())) {
+        throw std::runtime_error("Malformed NSL::Trie values.");
+      }
+      valueData.resize(valuesNo);
+      reader.readArray(valueData.data(), valueData.size());
+    }
+  } catch (...) {
+    std::free(array);
+    throw;
+  }
 
-  _serializedNodeArraySize = StreamBinaryRead<uint32_t>(s);
-  _serializedNodeArray = (char *)std::malloc(_serializedNodeArraySize);
-  s.read(_serializedNodeArray, _serializedNodeArraySize);
+  releaseSerializedNodeArray();
+  _format = format;
+  _serializedNodeArray = array;
+  _serializedNodeArraySize = size;
+  _ownedValueOffsets.swap(valueOffsets);
+  _ownedValueData.swap(valueData);
+  pointAtOwnedValues();
 }
 
-Trie::TrieImpl::~TrieImpl() {
-  if (!_editingMode) {
-    std::free(_serializedNodeArray);
+void Trie::TrieImpl::mapImage(const char *image) {
+  // parse the header before replacing anything, so that an unknown format
+  // leaves the trie as it was
+  Format format = Format::Narrow;
+  uint8_t flags = 0;
+  uint64_t size = TrieReadUnaligned<uint32_t>(image);
+  if (size == FormatMarker) {
+    format = (Format)image[4];
+    flags = image[5];
+    size = TrieReadUnaligned<uint64_t>(image + 8);
+    image += 16;
+  } else {
+    image += 4;
+  }
+  if (format != Format::Narrow && format != Format::Wide &&
+      format != Format::Dawg && format != Format::Louds) {
+    throw std::runtime_error("Unknown NSL::Trie format.");
   }
+
+  releaseSerializedNodeArray();
+  clearValues();
+  if (flags & HasValuesFlag) {
+    const char *values = image + size + valuesPadding(size);
+    _valueSetsNo = TrieReadUnaligned<uint32_t>(values);
+    _valueOffsets = reinterpret_cast<const uint32_t *>(values + 8);
+    _valueData = _valueOffsets + _valueSetsNo + 1;
+  }
+
+  // the image is only ever read
+  _format = format;
+  _serializedNodeArray = const_cast<char *>(image);
+  _serializedNodeArraySize = size;
+  _ownsSerializedNodeArray = false;
+  _editingMode = false;
+
+  std::vector<TrieNode>().swap(_nodes);
+  std::string().swap(_values);
+  resetNodes();
+}
+
+Trie::TrieImpl::~TrieImpl() {
+  if (!_editingMode) releaseSerializedNodeArray();
 }
 
 bool Trie::TrieImpl::editingMode() { return _editingMode; }
 
 Trie::WordIdPair Trie::IteratorImpl::value() {
+  const Frame &top = _stack.back();
+  _prefix.resize(top.prefixLength);
+  _prefix.append(_trie->label(top.node));
   WordIdPair wip;
-  wip.id = TrieImpl::getId(_snaPointer);
-  wip.str = String(HangulString(_prefix + TrieImpl::getValue(_snaPointer)));
+  wip.id = _trie->id(top.node);
+  wip.str = String(HangulString(_prefix));
   return wip;
 }
 
-Trie::IteratorImpl Trie::IteratorImpl::next(bool descend) {
-  // if no children left and cannot descend -> ascend back to the current
-  // node's parent
-  if (_childrenLeft == 0 && (TrieImpl::getChildrenNo(_snaPointer) == 0)) {
-  ascend:
-    if (_parent == nullptr) {
-      return _trie->end();
-    }
-    // jump to the parent
-    _snaPointer = _parent->_snaPointer;
-    _childrenLeft = _parent->_childrenLeft;
-    _prefix = _parent->_prefix;
-    _trie = _parent->_trie;
-    _parent = _parent->_parent;
-    // and move one to the right, no descending if there are children left
-    if (_childrenLeft > 0) {
-      _snaPointer += TrieImpl::getLenght(_snaPointer);
-      _childrenLeft--;
-    } else {  // else ascend some more
-      goto ascend;
-    }
-  } else {
-    uint8_t childrenNo = TrieImpl::getChildrenNo(_snaPointer);
-    if (childrenNo > 0) {
-      std::shared_ptr<IteratorImpl> newParent =
-          std::shared_ptr<IteratorImpl>(new IteratorImpl());
-      newParent->_snaPointer = _snaPointer;
-      newParent->_childrenLeft = _childrenLeft;
-      newParent->_prefix = _prefix;
-      newParent->_trie = _trie;
-      newParent->_parent = _parent;
-
-      _prefix = _prefix + std::string(TrieImpl::getValue(_snaPointer));
-      _snaPointer = _snaPointer + TrieImpl::getChildrenOffset(_snaPointer);
-      _childrenLeft = childrenNo - 1;
-      _parent = newParent;
-    } else {
-      _snaPointer += TrieImpl::getLenght(_snaPointer);
-      _childrenLeft--;
-    }
+/**
+ * Descends from the node on top of the stack to the first leaf below it.
+ */
+void Trie::IteratorImpl::descend() {
+  while (true) {
+    const Frame &top = _stack.back();
+    uint64_t childrenNo = _trie->childrenNo(top.node);
+    if (childrenNo == 0) return;
+    _prefix.resize(top.prefixLength);
+    _prefix.append(_trie->label(top.node));
+    _stack.push_back(
+        {_trie->firstChild(top.node), childrenNo - 1, _prefix.size()});
   }
+}
 
-  if (TrieImpl::getChildrenNo(_snaPointer) > 0) return next();
-  return *this;
+void Trie::IteratorImpl::next() {
+  // move to the next sibling of the deepest node having one left
+  while (!_stack.empty()) {
+    Frame &top = _stack.back();
+    if (top.childrenLeft > 0) {
+      top.node = _trie->nextSibling(top.node);
+      top.childrenLeft--;
+      descend();
+      return;
+    }
+    _stack.pop_back();
+  }
 }
 
 bool Trie::IteratorImpl::notEqualTo(const Trie::IteratorImpl &other) {
-  return (_snaPointer !=
-          other._snaPointer); /*!((_snaPointer == other._snaPointer) &&
-(_childrenLeft == other._childrenLeft) &&
-(_parent == other._parent) &&
-(_prefix == other._prefix));*/
+  if (_stack.size() != other._stack.size()) return true;
+  if (_stack.empty()) return false;
+  const TrieNodeRef &node = _stack.back().node;
+  const TrieNodeRef &otherNode = other._stack.back().node;
+  return node.pos != otherNode.pos || node.rank != otherNode.rank;
 }
 
 Trie::IteratorImpl Trie::TrieImpl::begin() {
   IteratorImpl it;
-  // pointing to the first child of the root node
-  it._snaPointer = _serializedNodeArray + sizeof(uint8_t);
-  // number of root children - 1 remaining
-  it._childrenLeft = getChildrenNo(_serializedNodeArray) - 1;
-  // null represents the root parent
-  it._parent = std::shared_ptr<IteratorImpl>(nullptr);
-  it._prefix = "";
   it._trie = this;
-  // find next node if the current isn't leaf
-  if (getChildrenNo(it._snaPointer) > 0) it.next();
+  TrieNodeRef root = {0, 0};
+  if (_editingMode || childrenNo(root) == 0) return it;
+
+  it._stack.push_back({firstChild(root), childrenNo(root) - 1, 0});
+  it.descend();
   return it;
 }
 
 Trie::IteratorImpl Trie::TrieImpl::end() {
   IteratorImpl it;
-  it._snaPointer = _serializedNodeArray + _serializedNodeArraySize;
-  it._childrenLeft = 0;
-  it._parent = std::shared_ptr<IteratorImpl>(nullptr);
-  it._prefix = "";
   it._trie = this;
   return it;
 }
 
+/**
+ * The number of subtrees partition looks for per range before it stops
+ * descending.
+ */
+static const size_t SubtreesPerRange = 8;
+
+/**
+ * Returns the first iterator of each range. The candidates are the paths to
+ * the roots of subtrees, in the order of the trie, and are replaced by the
+ * paths to their children level by level. Each path is already the state
+ * of an iterator about to descend into its subtree.
+ */
+std::vector<Trie::IteratorImpl> Trie::TrieImpl::partition(size_t rangesNo) {
+  if (rangesNo == 0) {
+    throw std::invalid_argument("A trie can't be split into no ranges.");
+  }
+  std::vector<IteratorImpl> subtrees;
+  TrieNodeRef root = {0, 0};
+  if (_editingMode || childrenNo(root) == 0) return subtrees;
+
+  IteratorImpl first;
+  first._trie = this;
+  first._stack.push_back({firstChild(root), childrenNo(root) - 1, 0});
+  for (TrieNodeRef node = first._stack.back().node;;) {
+    subtrees.push_back(first);
+    if (first._stack.back().childrenLeft == 0) break;
+    node = nextSibling(node);
+    first._stack.back().node = node;
+    first._stack.back().childrenLeft--;
+  }
+
+  bool descended = true;
+  while (descended && subtrees.size() < rangesNo * SubtreesPerRange) {
+    descended = false;
+    std::vector<IteratorImpl> children;
+    for (IteratorImpl &subtree : subtrees) {
+      const IteratorImpl::Frame &top = subtree._stack.back();
+      uint64_t n = childrenNo(top.node);
+      if (n == 0) {
+        children.push_back(std::move(subtree));
+        continue;
+      }
+      descended = true;
+      subtree._prefix.resize(top.prefixLength);
+      subtree._prefix.append(label(top.node));
+      subtree._stack.push_back(
+          {firstChild(top.node), n - 1, subtree._prefix.size()});
+      for (uint64_t i = 0; i < n; i++) {
+        if (i > 0) {
+          IteratorImpl::Frame &child = subtree._stack.back();
+          child.node = nextSibling(child.node);
+          child.childrenLeft--;
+        }
+        children.push_back(subtree);
+      }
+    }
+    subtrees.swap(children);
+  }
+
+  std::vector<IteratorImpl> begins;
+  rangesNo = std::min(rangesNo, subtrees.size());
+  for (size_t r = 0; r < rangesNo; r++) {
+    begins.push_back(std::move(subtrees[subtrees.size() * r / rangesNo]));
+    begins.back().descend();
+  }
+  return begins;
+}
+
+namespace {
+/**
+ * Visits the words depth first with an explicit stack, calling the
+ * function with the jamo of each.
+ */
+struct ForEachWord {
+  typedef void Result;
+  const std::function<void(const std::string &, uint32_t)> &function;
+
+  template <typename F>
+  void operator()(const F &f) const {
+    struct Frame {
+      TrieNodeRef node;
+      uint64_t childrenLeft;
+      size_t prefixLength;
+    };
+    std::vector<Frame> stack;
+    std::string word;
+
+    TrieNodeRef root = f.root();
+    uint64_t rootChildrenNo = f.childrenNo(root);
+    if (rootChildrenNo == 0) return;
+    stack.push_back({f.firstChild(root), rootChildrenNo, 0});
+    while (!stack.empty()) {
+      Frame &top = stack.back();
+      if (top.childrenLeft == 0) {
+        stack.pop_back();
+        continue;
+      }
+      TrieNodeRef node = top.node;
+      if (--top.childrenLeft > 0) top.node = f.nextSibling(top.node);
+
+      word.resize(top.prefixLength);
+      word.append(f.label(node));
+      uint64_t childrenNo = f.childrenNo(node);
+      if (childrenNo == 0) {
+        function(word, f.id(node));
+      } else {
+        stack.push_back({f.firstChild(node), childrenNo, word.size()});
+      }
+    }
+  }
+};
+}
+
+void Trie::TrieImpl::forEach(
+    const std::function<void(const std::string &, uint32_t)> &function) {
+  if (_editingMode) return;
+  withFormat(ForEachWord{function});
+}
+
 ////
 // Public method forwarding
 ////
 Trie::Trie() : _impl(new Trie::TrieImpl()) {}
 Trie::~Trie() = default;
 void Trie::makeEditable() { _impl->makeEditable(); };
-void Trie::freeze() { _impl->freeze(); };
+void Trie::freeze(Format format) { _impl->freeze(format); };
 uint32_t Trie::addWord(const String &str, uint32_t id, bool replace) {
   return _impl->addWord(str, id, replace);
 }
@@ -681,9 +1873,47 @@ uint32_t Trie::findWord(const String &str) { return _impl->findWord(str); }
 std::vector<Trie::WordIdPair> Trie::findWordPrefixes(const String &str) {
   return _impl->findWordPrefixes(str);
 }
+std::vector<Trie::WordIdDistance> Trie::findWordsWithin(const String &str,
+                                                        uint32_t maxEdits) {
+  return _impl->findWordsWithin(str, maxEdits);
+}
+std::vector<Trie::WordIdPair> Trie::findPattern(
+    const std::vector<SyllablePattern> &pattern) {
+  return _impl->findPattern(pattern);
+}
+void Trie::setScores(std::vector<float> scores) {
+  _impl->setScores(std::move(scores));
+}
+std::vector<Trie::WordIdPair> Trie::complete(const String &prefix, size_t k) {
+  return _impl->complete(prefix, k);
+}
+String Trie::wordForId(uint32_t id) { return _impl->wordForId(id); }
+uint32_t Trie::addWordValues(const String &str,
+                             const std::vector<uint32_t> &values) {
+  return _impl->addWordValues(str, values);
+}
+Trie::Values Trie::findWordValues(const String &str) {
+  return _impl->findWordValues(str);
+}
+std::vector<Trie::WordValuesPair> Trie::findWordPrefixValues(
+    const String &str) {
+  return _impl->findWordPrefixValues(str);
+}
+Trie::Values Trie::values(uint32_t id) { return _impl->values(id); }
 void Trie::writeToStream(std::ostream &s) { _impl->writeToStream(s); }
 void Trie::loadFromStream(std::istream &s) { _impl->loadFromStream(s); }
 bool Trie::editingMode() { return _impl->editingMode(); }
+void Trie::forEach(
+    const std::function<void(const std::string &, uint32_t)> &function) {
+  _impl->forEach(function);
+}
+void Trie::mapImage(const char *image) { _impl->mapImage(image); }
+void Trie::convert(Format format) { _impl->convert(format); }
+void Trie::adoptSerializedNodeArray(char *array, uint64_t size,
+                                    Format format) {
+  _impl->adoptSerializedNodeArray(array, size, format);
+}
+Trie::Format Trie::format() { return _impl->_format; }
 
 Trie::Iterator Trie::begin() {
   Iterator it;
@@ -697,12 +1927,32 @@ Trie::Iterator Trie::end() {
   return it;
 }
 
+std::vector<Trie::Range> Trie::partition(size_t rangesNo) {
+  std::vector<IteratorImpl> begins = _impl->partition(rangesNo);
+  std::vector<Range> ranges(begins.size());
+  for (size_t r = 0; r < begins.size(); r++) {
+    ranges[r]._begin._impl =
+        std::shared_ptr<IteratorImpl>(new IteratorImpl(begins[r]));
+    // a range ends where the next one begins, each with its own copy
+    ranges[r]._end._impl = std::shared_ptr<IteratorImpl>(new IteratorImpl(
+        r + 1 < begins.size() ? begins[r + 1] : _impl->end()));
+  }
+  return ranges;
+}
+
+Trie::Iterator Trie::Range::begin() const { return _begin; }
+Trie::Iterator Trie::Range::end() const { return _end; }
+
 Trie::Iterator::Iterator() : _impl(new Trie::IteratorImpl()) {}
 Trie::Iterator::~Iterator() = default;
 Trie::WordIdPair Trie::Iterator::operator*() { return _impl->value(); }
 Trie::WordIdPair Trie::Iterator::operator->() { return _impl->value(); }
 Trie::Iterator Trie::Iterator::operator++() {
-  _impl = std::unique_ptr<IteratorImpl>(new IteratorImpl(_impl->next()));
+  // copies share the state until one of them moves on
+  if (_impl.use_count() > 1) {
+    _impl = std::shared_ptr<IteratorImpl>(new IteratorImpl(*_impl));
+  }
+  _impl->next();
   return *this;
 }
 Trie::Iterator Trie::Iterator::operator+(uint32_t moveBy) {
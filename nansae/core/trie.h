@@ -18,6 +18,9 @@
 #define NSL_TRIE_H
 
 #include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
 
 #include "nansae/core/string.h"
 
@@ -28,6 +31,8 @@ namespace NSL {
  * libNansae's implementation of a trie.
  */
 class Trie {
+  friend class TrieBuilder;
+
  private:
   struct TrieImpl;
   struct IteratorImpl;
@@ -42,8 +47,83 @@ class Trie {
     uint32_t id;
   };
 
+  /**
+   * A view of the values of a word added with addWordValues, pointing into
+   * the trie. It stays valid until the trie changes.
+   */
+  struct Values {
+    const uint32_t *data;
+    uint32_t size;
+
+    const uint32_t *begin() const { return data; }
+    const uint32_t *end() const { return data + size; }
+    uint32_t operator[](uint32_t i) const { return data[i]; }
+    bool empty() const { return size == 0; }
+  };
+
+  /**
+   * A struct containing a word and its values.
+   */
+  struct WordValuesPair {
+    String str;
+    Values values;
+  };
+
+  /**
+   * A word found by an approximate lookup, with its edit distance.
+   */
+  struct WordIdDistance {
+    String str;
+    uint32_t id;
+    uint32_t distance;
+  };
+
+  /**
+   * A syllable of a pattern.
+   * Any of its jamo can be Character::HangulJamo::Any, which matches every
+   * jamo in that position, a missing batchim included. A jongseong of
+   * Character::HangulJamo::None matches syllables without a batchim.
+   */
+  struct SyllablePattern {
+    Character::HangulJamo choseong;
+    Character::HangulJamo jungseong;
+    Character::HangulJamo jongseong;
+  };
+
+  /**
+   * The formats of a frozen trie.
+   * Narrow is the original format with 32-bit offsets and at most 255
+   * children per node. Wide uses 64-bit offsets and varint children counts
+   * and has neither limit. Auto picks the narrow format when the trie
+   * fits it.
+   * Dawg shares identical subtrees, such as the endings common to many
+   * inflected forms, and stores the ids apart from the leaves. It is
+   * smaller, lookups pay for decoding varints. Auto never picks it.
+   * Louds is a succinct encoding of the tree with rank and select bit
+   * vectors, smaller still and slower to look up. Auto never picks it
+   * either.
+   */
+  enum class Format : uint8_t { Auto, Narrow, Wide, Dawg, Louds };
+
+ private:
+  /**
+   * Replaces the contents of the trie with a serialized node array written
+   * elsewhere and freezes the trie. The trie takes ownership of the array,
+   * which must have been allocated with std::malloc.
+   */
+  void adoptSerializedNodeArray(char *array, uint64_t size, Format format);
+
+  /**
+   * Converts the frozen trie to the Dawg or Louds format.
+   */
+  void convert(Format format);
+
+ public:
+
   /**
    * An iterator for enumerating words in the trie.
+   * It keeps the path to the current word on a stack reused from step to
+   * step. Copies share their state until one of them is incremented.
    */
   class Iterator {
     friend Trie;
@@ -61,6 +141,23 @@ class Trie {
     bool operator!=(const Iterator &other);
   };
 
+  /**
+   * A run of consecutive words of a frozen trie, iterated like the trie.
+   * The ranges of a partition can be iterated on threads of their own as
+   * long as the trie is neither changed nor destroyed meanwhile.
+   */
+  class Range {
+    friend Trie;
+
+   private:
+    Iterator _begin;
+    Iterator _end;
+
+   public:
+    Iterator begin() const;
+    Iterator end() const;
+  };
+
   /**
    * The constructor.
    */
@@ -80,8 +177,15 @@ class Trie {
   /**
    * Freezes the trie.
    * New words cannot be added to a frozen trie.
+   * \param format The format of the frozen trie.
+   * \throws std::length_error if the trie doesn't fit the requested format.
    */
-  void freeze();
+  void freeze(Format format = Format::Auto);
+
+  /**
+   * Returns the format of the frozen trie.
+   */
+  Format format();
 
   /**
    * Adds a new word to the trie.
@@ -93,9 +197,27 @@ class Trie {
    * \param replace Wheather to replace any existing ids
    * \ret The id of the new word. Same as the original id when the word
    * already exists and replace is set to false.
+   * \throws std::invalid_argument if the trie has words added with
+   * addWordValues.
    */
   uint32_t addWord(const String &str, uint32_t id, bool replace = true);
 
+  /**
+   * Adds a new word with several values, such as the analyses of a
+   * homograph, replacing any values or id it had.
+   * The values are kept in a table saved with the trie, and the word's id
+   * becomes the index of its values in the table, so the words of a trie
+   * must be added either all with addWord or all with addWordValues.
+   * New words cannot be added when in frozen mode.
+   * \param str The new word.
+   * \param values The values of the word.
+   * \ret The index of the word's values. It's only valid until freeze,
+   * which renumbers the values; look the word up again afterwards.
+   * \throws std::invalid_argument if the trie has words added with addWord.
+   */
+  uint32_t addWordValues(const String &str,
+                         const std::vector<uint32_t> &values);
+
   /**
    * Finds a word in the trie.
    * The trie cannot be searched when in editing mode.
@@ -111,6 +233,87 @@ class Trie {
    */
   std::vector<WordIdPair> findWordPrefixes(const String &str);
 
+  /**
+   * Finds a word added with addWordValues in the trie.
+   * \param str The word.
+   * \ret The word's values, empty when it's not found.
+   */
+  Values findWordValues(const String &str);
+
+  /**
+   * Finds all prefixes matching the given string, as findWordPrefixes
+   * does, along with their values.
+   * \param str the string
+   * \ret a list containing all words and their values found
+   */
+  std::vector<WordValuesPair> findWordPrefixValues(const String &str);
+
+  /**
+   * Returns the values with an index, such as the id of a word added with
+   * addWordValues found by another lookup of a frozen trie.
+   * \param id The index.
+   * \ret The values, empty if there are none with the index.
+   */
+  Values values(uint32_t id);
+
+  /**
+   * Finds all words within an edit distance of the given string.
+   * The distance counts inserted, deleted and substituted jamo, a jamo
+   * only matching one in the same position of a syllable, so that
+   * confusing ㅐ and ㅔ or dropping a batchim costs a single edit.
+   * Branches of the trie are abandoned as soon as no word below them can
+   * be within the distance.
+   * \param str The string.
+   * \param maxEdits The largest distance of the words returned.
+   * \ret The words found, closest first and in the order of the trie
+   * otherwise.
+   */
+  std::vector<WordIdDistance> findWordsWithin(const String &str,
+                                              uint32_t maxEdits);
+
+  /**
+   * Finds all words matching a pattern of syllables, in a single traversal
+   * of the trie following only the branches the pattern allows.
+   * \param pattern The syllables.
+   * \ret The words found, in the order of the trie.
+   * \throws std::invalid_argument if a jamo is not valid in its position.
+   */
+  std::vector<WordIdPair> findPattern(
+      const std::vector<SyllablePattern> &pattern);
+
+  /**
+   * Sets the scores complete ranks the words by.
+   * \param scores The score of each word, indexed by its id. Words with
+   * ids past the end score lowest.
+   */
+  void setScores(std::vector<float> scores);
+
+  /**
+   * Finds the words with the highest scores starting with a prefix.
+   * The highest score below every inner node is computed on the first call
+   * after the scores or the trie change, so that later calls only visit
+   * the branches that can hold one of the best words.
+   * \param prefix The prefix.
+   * \param k The number of words wanted.
+   * \ret Up to k words, highest score first, ties in the order of the trie.
+   */
+  std::vector<WordIdPair> complete(const String &prefix, size_t k);
+
+  /**
+   * Finds the word with an id, the reverse of findWord.
+   * The parent of every node and the leaf of every id are indexed on the
+   * first call after the trie changes, later calls only follow the parents
+   * from the leaf to the root and copy no more than the word's labels.
+   * The index takes 12 bytes per node and 8 per word. A Dawg trie is indexed
+   * as if its shared subtrees were expanded, so its index is as large as
+   * that of the same words in another format, usually several times the
+   * size of the Dawg itself.
+   * \param id The id.
+   * \ret The word, the first in the order of the trie if several have the
+   * id, or an empty string if none has.
+   */
+  String wordForId(uint32_t id);
+
   /**
    * Serializes the trie to an std::ostream.
    * \param s the stream
@@ -123,12 +326,44 @@ class Trie {
    */
   void loadFromStream(std::istream &s);
 
+  /**
+   * Uses a serialized trie in place without copying it, e.g. from a memory
+   * mapped file, and freezes the trie. The memory must stay valid for as
+   * long as the trie is frozen. The values of a trie are read in place as
+   * well, which needs the image to be aligned to 4 bytes.
+   * \param image The trie as written by writeToStream.
+   * \throws std::runtime_error if the format is unknown.
+   */
+  void mapImage(const char *image);
+
   /**
    * Returns true if the trie is in editing mode.
    * \ret whether the trie is in editing mode
    */
   bool editingMode();
 
+  /**
+   * Calls the function for every word in the order of the trie, passing
+   * the word's jamo as encoded by String::toHangulString and its id. The
+   * jamo are in a buffer reused for every word, no String is created.
+   * \param function Called as function(jamo, id).
+   */
+  void forEach(
+      const std::function<void(const std::string &, uint32_t)> &function);
+
+  /**
+   * Splits the words of the frozen trie into disjoint ranges covering all
+   * of them in the order of the trie. The trie is descended from the root
+   * until there are several subtrees for every range, and each range gets
+   * about as many consecutive subtrees as the others. The words aren't
+   * counted, so the ranges are only as even as the subtrees are.
+   * \param rangesNo The number of ranges wanted.
+   * \ret At most rangesNo ranges, fewer when the trie has too few
+   * subtrees, none when it is empty or in editing mode.
+   * \throws std::invalid_argument if rangesNo is 0.
+   */
+  std::vector<Range> partition(size_t rangesNo);
+
   Iterator begin();
   Iterator end();
 };
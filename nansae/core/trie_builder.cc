@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include "nansae/core/trie_builder.h"
+#include "nansae/core/trie_format.h"
+
+namespace NSL {
+/**
+ * The number of words a sorting thread gets at least.
+ */
+static const size_t MinWordsPerThread = 1 << 14;
+
+namespace {
+/**
+ * A buffer growing towards its front. The serialized node array is written
+ * from its end, so that the children of a node are always written before
+ * the node.
+ */
+class FrontBuffer {
+ private:
+  char *_data = nullptr;
+  uint64_t _capacity = 0;
+  uint64_t _used = 0;
+
+ public:
+  FrontBuffer() = default;
+  FrontBuffer(const FrontBuffer &) = delete;
+  FrontBuffer &operator=(const FrontBuffer &) = delete;
+  ~FrontBuffer() { std::free(_data); }
+
+  /**
+   * Reserves n bytes in front of the used ones.
+   * \ret The reserved bytes.
+   */
+  char *prepend(uint64_t n) {
+    if (_used + n > _capacity) {
+      uint64_t capacity = std::max<uint64_t>(_capacity * 2, 1 << 16);
+      while (capacity < _used + n) capacity *= 2;
+      char *data = (char *)std::malloc(capacity);
+      if (data == nullptr) throw std::bad_alloc();
+      if (_used > 0) {
+        std::memcpy(data + capacity - _used, _data + _capacity - _used,
+                    _used);
+      }
+      std::free(_data);
+      _data = data;
+      _capacity = capacity;
+    }
+    _used += n;
+    return _data + _capacity - _used;
+  }
+
+  /**
+   * The number of bytes used, which is also the distance of the first of
+   * them from the end.
+   */
+  uint64_t used() const { return _used; }
+
+  /**
+   * Moves the used bytes to the beginning of the buffer and hands the
+   * buffer over, to be freed with std::free.
+   */
+  char *release() {
+    std::memmove(_data, _data + _capacity - _used, _used);
+    char *data = (char *)std::realloc(_data, std::max<uint64_t>(_used, 1));
+    if (data == nullptr) data = _data;
+    _data = nullptr;
+    _capacity = _used = 0;
+    return data;
+  }
+};
+}
+
+void TrieBuilder::reserve(size_t wordsNo, size_t bytesNo) {
+  _entries.reserve(wordsNo);
+  _words.reserve(bytesNo);
+}
+
+void TrieBuilder::addWord(const String &str, uint32_t id) {
+  std::string hstr = str.toHangulString().theString;
+  // Trie::addWord ignores empty words as well
+  if (hstr.empty()) return;
+  _entries.push_back({_words.size(), (uint32_t)hstr.size(), id});
+  _words.append(hstr);
+}
+
+size_t TrieBuilder::size() const { return _entries.size(); }
+
+/**
+ * Sorts the entries by their jamo, keeping the last of equal words only.
+ * Chunks are sorted by their own threads and then merged pairwise, each
+ * round of merges in parallel as well.
+ */
+void TrieBuilder::sortEntries(unsigned threadsNo) {
+  const char *words = _words.data();
+  auto less = [words](const Entry &a, const Entry &b) {
+    int c = std::memcmp(words + a.offset, words + b.offset,
+                        std::min(a.length, b.length));
+    return c != 0 ? c < 0 : a.length < b.length;
+  };
+
+  if (!std::is_sorted(_entries.begin(), _entries.end(), less)) {
+    if (threadsNo == 0) threadsNo = std::thread::hardware_concurrency();
+    threadsNo = std::max<size_t>(
+        1, std::min<size_t>(threadsNo, _entries.size() / MinWordsPerThread));
+
+    std::vector<size_t> bounds;
+    for (unsigned t = 0; t <= threadsNo; t++) {
+      bounds.push_back(_entries.size() * t / threadsNo);
+    }
+
+    // stable sorts and merges keep equal words in the order they were added
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t + 1 < bounds.size(); t++) {
+      threads.emplace_back([&, t]() {
+        std::stable_sort(_entries.begin() + bounds[t],
+                         _entries.begin() + bounds[t + 1], less);
+      });
+    }
+    for (std::thread &thread : threads) thread.join();
+
+    while (bounds.size() > 2) {
+      std::vector<size_t> merged;
+      threads.clear();
+      for (size_t b = 0; b + 1 < bounds.size(); b += 2) {
+        merged.push_back(bounds[b]);
+        if (b + 2 >= bounds.size()) continue;
+        threads.emplace_back([&, b]() {
+          std::inplace_merge(_entries.begin() + bounds[b],
+                             _entries.begin() + bounds[b + 1],
+                             _entries.begin() + bounds[b + 2], less);
+        });
+      }
+      merged.push_back(bounds.back());
+      for (std::thread &thread : threads) thread.join();
+      bounds.swap(merged);
+    }
+  }
+
+  size_t unique = 0;
+  for (size_t i = 0; i < _entries.size(); i++) {
+    if (unique > 0 && !less(_entries[unique - 1], _entries[i])) {
+      _entries[unique - 1] = _entries[i];
+    } else {
+      _entries[unique++] = _entries[i];
+    }
+  }
+  _entries.resize(unique);
+}
+
+namespace {
+/**
+ * A node of the trie being written, its label is a slice of the jamo of
+ * one of the words passing through it.
+ */
+struct PendingNode {
+  uint64_t labelOffset;
+  uint64_t labelLength;
+  uint64_t childrenNo;
+
+  /**
+   * The distance of the node's children from the end of the array.
+   */
+  uint64_t childrenFromEnd;
+  uint32_t id;
+};
+
+/**
+ * A node whose children are still being collected, at the given depth in
+ * jamo bytes. The children are collected last to first.
+ */
+struct OpenNode {
+  uint64_t depth;
+  std::vector<PendingNode> children;
+};
+
+/**
+ * Writes the serialized node array of sorted, unique words.
+ * The words are visited last to first. The nodes on the path of the
+ * previous word stay open, and the ones deeper than the common prefix of
+ * the two words are closed: their children are written in front of
+ * everything written so far, which puts them before the children of their
+ * following siblings, and the node itself is handed to its parent.
+ * A node is written only once its children have been, so the array grows
+ * towards the front.
+ */
+template <typename F>
+class NodeArrayWriter {
+ private:
+  const std::string &_words;
+  FrontBuffer _buffer;
+  std::vector<OpenNode> _open;
+  size_t _openNo = 0;
+
+  /**
+   * The last node closed, or the leaf of the last word, which hasn't been
+   * handed to its parent yet, and the depth it ends at.
+   */
+  PendingNode _carry;
+  uint64_t _carryEnd;
+
+  void push(uint64_t depth) {
+    if (_openNo == _open.size()) _open.emplace_back();
+    _open[_openNo].depth = depth;
+    _open[_openNo].children.clear();
+    _openNo++;
+  }
+
+  /**
+   * Hands the carried node to the open node at the given depth, whose
+   * label starts there. The label offset of the carried node is the offset
+   * of the word passing through it up to then.
+   */
+  void handCarry(OpenNode &parent) {
+    _carry.labelOffset += parent.depth;
+    _carry.labelLength = _carryEnd - parent.depth;
+    parent.children.push_back(_carry);
+  }
+
+  /**
+   * Writes the children of the open node on top of the stack and makes
+   * the node the carried one.
+   */
+  void close(uint64_t wordOffset) {
+    OpenNode &node = _open[--_openNo];
+    std::vector<PendingNode> &children = node.children;
+    if (children.size() > F::MaxChildrenNo) {
+      throw std::length_error(
+          "The trie has nodes with more children than the format supports.");
+    }
+    std::reverse(children.begin(), children.end());
+
+    uint64_t size = 0;
+    for (const PendingNode &child : children) {
+      size += F::nodeSize(child.childrenNo, child.labelLength);
+    }
+    char *group = _buffer.prepend(size);
+    uint64_t groupFromEnd = _buffer.used();
+    if (groupFromEnd > F::MaxSize) {
+      throw std::length_error("The trie is too large for the format.");
+    }
+
+    // positions are counted from the start of the group
+    uint64_t pos = 0;
+    for (const PendingNode &child : children) {
+      F::writeNode(group, pos, child.childrenNo,
+                   groupFromEnd - child.childrenFromEnd, child.id,
+                   _words.data() + child.labelOffset, child.labelLength);
+      pos += F::nodeSize(child.childrenNo, child.labelLength);
+    }
+
+    _carry = {wordOffset, 0, children.size(), groupFromEnd, 0};
+    _carryEnd = node.depth;
+  }
+
+  /**
+   * Closes the open nodes deeper than depth and hands the carried node to
+   * the one at depth, opening it if needed.
+   */
+  void unwind(uint64_t depth, uint64_t wordOffset) {
+    while (_open[_openNo - 1].depth > depth) {
+      handCarry(_open[_openNo - 1]);
+      close(wordOffset);
+    }
+    if (_open[_openNo - 1].depth < depth) push(depth);
+    handCarry(_open[_openNo - 1]);
+  }
+
+ public:
+  explicit NodeArrayWriter(const std::string &words) : _words(words) {}
+
+  template <typename Entry>
+  char *write(const std::vector<Entry> &entries, uint64_t *size) {
+    push(0);
+    for (size_t i = entries.size(); i-- > 0;) {
+      const Entry &word = entries[i];
+      if (i + 1 < entries.size()) {
+        const Entry &previous = entries[i + 1];
+        const char *a = _words.data() + word.offset;
+        const char *b = _words.data() + previous.offset;
+        uint64_t common = 0;
+        uint64_t length = std::min(word.length, previous.length);
+        while (common < length && a[common] == b[common]) common++;
+        unwind(common, previous.offset);
+      }
+      _carry = {word.offset, 0, 0, 0, word.id};
+      _carryEnd = word.length;
+    }
+    if (!entries.empty()) unwind(0, entries.front().offset);
+
+    // the root, followed directly by its children
+    uint64_t rootChildrenNo = _open[0].children.size();
+    close(0);
+    F::writeRoot(_buffer.prepend(F::rootSize(rootChildrenNo)),
+                 rootChildrenNo);
+    if (_buffer.used() > F::MaxSize) {
+      throw std::length_error("The trie is too large for the format.");
+    }
+
+    *size = _buffer.used();
+    return _buffer.release();
+  }
+};
+}
+
+template <typename F>
+void TrieBuilder::build(Trie &trie, Trie::Format format) {
+  uint64_t size;
+  char *array = NodeArrayWriter<F>(_words).write(_entries, &size);
+  trie.adoptSerializedNodeArray(array, size, format);
+}
+
+void TrieBuilder::build(Trie &trie, Trie::Format format,
+                        unsigned threadsNo) {
+  sortEntries(threadsNo);
+
+  if (format == Trie::Format::Auto || format == Trie::Format::Narrow) {
+    try {
+      build<NarrowTrieFormat>(trie, Trie::Format::Narrow);
+      return;
+    } catch (const std::length_error &) {
+      if (format == Trie::Format::Narrow) throw;
+    }
+  }
+  build<WideTrieFormat>(trie, Trie::Format::Wide);
+  trie.convert(format);
+}
+}
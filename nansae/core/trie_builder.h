@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NSL_TRIE_BUILDER_H
+#define NSL_TRIE_BUILDER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nansae/core/string.h"
+#include "nansae/core/trie.h"
+
+namespace NSL {
+/**
+ * Builds a frozen trie from a whole list of words at once.
+ * The words are sorted by their jamo and the serialized node array is
+ * written directly in a single pass over them, without building the nodes
+ * of an editable trie first. Adding the words in sorted order saves the
+ * sort.
+ */
+class TrieBuilder {
+ private:
+  struct Entry {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t id;
+  };
+
+  /**
+   * The jamo of all added words, one after another.
+   */
+  std::string _words;
+  std::vector<Entry> _entries;
+
+  void sortEntries(unsigned threadsNo);
+  template <typename F>
+  void build(Trie &trie, Trie::Format format);
+
+ public:
+  /**
+   * Reserves memory for the given number of words and of their jamo bytes.
+   */
+  void reserve(size_t wordsNo, size_t bytesNo);
+
+  /**
+   * Adds a word. When a word is added more than once the last id wins, as
+   * with Trie::addWord.
+   * \param str The word.
+   * \param id The id of the word.
+   */
+  void addWord(const String &str, uint32_t id);
+
+  /**
+   * Returns the number of words added so far, duplicates included.
+   */
+  size_t size() const;
+
+  /**
+   * Builds the trie, replacing its contents. The trie is frozen afterwards.
+   * The words are kept, so the builder can build again.
+   * \param trie The trie to build.
+   * \param format The format of the frozen trie.
+   * \param threadsNo The number of threads sorting the words, 0 uses one
+   * per core.
+   * \throws std::length_error if the trie doesn't fit the requested format.
+   */
+  void build(Trie &trie, Trie::Format format = Trie::Format::Auto,
+             unsigned threadsNo = 0);
+};
+}
+
+#endif  // NSL_TRIE_BUILDER_H
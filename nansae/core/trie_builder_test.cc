@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nansae/core/trie_builder.h"
+#include "nansae/core/trie_test_util.h"
+#include "gtest/gtest.h"
+
+#include <map>
+#include <sstream>
+
+/**
+ * Checks that two tries contain the same words with the same ids.
+ */
+static void expectSameWords(NSL::Trie& expected, NSL::Trie& t) {
+  std::map<std::string, uint32_t> words;
+  for (NSL::Trie::WordIdPair wip : expected) {
+    words[wip.str.toStdString()] = wip.id;
+  }
+  size_t iterated = 0;
+  for (NSL::Trie::WordIdPair wip : t) {
+    ASSERT_EQ(words[wip.str.toStdString()], wip.id);
+    iterated++;
+  }
+  ASSERT_EQ(iterated, words.size());
+  for (const auto& entry : words) {
+    ASSERT_EQ(t.findWord(NSL::String(entry.first)), entry.second);
+  }
+}
+
+TEST(TrieBuilder, build) {
+  std::vector<NSL::String> words = {
+      NSL::String(u8"빨"),     NSL::String(u8"빨갛"), NSL::String(u8"빨간"),
+      NSL::String(u8"빨간색"), NSL::String(u8"파랗"), NSL::String(u8"파란"),
+      NSL::String(u8"빨래"),   NSL::String(u8"빨리"), NSL::String(u8"파")};
+
+  NSL::Trie expected;
+  NSL::TrieBuilder builder;
+  for (uint32_t i = 0; i < words.size(); i++) {
+    expected.addWord(words[i], i);
+    builder.addWord(words[i], i);
+  }
+  // the last id of a word wins
+  expected.addWord(NSL::String(u8"빨간"), 20);
+  builder.addWord(NSL::String(u8"빨간"), 20);
+  expected.freeze();
+
+  NSL::Trie t;
+  builder.build(t);
+  ASSERT_FALSE(t.editingMode());
+  ASSERT_EQ(t.format(), NSL::Trie::Format::Narrow);
+  expectSameWords(expected, t);
+  ASSERT_EQ(t.findWord(NSL::String(u8"빨가")), NIME_TRIE_WORD_NOT_FOUND);
+
+  std::vector<NSL::Trie::WordIdPair> prefixes =
+      t.findWordPrefixes(NSL::String(u8"빨간색깔"));
+  ASSERT_EQ(prefixes.size(), 3);
+  ASSERT_EQ(prefixes[0].id, 0);
+  ASSERT_EQ(prefixes[1].id, 20);
+  ASSERT_EQ(prefixes[2].id, 3);
+
+  // the built trie is an ordinary frozen trie
+  std::stringstream s;
+  t.writeToStream(s);
+  NSL::Trie loaded;
+  loaded.freeze();
+  loaded.loadFromStream(s);
+  expectSameWords(expected, loaded);
+
+  t.makeEditable();
+  t.addWord(NSL::String(u8"노랗"), 100);
+  t.freeze();
+  ASSERT_EQ(t.findWord(NSL::String(u8"노랗")), 100);
+  ASSERT_EQ(t.findWord(NSL::String(u8"빨간색")), 3);
+
+  NSL::Trie wide;
+  builder.build(wide, NSL::Trie::Format::Wide);
+  ASSERT_EQ(wide.format(), NSL::Trie::Format::Wide);
+  expectSameWords(expected, wide);
+
+  NSL::Trie dawg;
+  builder.build(dawg, NSL::Trie::Format::Dawg);
+  ASSERT_EQ(dawg.format(), NSL::Trie::Format::Dawg);
+  expectSameWords(expected, dawg);
+
+  NSL::Trie empty;
+  NSL::TrieBuilder().build(empty);
+  ASSERT_EQ(empty.findWord(NSL::String(u8"빨")), NIME_TRIE_WORD_NOT_FOUND);
+  ASSERT_FALSE(empty.begin() != empty.end());
+}
+
+TEST(TrieBuilder, manyWords) {
+  NSL::Trie expected;
+  NSL::TrieBuilder builder;
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < 100000; i++) {
+    NSL::String word = randomWord(seed);
+    expected.addWord(word, i);
+    builder.addWord(word, i);
+  }
+  expected.freeze();
+
+  for (unsigned threadsNo : {1, 4}) {
+    NSL::Trie t;
+    builder.build(t, NSL::Trie::Format::Auto, threadsNo);
+    expectSameWords(expected, t);
+  }
+
+  NSL::Trie dawg;
+  builder.build(dawg, NSL::Trie::Format::Dawg);
+  expectSameWords(expected, dawg);
+
+  NSL::Trie louds;
+  builder.build(louds, NSL::Trie::Format::Louds);
+  ASSERT_EQ(louds.format(), NSL::Trie::Format::Louds);
+  expectSameWords(expected, louds);
+}
@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NSL_TRIE_FORMAT_H
+#define NSL_TRIE_FORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace NSL {
+/**
+ * A node of a frozen trie.
+ * The position is the offset of the node in the serialized node array,
+ * the rank is the number of words preceding the node's subtree, which the
+ * formats that don't store ids in their leaves need.
+ */
+struct TrieNodeRef {
+  uint64_t pos;
+  uint64_t rank;
+};
+
+/**
+ * The frozen trie formats share the same interface used by all the lookups:
+ * root(), childrenNo(node), firstChild(node), nextSibling(node), label(node)
+ * returning the node's NUL terminated jamo bytes, and id(node) for leaves.
+ * A word ending at an inner node is stored as a child with an empty label.
+ * Siblings are adjacent, so nextSibling must only be called while there
+ * are siblings left.
+ */
+
+template <typename T>
+inline T TrieReadUnaligned(const char* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+template <typename T>
+inline void TrieWriteUnaligned(char* data, T value) {
+  std::memcpy(data, &value, sizeof(T));
+}
+
+inline unsigned TrieVarintSize(uint64_t value) {
+  unsigned size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+inline unsigned TrieWriteVarint(char* data, uint64_t value) {
+  unsigned size = 0;
+  while (value >= 0x80) {
+    data[size++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  data[size++] = (char)value;
+  return size;
+}
+
+inline uint64_t TrieReadVarint(const char* data, unsigned* size) {
+  uint64_t value = 0;
+  unsigned i = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    uint8_t byte = data[i++];
+    value |= uint64_t(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) break;
+  }
+  *size = i;
+  return value;
+}
+
+/**
+ * The original serialized node array.
+ * [(uint8_t)root children no], then for each node [(uint8_t)children no,
+ * (uint32_t)children offset or id, (uint8_t[])value, \0]. The children
+ * offset is counted from the beginning of the node, the children of the root
+ * follow it directly.
+ */
+class NarrowTrieFormat {
+ private:
+  const char* _data;
+
+ public:
+  static const uint64_t MaxChildrenNo = UINT8_MAX;
+  static const uint64_t MaxSize = UINT32_MAX;
+
+  explicit NarrowTrieFormat(const char* data) : _data(data) {}
+
+  TrieNodeRef root() const { return {0, 0}; }
+
+  uint64_t childrenNo(TrieNodeRef node) const {
+    return (uint8_t)_data[node.pos];
+  }
+
+  TrieNodeRef firstChild(TrieNodeRef node) const {
+    if (node.pos == 0) return {sizeof(uint8_t), node.rank};
+    return {node.pos + TrieReadUnaligned<uint32_t>(_data + node.pos + 1),
+            node.rank};
+  }
+
+  TrieNodeRef nextSibling(TrieNodeRef node) const {
+    return {node.pos + nodeSize(0, std::strlen(label(node))), node.rank};
+  }
+
+  const char* label(TrieNodeRef node) const {
+    if (node.pos == 0) return "";
+    return _data + node.pos + sizeof(uint8_t) + sizeof(uint32_t);
+  }
+
+  uint32_t id(TrieNodeRef node) const {
+    return TrieReadUnaligned<uint32_t>(_data + node.pos + 1);
+  }
+
+  static uint64_t rootSize(uint64_t /*childrenNo*/) { return sizeof(uint8_t); }
+
+  static uint64_t nodeSize(uint64_t /*childrenNo*/, uint64_t labelLength) {
+    return sizeof(uint8_t) + sizeof(uint32_t) + labelLength + 1;
+  }
+
+  static void writeRoot(char* data, uint64_t childrenNo) {
+    *data = (uint8_t)childrenNo;
+  }
+
+  /**
+   * Writes a node at the given position. Inner nodes point to their
+   * children, leaves store the id.
+   */
+  static void writeNode(char* data, uint64_t pos, uint64_t childrenNo,
+                        uint64_t childrenPos, uint32_t id, const char* label,
+                        uint64_t labelLength) {
+    char* node = data + pos;
+    *node = (uint8_t)childrenNo;
+    TrieWriteUnaligned<uint32_t>(
+        node + 1, childrenNo > 0 ? (uint32_t)(childrenPos - pos) : id);
+    std::memcpy(node + 5, label, labelLength);
+    node[5 + labelLength] = '\0';
+  }
+};
+
+/**
+ * The wide serialized node array, for tries with nodes of more than 255
+ * children or of more than 4 GB.
+ * [(varint)root children no], then for each node [(varint)children no,
+ * (uint64_t)children offset or (uint32_t)id, (uint8_t[])value, \0], the
+ * children offset is counted from the beginning of the node.
+ */
+class WideTrieFormat {
+ private:
+  const char* _data;
+
+  uint64_t header(TrieNodeRef node, uint64_t* childrenNo) const {
+    unsigned size;
+    *childrenNo = TrieReadVarint(_data + node.pos, &size);
+    return size;
+  }
+
+ public:
+  static const uint64_t MaxChildrenNo = UINT64_MAX;
+  static const uint64_t MaxSize = UINT64_MAX;
+
+  explicit WideTrieFormat(const char* data) : _data(data) {}
+
+  TrieNodeRef root() const { return {0, 0}; }
+
+  uint64_t childrenNo(TrieNodeRef node) const {
+    uint64_t childrenNo;
+    header(node, &childrenNo);
+    return childrenNo;
+  }
+
+  TrieNodeRef firstChild(TrieNodeRef node) const {
+    uint64_t childrenNo;
+    uint64_t size = header(node, &childrenNo);
+    if (node.pos == 0) return {size, node.rank};
+    return {node.pos + TrieReadUnaligned<uint64_t>(_data + node.pos + size),
+            node.rank};
+  }
+
+  TrieNodeRef nextSibling(TrieNodeRef node) const {
+    uint64_t childrenNo;
+    header(node, &childrenNo);
+    return {node.pos + nodeSize(childrenNo, std::strlen(label(node))),
+            node.rank};
+  }
+
+  const char* label(TrieNodeRef node) const {
+    if (node.pos == 0) return "";
+    uint64_t childrenNo;
+    uint64_t size = header(node, &childrenNo);
+    return _data + node.pos + size +
+           (childrenNo > 0 ? sizeof(uint64_t) : sizeof(uint32_t));
+  }
+
+  uint32_t id(TrieNodeRef node) const {
+    uint64_t childrenNo;
+    uint64_t size = header(node, &childrenNo);
+    return TrieReadUnaligned<uint32_t>(_data + node.pos + size);
+  }
+
+  static uint64_t rootSize(uint64_t childrenNo) {
+    return TrieVarintSize(childrenNo);
+  }
+
+  static uint64_t nodeSize(uint64_t childrenNo, uint64_t labelLength) {
+    return TrieVarintSize(childrenNo) +
+           (childrenNo > 0 ? sizeof(uint64_t) : sizeof(uint32_t)) +
+           labelLength + 1;
+  }
+
+  static void writeRoot(char* data, uint64_t childrenNo) {
+    TrieWriteVarint(data, childrenNo);
+  }
+
+  static void writeNode(char* data, uint64_t pos, uint64_t childrenNo,
+                        uint64_t childrenPos, uint32_t id, const char* label,
+                        uint64_t labelLength) {
+    char* node = data + pos;
+    node += TrieWriteVarint(node, childrenNo);
+    if (childrenNo > 0) {
+      TrieWriteUnaligned<uint64_t>(node, childrenPos - pos);
+      node += sizeof(uint64_t);
+    } else {
+      TrieWriteUnaligned<uint32_t>(node, id);
+      node += sizeof(uint32_t);
+    }
+    std::memcpy(node, label, labelLength);
+    node[labelLength] = '\0';
+  }
+};
+
+/**
+ * The minimized serialized node array, a DAWG sharing identical subtrees.
+ * [(uint64_t)ids offset, (uint64_t)root children no, (uint64_t)root
+ * children position], then the children groups, each group stored once,
+ * with nodes of [(varint)children no, (varint)words no and (varint)children
+ * position for inner nodes only, (uint8_t[])value, \0], and finally the ids
+ * as (uint32_t[]).
+ * Since leaves are shared they can't store ids. The words are numbered in
+ * the order of the trie instead, a node's rank being the number of words
+ * before its subtree, and the ids are looked up by the rank of the leaf.
+ */
+class DawgTrieFormat {
+ private:
+  const char* _data;
+
+  /**
+   * Parses the node's header.
+   * \ret The node's label.
+   */
+  const char* parse(TrieNodeRef node, uint64_t* childrenNo,
+                    uint64_t* wordsNo, uint64_t* childrenPos) const {
+    const char* data = _data + node.pos;
+    unsigned size;
+    *childrenNo = TrieReadVarint(data, &size);
+    data += size;
+    if (*childrenNo == 0) {
+      *wordsNo = 1;
+      *childrenPos = 0;
+      return data;
+    }
+    *wordsNo = TrieReadVarint(data, &size);
+    data += size;
+    *childrenPos = TrieReadVarint(data, &size);
+    return data + size;
+  }
+
+ public:
+  static const uint64_t MaxChildrenNo = UINT64_MAX;
+  static const uint64_t MaxSize = UINT64_MAX;
+  static const uint64_t HeaderSize = 3 * sizeof(uint64_t);
+
+  explicit DawgTrieFormat(const char* data) : _data(data) {}
+
+  TrieNodeRef root() const { return {0, 0}; }
+
+  uint64_t childrenNo(TrieNodeRef node) const {
+    if (node.pos == 0) return TrieReadUnaligned<uint64_t>(_data + 8);
+    unsigned size;
+    return TrieReadVarint(_data + node.pos, &size);
+  }
+
+  TrieNodeRef firstChild(TrieNodeRef node) const {
+    if (node.pos == 0) {
+      return {TrieReadUnaligned<uint64_t>(_data + 16), node.rank};
+    }
+    uint64_t childrenNo, wordsNo, childrenPos;
+    parse(node, &childrenNo, &wordsNo, &childrenPos);
+    return {childrenPos, node.rank};
+  }
+
+  TrieNodeRef nextSibling(TrieNodeRef node) const {
+    uint64_t childrenNo, wordsNo, childrenPos;
+    const char* label = parse(node, &childrenNo, &wordsNo, &childrenPos);
+    return {(uint64_t)(label - _data) + std::strlen(label) + 1,
+            node.rank + wordsNo};
+  }
+
+  const char* label(TrieNodeRef node) const {
+    if (node.pos == 0) return "";
+    uint64_t childrenNo, wordsNo, childrenPos;
+    return parse(node, &childrenNo, &wordsNo, &childrenPos);
+  }
+
+  uint32_t id(TrieNodeRef node) const {
+    uint64_t idsOffset = TrieReadUnaligned<uint64_t>(_data);
+    return TrieReadUnaligned<uint32_t>(_data + idsOffset +
+                                       node.rank * sizeof(uint32_t));
+  }
+
+  static void writeHeader(char* data, uint64_t idsOffset,
+                          uint64_t rootChildrenNo, uint64_t rootChildrenPos) {
+    TrieWriteUnaligned<uint64_t>(data, idsOffset);
+    TrieWriteUnaligned<uint64_t>(data + 8, rootChildrenNo);
+    TrieWriteUnaligned<uint64_t>(data + 16, rootChildrenPos);
+  }
+
+  /**
+   * Appends a node to a children group. Leaves count as one word and have
+   * no children position.
+   */
+  static void appendNode(std::string& group, uint64_t childrenNo,
+                         uint64_t wordsNo, uint64_t childrenPos,
+                         const char* label, uint64_t labelLength) {
+    char varint[10];
+    group.append(varint, TrieWriteVarint(varint, childrenNo));
+    if (childrenNo > 0) {
+      group.append(varint, TrieWriteVarint(varint, wordsNo));
+      group.append(varint, TrieWriteVarint(varint, childrenPos));
+    }
+    group.append(label, labelLength);
+    group.push_back('\0');
+  }
+};
+
+/**
+ * A read-only bit vector with rank and select, used in place.
+ * [(uint64_t)bits no, (uint64_t)ones no, (uint64_t)words no, (uint64_t)one
+ * samples no, (uint64_t)zero samples no], the bits as (uint64_t[]) words,
+ * the number of ones before each block of 8 words and after the last one,
+ * and the block of every 512th one and every 512th zero, which select
+ * starts scanning from.
+ */
+class SuccinctBitVector {
+ private:
+  static const uint64_t WordsPerBlock = 8;
+  static const uint64_t BitsPerBlock = WordsPerBlock * 64;
+  static const uint64_t SampleRate = 512;
+
+  const char* _data;
+  uint64_t _wordsNo;
+  uint64_t _blocksNo;
+  uint64_t _oneSamplesNo;
+
+  uint64_t word(uint64_t i) const {
+    return TrieReadUnaligned<uint64_t>(_data + (5 + i) * sizeof(uint64_t));
+  }
+
+  uint64_t onesBefore(uint64_t block) const {
+    return TrieReadUnaligned<uint64_t>(
+        _data + (5 + _wordsNo + block) * sizeof(uint64_t));
+  }
+
+  uint64_t sample(uint64_t i) const {
+    return TrieReadUnaligned<uint64_t>(
+        _data + (5 + _wordsNo + _blocksNo + 1 + i) * sizeof(uint64_t));
+  }
+
+  static uint64_t selectInWord(uint64_t bits, uint64_t k) {
+    for (uint64_t i = 0; i < k; i++) bits &= bits - 1;
+    return __builtin_ctzll(bits);
+  }
+
+ public:
+  explicit SuccinctBitVector(const char* data)
+      : _data(data),
+        _wordsNo(TrieReadUnaligned<uint64_t>(data + 16)),
+        _blocksNo((_wordsNo + WordsPerBlock - 1) / WordsPerBlock),
+        _oneSamplesNo(TrieReadUnaligned<uint64_t>(data + 24)) {}
+
+  bool get(uint64_t pos) const { return (word(pos / 64) >> (pos % 64)) & 1; }
+
+  /**
+   * Returns the number of ones before the position.
+   */
+  uint64_t rank1(uint64_t pos) const {
+    uint64_t block = pos / BitsPerBlock;
+    uint64_t rank = onesBefore(block);
+    for (uint64_t w = block * WordsPerBlock; w < pos / 64; w++) {
+      rank += __builtin_popcountll(word(w));
+    }
+    if (pos % 64 != 0) {
+      rank += __builtin_popcountll(word(pos / 64) &
+                                   ((uint64_t(1) << (pos % 64)) - 1));
+    }
+    return rank;
+  }
+
+  /**
+   * Returns the position of the k-th one, counted from zero.
+   */
+  uint64_t select1(uint64_t k) const {
+    uint64_t block = sample(k / SampleRate);
+    while (onesBefore(block + 1) <= k) block++;
+    k -= onesBefore(block);
+    uint64_t w = block * WordsPerBlock;
+    for (uint64_t ones; k >= (ones = __builtin_popcountll(word(w))); w++) {
+      k -= ones;
+    }
+    return w * 64 + selectInWord(word(w), k);
+  }
+
+  /**
+   * Returns the position of the k-th zero, counted from zero.
+   */
+  uint64_t select0(uint64_t k) const {
+    uint64_t block = sample(_oneSamplesNo + k / SampleRate);
+    while ((block + 1) * BitsPerBlock - onesBefore(block + 1) <= k) block++;
+    k -= block * BitsPerBlock - onesBefore(block);
+    uint64_t w = block * WordsPerBlock;
+    for (uint64_t zeros; k >= (zeros = __builtin_popcountll(~word(w))); w++) {
+      k -= zeros;
+    }
+    return w * 64 + selectInWord(~word(w), k);
+  }
+
+  /**
+   * Appends the bit vector to the buffer.
+   */
+  static void append(std::string& buffer, const std::vector<bool>& bits) {
+    std::vector<uint64_t> words((bits.size() + 63) / 64);
+    for (uint64_t i = 0; i < bits.size(); i++) {
+      if (bits[i]) words[i / 64] |= uint64_t(1) << (i % 64);
+    }
+    uint64_t blocksNo = (words.size() + WordsPerBlock - 1) / WordsPerBlock;
+
+    std::vector<uint64_t> onesBefore(blocksNo + 1);
+    std::vector<uint64_t> oneSamples, zeroSamples;
+    uint64_t ones = 0, zeros = 0;
+    for (uint64_t w = 0; w < words.size(); w++) {
+      if (w % WordsPerBlock == 0) onesBefore[w / WordsPerBlock] = ones;
+      for (unsigned bit = 0; bit < 64 && w * 64 + bit < bits.size(); bit++) {
+        if ((words[w] >> bit) & 1) {
+          if (ones++ % SampleRate == 0) oneSamples.push_back(w / 8);
+        } else {
+          if (zeros++ % SampleRate == 0) zeroSamples.push_back(w / 8);
+        }
+      }
+    }
+    onesBefore[blocksNo] = ones;
+
+    std::vector<uint64_t> header = {bits.size(), ones, words.size(),
+                                    oneSamples.size(), zeroSamples.size()};
+    for (const std::vector<uint64_t>* v :
+         {&header, &words, &onesBefore, &oneSamples, &zeroSamples}) {
+      buffer.append((const char*)v->data(), v->size() * sizeof(uint64_t));
+    }
+  }
+};
+
+/**
+ * The succinct serialized node array, a LOUDS encoding of the trie.
+ * [(uint64_t)nodes no, and the offsets of the sections: (uint64_t)louds,
+ * (uint64_t)leaves, (uint64_t)label starts, (uint64_t)labels,
+ * (uint64_t)ids]. The nodes are numbered breadth first starting with the
+ * root, so the children of a node are numbered consecutively. The louds bit
+ * vector holds a one per child followed by a zero for each node in turn,
+ * the leaves bit vector a one for each leaf, whose rank indexes the
+ * (uint32_t[]) ids. The labels are stored one after another, each followed
+ * by \0, with a bit vector marking where each starts.
+ * Each node costs about three bits and the bytes of its label instead of
+ * the per node headers of the other formats.
+ */
+class LoudsTrieFormat {
+ private:
+  const char* _data;
+
+  /**
+   * The bit vectors of the sections, read once when the format is created
+   * for an operation rather than on every access.
+   */
+  SuccinctBitVector _louds;
+  SuccinctBitVector _leaves;
+  SuccinctBitVector _starts;
+  const char* _labels;
+  const char* _ids;
+
+  uint64_t offset(unsigned section) const {
+    return TrieReadUnaligned<uint64_t>(_data + (1 + section) * 8);
+  }
+
+  /**
+   * Returns the position of the first bit of the node in the louds.
+   */
+  uint64_t start(uint64_t node) const {
+    return node == 0 ? 0 : _louds.select0(node - 1) + 1;
+  }
+
+ public:
+  static const uint64_t MaxChildrenNo = UINT64_MAX;
+  static const uint64_t MaxSize = UINT64_MAX;
+  static const uint64_t HeaderSize = 6 * sizeof(uint64_t);
+
+  explicit LoudsTrieFormat(const char* data)
+      : _data(data),
+        _louds(data + offset(0)),
+        _leaves(data + offset(1)),
+        _starts(data + offset(2)),
+        _labels(data + offset(3)),
+        _ids(data + offset(4)) {}
+
+  TrieNodeRef root() const { return {0, 0}; }
+
+  uint64_t childrenNo(TrieNodeRef node) const {
+    return _louds.select0(node.pos) - start(node.pos);
+  }
+
+  TrieNodeRef firstChild(TrieNodeRef node) const {
+    // all the bits before the node's are a zero per node or a one per child
+    return {start(node.pos) - node.pos + 1, 0};
+  }
+
+  TrieNodeRef nextSibling(TrieNodeRef node) const {
+    return {node.pos + 1, 0};
+  }
+
+  const char* label(TrieNodeRef node) const {
+    if (node.pos == 0) return "";
+    return _labels + _starts.select1(node.pos - 1);
+  }
+
+  uint32_t id(TrieNodeRef node) const {
+    return TrieReadUnaligned<uint32_t>(
+        _ids + _leaves.rank1(node.pos) * sizeof(uint32_t));
+  }
+
+  /**
+   * Writes the succinct array of a trie read through another format.
+   */
+  template <typename F>
+  static std::string convert(const F& f) {
+    std::vector<bool> louds, leaves, starts;
+    std::string labels;
+    std::vector<uint32_t> ids;
+
+    std::vector<TrieNodeRef> queue = {f.root()};
+    for (uint64_t i = 0; i < queue.size(); i++) {
+      TrieNodeRef node = queue[i];
+      uint64_t childrenNo = f.childrenNo(node);
+      louds.insert(louds.end(), childrenNo, true);
+      louds.push_back(false);
+
+      bool leaf = i > 0 && childrenNo == 0;
+      leaves.push_back(leaf);
+      if (leaf) ids.push_back(f.id(node));
+      if (i > 0) {
+        const char* label = f.label(node);
+        starts.push_back(true);
+        starts.insert(starts.end(), std::strlen(label), false);
+        labels.append(label, std::strlen(label) + 1);
+      }
+
+      if (childrenNo == 0) continue;
+      TrieNodeRef child = f.firstChild(node);
+      for (uint64_t c = 0; c < childrenNo; c++) {
+        if (c > 0) child = f.nextSibling(child);
+        queue.push_back(child);
+      }
+    }
+
+    std::string na(HeaderSize, '\0');
+    TrieWriteUnaligned<uint64_t>(&na[0], queue.size());
+    std::vector<uint64_t> offsets;
+    auto align = [&na]() { na.resize((na.size() + 7) & ~uint64_t(7)); };
+    offsets.push_back(na.size());
+    SuccinctBitVector::append(na, louds);
+    offsets.push_back(na.size());
+    SuccinctBitVector::append(na, leaves);
+    offsets.push_back(na.size());
+    SuccinctBitVector::append(na, starts);
+    offsets.push_back(na.size());
+    na.append(labels);
+    align();
+    offsets.push_back(na.size());
+    na.append((const char*)ids.data(), ids.size() * sizeof(uint32_t));
+    for (unsigned i = 0; i < offsets.size(); i++) {
+      TrieWriteUnaligned<uint64_t>(&na[(1 + i) * 8], offsets[i]);
+    }
+    return na;
+  }
+};
+}
+
+#endif  // NSL_TRIE_FORMAT_H
@@ -15,10 +15,14 @@
  */
 
 #include "nansae/core/trie.h"
+#include "nansae/core/trie_test_util.h"
 #include "gtest/gtest.h"
 
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <stdexcept>
+#include <thread>
 
 TEST(Trie, findWord) {
   NSL::Trie t;
@@ -160,3 +164,646 @@ TEST(Trie, iteration) {
     ASSERT_EQ(idFound[i], true);
   }
 }
+
+TEST(Trie, wideFormat) {
+  std::vector<NSL::String> words = {
+      NSL::String(u8"빨"),     NSL::String(u8"빨갛"), NSL::String(u8"빨간"),
+      NSL::String(u8"빨간색"), NSL::String(u8"파랗"), NSL::String(u8"파란"),
+      NSL::String(u8"빨래"),   NSL::String(u8"빨리"), NSL::String(u8"파")};
+
+  NSL::Trie narrow, wide;
+  for (uint32_t i = 0; i < words.size(); i++) {
+    narrow.addWord(words[i], i);
+    wide.addWord(words[i], i);
+  }
+  narrow.freeze();
+  wide.freeze(NSL::Trie::Format::Wide);
+  ASSERT_EQ(narrow.format(), NSL::Trie::Format::Narrow);
+  ASSERT_EQ(wide.format(), NSL::Trie::Format::Wide);
+
+  std::stringstream s;
+  wide.writeToStream(s);
+  NSL::Trie loaded;
+  loaded.freeze();
+  loaded.loadFromStream(s);
+  ASSERT_EQ(loaded.format(), NSL::Trie::Format::Wide);
+
+  for (NSL::Trie* t : {&wide, &loaded}) {
+    for (uint32_t i = 0; i < words.size(); i++) {
+      ASSERT_EQ(t->findWord(words[i]), i);
+    }
+    ASSERT_EQ(t->findWord(NSL::String(u8"빨가")), NIME_TRIE_WORD_NOT_FOUND);
+
+    std::vector<NSL::Trie::WordIdPair> expected =
+        narrow.findWordPrefixes(NSL::String(u8"빨간색깔"));
+    std::vector<NSL::Trie::WordIdPair> prefixes =
+        t->findWordPrefixes(NSL::String(u8"빨간색깔"));
+    ASSERT_EQ(prefixes.size(), 3);
+    for (size_t i = 0; i < prefixes.size(); i++) {
+      ASSERT_EQ(prefixes[i].str, expected[i].str);
+      ASSERT_EQ(prefixes[i].id, expected[i].id);
+    }
+
+    uint32_t iterated = 0;
+    for (NSL::Trie::WordIdPair wip : *t) {
+      ASSERT_EQ(words[wip.id], wip.str);
+      iterated++;
+    }
+    ASSERT_EQ(iterated, words.size());
+  }
+
+  // a frozen trie can be edited again whatever its format
+  wide.makeEditable();
+  wide.addWord(NSL::String(u8"노랗"), 100);
+  wide.freeze();
+  ASSERT_EQ(wide.format(), NSL::Trie::Format::Narrow);
+  ASSERT_EQ(wide.findWord(NSL::String(u8"노랗")), 100);
+  ASSERT_EQ(wide.findWord(NSL::String(u8"빨간색")), 3);
+
+  NSL::Trie empty;
+  empty.freeze();
+  ASSERT_EQ(empty.findWord(NSL::String(u8"빨")), NIME_TRIE_WORD_NOT_FOUND);
+  ASSERT_FALSE(empty.begin() != empty.end());
+}
+
+TEST(Trie, manyWords) {
+  NSL::Trie t;
+  std::map<std::string, uint32_t> reference;
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < 20000; i++) {
+    NSL::String word = randomWord(seed);
+    bool replace = i % 3 != 0;
+    uint32_t expected = replace || !reference.count(word.toStdString())
+                            ? i
+                            : reference[word.toStdString()];
+    ASSERT_EQ(t.addWord(word, i, replace), expected);
+    reference[word.toStdString()] = expected;
+  }
+  t.freeze();
+
+  // editing a frozen trie again keeps every word
+  t.makeEditable();
+  t.freeze();
+
+  uint32_t iterated = 0;
+  for (NSL::Trie::WordIdPair wip : t) {
+    ASSERT_EQ(reference[wip.str.toStdString()], wip.id);
+    iterated++;
+  }
+  ASSERT_EQ(iterated, reference.size());
+  for (const auto& entry : reference) {
+    ASSERT_EQ(t.findWord(NSL::String(entry.first)), entry.second);
+  }
+}
+
+TEST(Trie, dawgFormat) {
+  // inflected forms share their endings
+  std::vector<std::string> stems = {u8"가", u8"먹", u8"읽", u8"잡", u8"찾",
+                                    u8"놓", u8"받", u8"웃", u8"씻", u8"걷"};
+  std::vector<std::string> endings = {u8"", u8"었다", u8"습니다", u8"는데",
+                                      u8"었습니다", u8"고", u8"지만"};
+  std::map<std::string, uint32_t> words;
+  NSL::Trie t, narrow;
+  for (const std::string& stem : stems) {
+    for (const std::string& ending : endings) {
+      uint32_t id = words.size() * 7 + 3;
+      words[stem + ending] = id;
+      t.addWord(NSL::String(stem + ending), id);
+      narrow.addWord(NSL::String(stem + ending), id);
+    }
+  }
+  t.freeze(NSL::Trie::Format::Dawg);
+  narrow.freeze();
+  ASSERT_EQ(t.format(), NSL::Trie::Format::Dawg);
+
+  std::stringstream dawgStream, narrowStream;
+  t.writeToStream(dawgStream);
+  narrow.writeToStream(narrowStream);
+  ASSERT_LT(dawgStream.str().size() * 2, narrowStream.str().size());
+
+  NSL::Trie loaded;
+  loaded.freeze();
+  loaded.loadFromStream(dawgStream);
+  ASSERT_EQ(loaded.format(), NSL::Trie::Format::Dawg);
+
+  for (NSL::Trie* trie : {&t, &loaded}) {
+    for (const auto& entry : words) {
+      ASSERT_EQ(trie->findWord(NSL::String(entry.first)), entry.second);
+    }
+    ASSERT_EQ(trie->findWord(NSL::String(u8"먹었")), NIME_TRIE_WORD_NOT_FOUND);
+
+    std::vector<NSL::Trie::WordIdPair> prefixes =
+        trie->findWordPrefixes(NSL::String(u8"먹었습니다만"));
+    ASSERT_EQ(prefixes.size(), 2);
+    ASSERT_EQ(prefixes[0].str, NSL::String(u8"먹"));
+    ASSERT_EQ(prefixes[0].id, words[u8"먹"]);
+    ASSERT_EQ(prefixes[1].str, NSL::String(u8"먹었습니다"));
+    ASSERT_EQ(prefixes[1].id, words[u8"먹었습니다"]);
+
+    size_t iterated = 0;
+    for (NSL::Trie::WordIdPair wip : *trie) {
+      ASSERT_EQ(words[wip.str.toStdString()], wip.id);
+      iterated++;
+    }
+    ASSERT_EQ(iterated, words.size());
+  }
+
+  t.makeEditable();
+  t.addWord(NSL::String(u8"노랗"), 1000);
+  t.freeze();
+  ASSERT_EQ(t.format(), NSL::Trie::Format::Narrow);
+  ASSERT_EQ(t.findWord(NSL::String(u8"노랗")), 1000);
+  ASSERT_EQ(t.findWord(NSL::String(u8"웃지만")), words[u8"웃지만"]);
+}
+
+TEST(Trie, loudsFormat) {
+  NSL::Trie t, narrow;
+  std::map<std::string, uint32_t> reference;
+  uint32_t seed = 7;
+  for (uint32_t i = 0; i < 20000; i++) {
+    NSL::String word = randomWord(seed);
+    t.addWord(word, i);
+    narrow.addWord(word, i);
+    reference[word.toStdString()] = i;
+  }
+  t.freeze(NSL::Trie::Format::Louds);
+  narrow.freeze();
+  ASSERT_EQ(t.format(), NSL::Trie::Format::Louds);
+
+  std::stringstream loudsStream, narrowStream;
+  t.writeToStream(loudsStream);
+  narrow.writeToStream(narrowStream);
+  std::string image = loudsStream.str();
+  ASSERT_LT(image.size(), narrowStream.str().size());
+
+  NSL::Trie loaded, mapped;
+  loaded.freeze();
+  loaded.loadFromStream(loudsStream);
+  mapped.mapImage(image.data());
+  ASSERT_EQ(mapped.format(), NSL::Trie::Format::Louds);
+
+  for (NSL::Trie* trie : {&t, &loaded, &mapped}) {
+    size_t iterated = 0;
+    for (NSL::Trie::WordIdPair wip : *trie) {
+      ASSERT_EQ(reference[wip.str.toStdString()], wip.id);
+      iterated++;
+    }
+    ASSERT_EQ(iterated, reference.size());
+    for (const auto& entry : reference) {
+      NSL::String word(entry.first);
+      ASSERT_EQ(trie->findWord(word), entry.second);
+
+      std::vector<NSL::Trie::WordIdPair> expected =
+          narrow.findWordPrefixes(word);
+      std::vector<NSL::Trie::WordIdPair> prefixes =
+          trie->findWordPrefixes(word);
+      ASSERT_EQ(prefixes.size(), expected.size());
+      for (size_t i = 0; i < prefixes.size(); i++) {
+        ASSERT_EQ(prefixes[i].str, expected[i].str);
+        ASSERT_EQ(prefixes[i].id, expected[i].id);
+      }
+    }
+  }
+
+  // a mapped image is copied when the trie is edited
+  mapped.makeEditable();
+  mapped.addWord(NSL::String(u8"노랗"), 100000);
+  mapped.freeze();
+  ASSERT_EQ(mapped.findWord(NSL::String(u8"노랗")), 100000);
+  ASSERT_EQ(mapped.findWord(NSL::String(reference.begin()->first)),
+            reference.begin()->second);
+
+  NSL::Trie narrowMapped;
+  std::string narrowImage = narrowStream.str();
+  narrowMapped.mapImage(narrowImage.data());
+  ASSERT_EQ(narrowMapped.format(), NSL::Trie::Format::Narrow);
+  ASSERT_EQ(narrowMapped.findWord(NSL::String(reference.begin()->first)),
+            reference.begin()->second);
+
+  // an unknown format leaves the mapped trie as it was
+  std::string unknown = loudsStream.str();
+  unknown[4] = 100;
+  ASSERT_THROW(narrowMapped.mapImage(unknown.data()), std::runtime_error);
+  ASSERT_EQ(narrowMapped.format(), NSL::Trie::Format::Narrow);
+  ASSERT_EQ(narrowMapped.findWord(NSL::String(reference.begin()->first)),
+            reference.begin()->second);
+
+  NSL::Trie empty;
+  empty.freeze(NSL::Trie::Format::Louds);
+  ASSERT_EQ(empty.findWord(NSL::String(u8"빨")), NIME_TRIE_WORD_NOT_FOUND);
+  ASSERT_FALSE(empty.begin() != empty.end());
+}
+
+TEST(Trie, findWordsWithin) {
+  NSL::Trie t;
+  t.addWord(NSL::String(u8"했다"), 0);
+  t.addWord(NSL::String(u8"했데"), 1);
+  t.addWord(NSL::String(u8"하다"), 2);
+  t.addWord(NSL::String(u8"한다"), 3);
+  t.addWord(NSL::String(u8"했"), 4);
+  t.addWord(NSL::String(u8"먹었다"), 5);
+  t.addWord(NSL::String(u8"해다"), 6);
+  t.freeze();
+
+  std::vector<NSL::Trie::WordIdDistance> found =
+      t.findWordsWithin(NSL::String(u8"했다"), 0);
+  ASSERT_EQ(found.size(), 1);
+  ASSERT_EQ(found[0].str, NSL::String(u8"했다"));
+  ASSERT_EQ(found[0].id, 0);
+  ASSERT_EQ(found[0].distance, 0);
+
+  // ㅏ/ㅔ and a dropped batchim are a single edit each, a whole syllable
+  // is three
+  found = t.findWordsWithin(NSL::String(u8"했다"), 1);
+  std::map<uint32_t, uint32_t> distances;
+  for (const NSL::Trie::WordIdDistance& wd : found) {
+    distances[wd.id] = wd.distance;
+  }
+  ASSERT_EQ(distances.size(), 3);
+  ASSERT_EQ(found[0].id, 0);
+  ASSERT_EQ(distances[1], 1);
+  ASSERT_EQ(distances[6], 1);
+
+  found = t.findWordsWithin(NSL::String(u8"핻데"), 2);
+  distances.clear();
+  for (const NSL::Trie::WordIdDistance& wd : found) {
+    distances[wd.id] = wd.distance;
+  }
+  ASSERT_EQ(distances.size(), 3);
+  ASSERT_EQ(distances[1], 1);
+  ASSERT_EQ(distances[0], 2);
+  ASSERT_EQ(distances[6], 2);
+  for (size_t i = 1; i < found.size(); i++) {
+    ASSERT_LE(found[i - 1].distance, found[i].distance);
+  }
+
+  found = t.findWordsWithin(NSL::String(u8"했다"), 3);
+  distances.clear();
+  for (const NSL::Trie::WordIdDistance& wd : found) {
+    distances[wd.id] = wd.distance;
+  }
+  ASSERT_EQ(distances[4], 3);
+  ASSERT_EQ(distances[2], 2);
+  ASSERT_EQ(distances[3], 2);
+  ASSERT_EQ(distances.count(5), 0);
+
+  // every format gives the same answer
+  NSL::Trie louds;
+  louds.addWord(NSL::String(u8"했다"), 0);
+  louds.addWord(NSL::String(u8"해다"), 2);
+  louds.freeze(NSL::Trie::Format::Louds);
+  found = louds.findWordsWithin(NSL::String(u8"했다"), 1);
+  ASSERT_EQ(found.size(), 2);
+  ASSERT_EQ(found[1].id, 2);
+  ASSERT_EQ(found[1].distance, 1);
+}
+
+TEST(Trie, findPattern) {
+  typedef NSL::Character::HangulJamo Jamo;
+  NSL::Trie t;
+  t.addWord(NSL::String(u8"하"), 0);
+  t.addWord(NSL::String(u8"한"), 1);
+  t.addWord(NSL::String(u8"할"), 2);
+  t.addWord(NSL::String(u8"함"), 3);
+  t.addWord(NSL::String(u8"해"), 4);
+  t.addWord(NSL::String(u8"한다"), 5);
+  t.addWord(NSL::String(u8"하다"), 6);
+  t.addWord(NSL::String(u8"허다"), 7);
+  NSL::String mixed(u8"a하b하c");
+  mixed.encapsulateNonHangul();
+  t.addWord(mixed, 8);
+  t.addWord(NSL::String(u8"하다가"), 9);
+  t.freeze();
+
+  // 하 with any batchim
+  std::vector<NSL::Trie::WordIdPair> found =
+      t.findPattern({{Jamo::Hieut, Jamo::A, Jamo::Any}});
+  std::map<uint32_t, std::string> ids;
+  for (const NSL::Trie::WordIdPair& wip : found) {
+    ids[wip.id] = wip.str.toStdString();
+  }
+  ASSERT_EQ(ids.size(), 4);
+  ASSERT_EQ(ids[0], u8"하");
+  ASSERT_EQ(ids[1], u8"한");
+  ASSERT_EQ(ids[2], u8"할");
+  ASSERT_EQ(ids[3], u8"함");
+
+  // only without a batchim
+  found = t.findPattern({{Jamo::Hieut, Jamo::A, Jamo::None}});
+  ASSERT_EQ(found.size(), 1);
+  ASSERT_EQ(found[0].id, 0);
+
+  // any vowel followed by 다
+  found = t.findPattern({{Jamo::Hieut, Jamo::Any, Jamo::None},
+                         {Jamo::Digeut, Jamo::A, Jamo::None}});
+  ids.clear();
+  for (const NSL::Trie::WordIdPair& wip : found) ids[wip.id] = "";
+  ASSERT_EQ(ids.size(), 2);
+  ASSERT_EQ(ids.count(6), 1);
+  ASSERT_EQ(ids.count(7), 1);
+
+  found = t.findPattern(
+      {{Jamo::Any, Jamo::Any, Jamo::Any}, {Jamo::Any, Jamo::Any, Jamo::Any}});
+  ASSERT_EQ(found.size(), 3);
+
+  // wildcards only match jamo, not the non Hangul characters of a word as
+  // long as three syllables
+  found = t.findPattern({{Jamo::Any, Jamo::Any, Jamo::Any},
+                         {Jamo::Any, Jamo::Any, Jamo::Any},
+                         {Jamo::Any, Jamo::Any, Jamo::Any}});
+  ASSERT_EQ(found.size(), 1);
+  ASSERT_EQ(found[0].id, 9);
+
+  ASSERT_TRUE(t.findPattern({{Jamo::Kieuk, Jamo::A, Jamo::Any}}).empty());
+  ASSERT_THROW(t.findPattern({{Jamo::A, Jamo::A, Jamo::None}}),
+               std::invalid_argument);
+}
+
+TEST(Trie, complete) {
+  NSL::Trie t;
+  t.addWord(NSL::String(u8"빨"), 0);
+  t.addWord(NSL::String(u8"빨갛"), 1);
+  t.addWord(NSL::String(u8"빨간"), 2);
+  t.addWord(NSL::String(u8"빨간색"), 3);
+  t.addWord(NSL::String(u8"빨래"), 4);
+  t.addWord(NSL::String(u8"파랗"), 5);
+  t.addWord(NSL::String(u8"파란"), 6);
+  t.freeze();
+  t.setScores({0.5f, 0.1f, 0.7f, 0.9f, 0.3f, 1.0f});
+
+  std::vector<NSL::Trie::WordIdPair> completions =
+      t.complete(NSL::String(u8"빨"), 3);
+  ASSERT_EQ(completions.size(), 3);
+  ASSERT_EQ(completions[0].id, 3);
+  ASSERT_EQ(completions[0].str, NSL::String(u8"빨간색"));
+  ASSERT_EQ(completions[1].id, 2);
+  ASSERT_EQ(completions[2].id, 0);
+
+  // the prefix can end inside a node's label
+  completions = t.complete(NSL::String(u8"빨간"), 10);
+  ASSERT_EQ(completions.size(), 2);
+  ASSERT_EQ(completions[0].id, 3);
+  ASSERT_EQ(completions[1].id, 2);
+
+  // words without a score come last
+  completions = t.complete(NSL::String(u8"파"), 10);
+  ASSERT_EQ(completions.size(), 2);
+  ASSERT_EQ(completions[0].id, 5);
+  ASSERT_EQ(completions[1].id, 6);
+
+  completions = t.complete(NSL::String(u8""), 1);
+  ASSERT_EQ(completions.size(), 1);
+  ASSERT_EQ(completions[0].id, 5);
+  ASSERT_TRUE(t.complete(NSL::String(u8"노"), 5).empty());
+
+  // changed scores are picked up, in every format
+  t.setScores({0.5f, 0.1f, 0.7f, 0.9f, 0.3f, 1.0f, 2.0f});
+  ASSERT_EQ(t.complete(NSL::String(u8"파"), 1)[0].id, 6);
+  for (NSL::Trie::Format format :
+       {NSL::Trie::Format::Wide, NSL::Trie::Format::Dawg,
+        NSL::Trie::Format::Louds}) {
+    t.makeEditable();
+    t.freeze(format);
+    completions = t.complete(NSL::String(u8"빨"), 5);
+    ASSERT_EQ(completions.size(), 5);
+    ASSERT_EQ(completions[0].id, 3);
+    ASSERT_EQ(completions[4].id, 1);
+  }
+
+  NSL::Trie empty;
+  empty.freeze();
+  ASSERT_TRUE(empty.complete(NSL::String(u8""), 5).empty());
+}
+
+TEST(Trie, forEach) {
+  NSL::Trie t;
+  std::map<std::string, uint32_t> reference;
+  uint32_t seed = 3;
+  for (uint32_t i = 0; i < 5000; i++) {
+    NSL::String word = randomWord(seed);
+    t.addWord(word, i);
+    reference[word.toStdString()] = i;
+  }
+  t.freeze();
+
+  std::vector<NSL::Trie::WordIdPair> iterated;
+  for (NSL::Trie::WordIdPair wip : t) iterated.push_back(wip);
+  ASSERT_EQ(iterated.size(), reference.size());
+
+  // forEach visits the same words in the same order
+  size_t visited = 0;
+  t.forEach([&](const std::string& jamo, uint32_t id) {
+    ASSERT_LT(visited, iterated.size());
+    ASSERT_EQ(NSL::String(NSL::HangulString(jamo)), iterated[visited].str);
+    ASSERT_EQ(id, iterated[visited].id);
+    visited++;
+  });
+  ASSERT_EQ(visited, reference.size());
+
+  // a copy stays where it was
+  NSL::Trie::Iterator it = t.begin();
+  NSL::Trie::Iterator copy = it;
+  ++it;
+  ASSERT_EQ((*copy).id, iterated[0].id);
+  ASSERT_EQ((*it).id, iterated[1].id);
+  ++copy;
+  ASSERT_FALSE(copy != it);
+  it = it + 3;
+  ASSERT_EQ((*it).id, iterated[4].id);
+
+  NSL::Trie empty;
+  empty.freeze();
+  empty.forEach([](const std::string&, uint32_t) { FAIL(); });
+}
+
+TEST(Trie, partition) {
+  NSL::Trie t;
+  uint32_t seed = 5;
+  for (uint32_t i = 0; i < 5000; i++) t.addWord(randomWord(seed), i);
+  t.freeze();
+
+  for (NSL::Trie::Format format :
+       {NSL::Trie::Format::Narrow, NSL::Trie::Format::Dawg,
+        NSL::Trie::Format::Louds}) {
+    t.makeEditable();
+    t.freeze(format);
+    std::vector<NSL::Trie::WordIdPair> iterated;
+    for (NSL::Trie::WordIdPair wip : t) iterated.push_back(wip);
+
+    // the ranges together are the whole trie, in order
+    for (size_t rangesNo : {1, 3, 16, 1000}) {
+      std::vector<NSL::Trie::Range> ranges = t.partition(rangesNo);
+      ASSERT_EQ(ranges.size(), rangesNo);
+      size_t i = 0;
+      for (const NSL::Trie::Range& range : ranges) {
+        size_t words = 0;
+        for (NSL::Trie::WordIdPair wip : range) {
+          ASSERT_LT(i, iterated.size());
+          ASSERT_EQ(wip.str, iterated[i].str);
+          ASSERT_EQ(wip.id, iterated[i].id);
+          i++;
+          words++;
+        }
+        ASSERT_GT(words, 0);
+      }
+      ASSERT_EQ(i, iterated.size());
+    }
+
+    // and can be iterated at the same time
+    std::vector<NSL::Trie::Range> ranges = t.partition(4);
+    std::vector<size_t> counts(ranges.size());
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < ranges.size(); r++) {
+      threads.emplace_back([&, r]() {
+        for (NSL::Trie::WordIdPair wip : ranges[r]) counts[r]++;
+      });
+    }
+    for (std::thread& thread : threads) thread.join();
+    size_t total = 0;
+    for (size_t count : counts) total += count;
+    ASSERT_EQ(total, iterated.size());
+  }
+
+  NSL::Trie small;
+  small.addWord(NSL::String(u8"빨"), 0);
+  small.addWord(NSL::String(u8"파"), 1);
+  small.freeze();
+  ASSERT_EQ(small.partition(8).size(), 2);
+  ASSERT_THROW(small.partition(0), std::invalid_argument);
+
+  NSL::Trie empty;
+  empty.freeze();
+  ASSERT_TRUE(empty.partition(4).empty());
+}
+
+TEST(Trie, wordForId) {
+  NSL::Trie t;
+  uint32_t seed = 7;
+  std::map<std::string, uint32_t> ids;
+  for (uint32_t i = 0; i < 3000; i++) {
+    // sparse ids
+    ids[randomWord(seed).toStdString()] = i * 7;
+  }
+  std::map<uint32_t, NSL::String> words;
+  for (const auto& entry : ids) {
+    t.addWord(NSL::String(entry.first), entry.second);
+    words[entry.second] = NSL::String(entry.first);
+  }
+  t.addWord(NSL::String(u8"빨"), 100000);
+  t.addWord(NSL::String(u8"빨간"), 100001);
+  words[100000] = NSL::String(u8"빨");
+  words[100001] = NSL::String(u8"빨간");
+
+  for (NSL::Trie::Format format :
+       {NSL::Trie::Format::Narrow, NSL::Trie::Format::Wide,
+        NSL::Trie::Format::Dawg, NSL::Trie::Format::Louds}) {
+    t.freeze(format);
+    for (const auto& entry : words) {
+      ASSERT_EQ(t.wordForId(entry.first), entry.second);
+    }
+    ASSERT_EQ(t.wordForId(1), NSL::String());
+    ASSERT_EQ(t.wordForId(200000), NSL::String());
+    t.makeEditable();
+  }
+  ASSERT_EQ(t.wordForId(0), NSL::String());
+
+  // the index follows changes of the trie
+  t.addWord(NSL::String(u8"파랗"), 100000);
+  t.freeze();
+  ASSERT_EQ(t.wordForId(100000), NSL::String(u8"빨"));
+}
+
+TEST(Trie, values) {
+  NSL::Trie t;
+  t.addWordValues(NSL::String(u8"빨"), {1});
+  t.addWordValues(NSL::String(u8"빨간"), {2, 3, 4});
+  t.addWordValues(NSL::String(u8"빨간색"), {5, 6});
+  t.addWordValues(NSL::String(u8"파란"), {});
+  // adding a word again replaces its values
+  t.addWordValues(NSL::String(u8"빨간색"), {7, 8});
+  ASSERT_TRUE(t.findWordValues(NSL::String(u8"빨")).empty());
+  t.freeze();
+
+  NSL::Trie::Values values = t.findWordValues(NSL::String(u8"빨간"));
+  ASSERT_EQ(std::vector<uint32_t>(values.begin(), values.end()),
+            std::vector<uint32_t>({2, 3, 4}));
+  ASSERT_EQ(t.findWordValues(NSL::String(u8"빨간색")).size, 2);
+  ASSERT_EQ(t.findWordValues(NSL::String(u8"빨간색"))[0], 7);
+  ASSERT_TRUE(t.findWordValues(NSL::String(u8"파란")).empty());
+  ASSERT_TRUE(t.findWordValues(NSL::String(u8"빨가")).empty());
+
+  // the id of a word is the index of its values
+  uint32_t id = t.findWord(NSL::String(u8"빨"));
+  ASSERT_EQ(t.values(id).size, 1);
+  ASSERT_EQ(t.values(id)[0], 1);
+  ASSERT_TRUE(t.values(100).empty());
+
+  std::vector<NSL::Trie::WordValuesPair> prefixes =
+      t.findWordPrefixValues(NSL::String(u8"빨간색깔"));
+  ASSERT_EQ(prefixes.size(), 3);
+  ASSERT_EQ(prefixes[0].str, NSL::String(u8"빨"));
+  ASSERT_EQ(prefixes[1].values.size, 3);
+  ASSERT_EQ(prefixes[2].values[1], 8);
+
+  for (NSL::Trie::Format format :
+       {NSL::Trie::Format::Narrow, NSL::Trie::Format::Dawg,
+        NSL::Trie::Format::Louds}) {
+    t.makeEditable();
+    t.freeze(format);
+    std::stringstream s;
+    t.writeToStream(s);
+    std::string image = s.str();
+
+    NSL::Trie loaded;
+    loaded.freeze();
+    loaded.loadFromStream(s);
+    NSL::Trie mapped;
+    mapped.mapImage(image.data());
+    for (NSL::Trie* trie : {&t, &loaded, &mapped}) {
+      values = trie->findWordValues(NSL::String(u8"빨간"));
+      ASSERT_EQ(std::vector<uint32_t>(values.begin(), values.end()),
+                std::vector<uint32_t>({2, 3, 4}));
+      ASSERT_EQ(trie->findWordValues(NSL::String(u8"빨간색"))[1], 8);
+      ASSERT_TRUE(trie->findWordValues(NSL::String(u8"파란")).empty());
+    }
+
+    // a mapped trie keeps its values when made editable
+    mapped.makeEditable();
+    mapped.addWordValues(NSL::String(u8"노랗"), {9});
+    mapped.freeze();
+    ASSERT_EQ(mapped.findWordValues(NSL::String(u8"빨"))[0], 1);
+    ASSERT_EQ(mapped.findWordValues(NSL::String(u8"노랗"))[0], 9);
+
+    // a truncated stream leaves the loaded trie as it was
+    for (size_t length : {image.size() / 2, image.size() - 1}) {
+      std::stringstream truncated(image.substr(0, length));
+      ASSERT_THROW(mapped.loadFromStream(truncated), std::ios_base::failure);
+      ASSERT_EQ(mapped.findWordValues(NSL::String(u8"노랗"))[0], 9);
+      ASSERT_EQ(mapped.findWordValues(NSL::String(u8"빨간색"))[1], 8);
+    }
+  }
+}
+
+TEST(Trie, valuesMixedWithIds) {
+  NSL::Trie t;
+  t.addWordValues(NSL::String(u8"빨간"), {1, 2});
+  ASSERT_THROW(t.addWord(NSL::String(u8"파란"), 0), std::invalid_argument);
+  t.freeze();
+  ASSERT_EQ(t.findWord(NSL::String(u8"파란")), NIME_TRIE_WORD_NOT_FOUND);
+
+  // the values survive a round trip through editing mode
+  t.makeEditable();
+  ASSERT_THROW(t.addWord(NSL::String(u8"파란"), 0), std::invalid_argument);
+  t.addWordValues(NSL::String(u8"파란"), {3});
+  t.freeze();
+  ASSERT_EQ(t.findWordValues(NSL::String(u8"빨간"))[1], 2);
+  ASSERT_EQ(t.findWordValues(NSL::String(u8"파란"))[0], 3);
+
+  NSL::Trie ids;
+  ids.addWord(NSL::String(u8"빨간"), 7);
+  ASSERT_THROW(ids.addWordValues(NSL::String(u8"파란"), {3}),
+               std::invalid_argument);
+  ids.freeze();
+  ASSERT_EQ(ids.findWord(NSL::String(u8"빨간")), 7);
+  ASSERT_TRUE(ids.findWordValues(NSL::String(u8"빨간")).empty());
+}
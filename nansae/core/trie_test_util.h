@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NSL_TRIE_TEST_UTIL_H
+#define NSL_TRIE_TEST_UTIL_H
+
+#include <cstdint>
+#include <string>
+
+#include "nansae/core/string.h"
+
+/**
+ * Returns a pseudo random word of one to four Hangul syllables drawn from a
+ * small set, so that the words share many prefixes.
+ */
+inline NSL::String randomWord(uint32_t& seed) {
+  std::string word;
+  seed = seed * 1103515245 + 12345;
+  unsigned length = 1 + (seed >> 16) % 4;
+  for (unsigned i = 0; i < length; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t syllable = 0xac00 + ((seed >> 16) % 12) * 28 + (seed >> 8) % 3;
+    word += (char)(0xe0 | (syllable >> 12));
+    word += (char)(0x80 | ((syllable >> 6) & 0x3f));
+    word += (char)(0x80 | (syllable & 0x3f));
+  }
+  return NSL::String(word);
+}
+
+#endif  // NSL_TRIE_TEST_UTIL_H
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2015-2017 Daniel Shihoon Lee <daniel@nansae.im>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+%{
+#include "nansae/core/group_hash_table.h"
+%}
+
+
+%rename("GroupHashTableUInt32_Entry") NSL::GroupHashTable<uint32_t>::Entry;
+%rename("GroupHashTableUInt64_Entry") NSL::GroupHashTable<uint64_t>::Entry;
+%rename("GroupHashTableUInt32_Iterator") NSL::GroupHashTable<uint32_t>::Iterator;
+%rename("GroupHashTableUInt64_Iterator") NSL::GroupHashTable<uint64_t>::Iterator;
+
+%include "nansae/core/group_hash_table.h"
+
+%template(GroupHashTableUInt32) NSL::GroupHashTable<uint32_t>;
+%template(GroupHashTableUInt64) NSL::GroupHashTable<uint64_t>;
+
+
+%pythoncode %{
+GroupHashTableUInt32_Iterator.entry = property(lambda self: self.__deref__())
+GroupHashTableUInt64_Iterator.entry = property(lambda self: self.__deref__())
+%}
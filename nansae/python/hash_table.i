@@ -23,14 +23,22 @@
 %rename("HashTableUInt64_Entry") NSL::HashTable<uint64_t>::Entry;
 %rename("HashTableUInt32_Iterator") NSL::HashTable<uint32_t>::Iterator;
 %rename("HashTableUInt64_Iterator") NSL::HashTable<uint64_t>::Iterator;
+%rename("HashTableUInt32Float_Entry") NSL::HashTable<uint32_t, float>::Entry;
+%rename("HashTableUInt64Float_Entry") NSL::HashTable<uint64_t, float>::Entry;
+%rename("HashTableUInt32Float_Iterator") NSL::HashTable<uint32_t, float>::Iterator;
+%rename("HashTableUInt64Float_Iterator") NSL::HashTable<uint64_t, float>::Iterator;
 
 %include "nansae/core/hash_table.h"
 
 %template(HashTableUInt32) NSL::HashTable<uint32_t>;
 %template(HashTableUInt64) NSL::HashTable<uint64_t>;
+%template(HashTableUInt32Float) NSL::HashTable<uint32_t, float>;
+%template(HashTableUInt64Float) NSL::HashTable<uint64_t, float>;
 
 
 %pythoncode %{
 HashTableUInt32_Iterator.entry = property(lambda self: self.__deref__())
 HashTableUInt64_Iterator.entry = property(lambda self: self.__deref__())
+HashTableUInt32Float_Iterator.entry = property(lambda self: self.__deref__())
+HashTableUInt64Float_Iterator.entry = property(lambda self: self.__deref__())
 %}
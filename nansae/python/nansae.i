@@ -27,5 +27,6 @@
 %include "nansae/python/character.i"
 %include "nansae/python/string.i"
 %include "nansae/python/hash_table.i"
+%include "nansae/python/group_hash_table.i"
 %include "nansae/python/trie.i"
 %include "nansae/python/segmentations.i"